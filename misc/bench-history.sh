@@ -0,0 +1,71 @@
+#!/bin/sh
+# Compares HISTORY with text actions and DATETIME dates against action codes and epochs: database
+# size and the time of the date range and action filters of the history page, on ROWS generated rows.
+# Usage: misc/bench-history.sh [rows]
+set -e
+
+ROWS=${1:-1000000}
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+
+cat > "$DIR/before.sql" <<EOF
+CREATE TABLE ACTION (actionName TEXT PRIMARY KEY NOT NULL);
+INSERT INTO ACTION VALUES ('ADD'), ('REMOVE'), ('EDIT'), ('QUERY'), ('LOGIN'), ('LOGOUT'), ('SIGNUP'), ('BORROW'), ('RETURN');
+CREATE TABLE HISTORY
+(
+    UUID TEXT DEFAULT NULL, UUID_ISSUER TEXT DEFAULT NULL, serialnum TEXT DEFAULT NULL, IP TEXT DEFAULT NULL,
+    action TEXT NOT NULL REFERENCES ACTION (actionName), actiondate DATETIME NOT NULL, details TEXT DEFAULT NULL
+);
+WITH RECURSIVE n(i) AS (SELECT 0 UNION ALL SELECT i + 1 FROM n WHERE i + 1 < $ROWS)
+INSERT INTO HISTORY (UUID, IP, action, actiondate, details)
+SELECT 'user' || (i % 500), '10.0.0.' || (i % 250), (SELECT actionName FROM ACTION WHERE rowid = i % 9 + 1),
+       datetime(1700000000 + i * 30, 'unixepoch', 'localtime'), NULL
+FROM n;
+CREATE INDEX HISTORY_ACTIONDATE ON HISTORY (actiondate);
+EOF
+
+cat > "$DIR/after.sql" <<EOF
+CREATE TABLE ACTION (actionCode INTEGER PRIMARY KEY NOT NULL, actionName TEXT UNIQUE NOT NULL);
+INSERT INTO ACTION VALUES (1, 'ADD'), (2, 'REMOVE'), (3, 'EDIT'), (4, 'QUERY'), (5, 'LOGIN'), (6, 'LOGOUT'),
+                          (7, 'SIGNUP'), (8, 'BORROW'), (9, 'RETURN');
+CREATE TABLE HISTORY
+(
+    UUID TEXT DEFAULT NULL, UUID_ISSUER TEXT DEFAULT NULL, serialnum TEXT DEFAULT NULL, IP TEXT DEFAULT NULL,
+    action INTEGER NOT NULL REFERENCES ACTION (actionCode), actiontime INTEGER NOT NULL, details TEXT DEFAULT NULL
+);
+WITH RECURSIVE n(i) AS (SELECT 0 UNION ALL SELECT i + 1 FROM n WHERE i + 1 < $ROWS)
+INSERT INTO HISTORY (UUID, IP, action, actiontime, details)
+SELECT 'user' || (i % 500), '10.0.0.' || (i % 250), i % 9 + 1, 1700000000 + i * 30, NULL
+FROM n;
+CREATE INDEX HISTORY_ACTIONTIME ON HISTORY (actiontime);
+EOF
+
+# A tenth of the rows in the middle of the range, the same instants for both schemas
+LOWER=$((1700000000 + ROWS * 30 * 4 / 10))
+UPPER=$((1700000000 + ROWS * 30 * 5 / 10))
+
+cat > "$DIR/before-bench.sql" <<EOF
+.timer on
+SELECT count(*) FROM HISTORY
+WHERE actiondate >= datetime($LOWER, 'unixepoch', 'localtime') AND actiondate <= datetime($UPPER, 'unixepoch', 'localtime');
+SELECT count(*) FROM HISTORY
+WHERE action = 'BORROW' AND actiondate >= datetime($LOWER, 'unixepoch', 'localtime')
+  AND actiondate <= datetime($UPPER, 'unixepoch', 'localtime');
+SELECT strftime('%Y-%m', actiondate), count(*) FROM HISTORY GROUP BY 1 ORDER BY 1 LIMIT 1;
+EOF
+
+cat > "$DIR/after-bench.sql" <<EOF
+.timer on
+SELECT count(*) FROM HISTORY WHERE actiontime >= $LOWER AND actiontime <= $UPPER;
+SELECT count(*) FROM HISTORY
+WHERE action = (SELECT actionCode FROM ACTION WHERE actionName = 'BORROW') AND actiontime >= $LOWER
+  AND actiontime <= $UPPER;
+SELECT strftime('%Y-%m', actiontime, 'unixepoch', 'localtime'), count(*) FROM HISTORY GROUP BY 1 ORDER BY 1 LIMIT 1;
+EOF
+
+for schema in before after; do
+    sqlite3 "$DIR/$schema.db" < "$DIR/$schema.sql"
+    sqlite3 "$DIR/$schema.db" "VACUUM;"
+    echo "== $schema: $(wc -c < "$DIR/$schema.db") bytes for $ROWS rows"
+    sqlite3 "$DIR/$schema.db" < "$DIR/$schema-bench.sql"
+done
@@ -16,19 +16,20 @@ VALUES ('Brian Wilson Kernighan'),
        ('Dennis M Ritchie');
 CREATE TABLE ACTION
 (
-    actionName TEXT PRIMARY KEY NOT NULL
+    actionCode INTEGER PRIMARY KEY NOT NULL,
+    actionName TEXT UNIQUE NOT NULL
 );
 
 INSERT INTO ACTION
-VALUES ('ADD'),
-       ('REMOVE'),
-       ('EDIT'),
-       ('QUERY'),
-       ('LOGIN'),
-       ('LOGOUT'),
-       ('SIGNUP'),
-       ('BORROW'),
-       ('RETURN');
+VALUES (1, 'ADD'),
+       (2, 'REMOVE'),
+       (3, 'EDIT'),
+       (4, 'QUERY'),
+       (5, 'LOGIN'),
+       (6, 'LOGOUT'),
+       (7, 'SIGNUP'),
+       (8, 'BORROW'),
+       (9, 'RETURN');
 
 CREATE TABLE LANG
 (
@@ -109,6 +110,7 @@ CREATE TABLE SESSIONS
     sessionID TEXT     NOT NULL UNIQUE,
     expiresAt DATETIME NOT NULL
 );
+CREATE INDEX SESSIONS_EXPIRES ON SESSIONS (expiresAt);
 INSERT INTO ACCOUNT
 VALUES ('teto', 'Administrator Kasane Teto',
         '$argon2id$v=19$m=47104,t=1,p=2$ekVIR1hycXl0Rk9hb0l6Qg$a4F4t8KwYTGXFprw2mI1xdIYtNsir9TWMpCO89v26e8', 'El Kseur',
@@ -125,13 +127,16 @@ CREATE TABLE BOOK
     bookreleaseyear INTEGER          NOT NULL,
     bookcover       BLOB,
     description     TEXT,
-    hits            INTEGER DEFAULT 0 CHECK (hits >= 0)
+    hits            INTEGER DEFAULT 0 CHECK (hits >= 0),
+    searchkey       TEXT    DEFAULT NULL,
+    bookid          INTEGER UNIQUE DEFAULT NULL,
+    viewers         INTEGER DEFAULT 0 CHECK (viewers >= 0)
 );
 Insert INTO BOOK
 VALUES ('9780131101630', 'Book', '00', 'Longman Publishing',
         'The C Programming Language', 1978, '9780131101630.jpg',
         'Known as the bible of C, this classic bestseller introduces the C programming language and illustrates ' ||
-        'algorithms, data structures, and programming techniques.', 0);
+        'algorithms, data structures, and programming techniques.', 0, NULL, 1, 0);
 
 CREATE TABLE LANGUAGES
 (
@@ -172,10 +177,20 @@ CREATE TABLE INVENTORY
     UUID         TEXT     NOT NULL REFERENCES ACCOUNT (UUID) ON UPDATE CASCADE ON DELETE CASCADE,
     serialnum    TEXT     NOT NULL REFERENCES BOOK (serialnum) ON UPDATE CASCADE ON DELETE CASCADE,
     rentduration INTEGER  NOT NULL CHECK (rentduration > 0),
-    rentdate     DATETIME NOT NULL,
+    rentdate     INTEGER  NOT NULL, -- epoch
     extended     BOOLEAN  NOT NULL,
+    -- Campus the copy was lent from
+    campus       TEXT     NOT NULL REFERENCES CAMPUS (campusName) ON UPDATE CASCADE ON DELETE CASCADE,
+    -- rentdate + rentduration days, computed when read and kept up to date in INVENTORY_DUEDATE
+    duedate      INTEGER  GENERATED ALWAYS AS (rentdate + rentduration * 86400) VIRTUAL,
     UNIQUE (UUID, serialnum)
 );
+-- The overdue report of a campus is read in this order, see query.c
+CREATE INDEX INVENTORY_DUEDATE ON INVENTORY (campus, duedate, UUID, serialnum);
+CREATE VIEW INVENTORYTEXT AS
+SELECT UUID, serialnum, rentduration, datetime(rentdate, 'unixepoch', 'localtime') AS rentdate, extended,
+       campus, datetime(duedate, 'unixepoch', 'localtime') AS duedate, rentdate AS renttime, duedate AS duetime
+FROM INVENTORY;
 
 
 CREATE TABLE HISTORY
@@ -184,7 +199,323 @@ CREATE TABLE HISTORY
     UUID_ISSUER TEXT DEFAULT NULL,
     serialnum   TEXT DEFAULT NULL,
     IP          TEXT DEFAULT NULL,
-    action      TEXT     NOT NULL REFERENCES ACTION (actionName) ON UPDATE CASCADE ON DELETE CASCADE,
-    actiondate  DATETIME NOT NULL,
-    details     TEXT DEFAULT NULL
+    action      INTEGER  NOT NULL REFERENCES ACTION (actionCode) ON UPDATE CASCADE ON DELETE CASCADE,
+    actiontime  INTEGER  NOT NULL, -- epoch
+    details     TEXT DEFAULT NULL,
+    -- Reads logged by query and search have JSON details, see audit.h
+    querypage      TEXT GENERATED ALWAYS AS (CASE WHEN json_valid(details) THEN json_extract(details, '$.page') END) VIRTUAL,
+    queryserialnum TEXT GENERATED ALWAYS AS (CASE WHEN json_valid(details) THEN json_extract(details, '$.serialnum') END) VIRTUAL
 );
+CREATE INDEX HISTORY_ACTIONTIME ON HISTORY (actiontime);
+CREATE INDEX HISTORY_UUID ON HISTORY (UUID);
+CREATE INDEX HISTORY_SERIALNUM ON HISTORY (serialnum);
+CREATE INDEX HISTORY_QUERYPAGE ON HISTORY (querypage);
+CREATE INDEX HISTORY_QUERYSERIALNUM ON HISTORY (queryserialnum);
+-- HISTORY as the history page shows it, action names and local dates
+CREATE VIEW HISTORYTEXT AS
+SELECT H.UUID, UUID_ISSUER, serialnum, IP, actionName AS action,
+       datetime(actiontime, 'unixepoch', 'localtime') AS actiondate, details, querypage, queryserialnum, actiontime,
+       H.action AS actioncode
+FROM HISTORY H
+         JOIN ACTION ON actionCode = H.action;
+
+CREATE TABLE AUDITINGEST
+(
+    file   TEXT    NOT NULL PRIMARY KEY,
+    offset INTEGER NOT NULL
+);
+
+CREATE TABLE SEARCHWORD
+(
+    word      TEXT NOT NULL,
+    serialnum TEXT NOT NULL REFERENCES BOOK (serialnum) ON UPDATE CASCADE ON DELETE CASCADE,
+    PRIMARY KEY (word, serialnum)
+) WITHOUT ROWID;
+CREATE INDEX SEARCHWORD_SERIALNUM ON SEARCHWORD (serialnum);
+
+CREATE TABLE WORDGRAM
+(
+    gram TEXT NOT NULL,
+    word TEXT NOT NULL,
+    PRIMARY KEY (gram, word)
+) WITHOUT ROWID;
+
+-- Trigram index of BOOK.searchkey, the exact search GLOBs it (see search.c) instead of scanning BOOK.
+-- The content stays in BOOK, rows are keyed by bookid and kept by the triggers below.
+CREATE VIRTUAL TABLE SEARCHKEYFTS USING fts5(searchkey, content = 'BOOK', content_rowid = 'bookid', tokenize = 'trigram');
+CREATE TRIGGER BOOK_INSERT_SEARCHKEYFTS AFTER INSERT ON BOOK WHEN NEW.bookid IS NOT NULL AND NEW.searchkey IS NOT NULL
+BEGIN INSERT INTO SEARCHKEYFTS (rowid, searchkey) VALUES (NEW.bookid, NEW.searchkey); END;
+CREATE TRIGGER BOOK_DELETE_SEARCHKEYFTS AFTER DELETE ON BOOK WHEN OLD.bookid IS NOT NULL AND OLD.searchkey IS NOT NULL
+BEGIN INSERT INTO SEARCHKEYFTS (SEARCHKEYFTS, rowid, searchkey) VALUES ('delete', OLD.bookid, OLD.searchkey); END;
+CREATE TRIGGER BOOK_UPDATE_SEARCHKEYFTS AFTER UPDATE OF bookid, searchkey ON BOOK
+BEGIN
+    INSERT INTO SEARCHKEYFTS (SEARCHKEYFTS, rowid, searchkey)
+    SELECT 'delete', OLD.bookid, OLD.searchkey WHERE OLD.bookid IS NOT NULL AND OLD.searchkey IS NOT NULL;
+    INSERT INTO SEARCHKEYFTS (rowid, searchkey)
+    SELECT NEW.bookid, NEW.searchkey WHERE NEW.bookid IS NOT NULL AND NEW.searchkey IS NOT NULL;
+END;
+
+CREATE TABLE CATALOGVERSION
+(
+    version INTEGER NOT NULL DEFAULT 0
+);
+INSERT INTO CATALOGVERSION
+VALUES (0);
+
+CREATE TRIGGER BOOK_INSERT_VERSION AFTER INSERT ON BOOK
+BEGIN UPDATE CATALOGVERSION SET version = version + 1; END;
+CREATE TRIGGER BOOK_DELETE_VERSION AFTER DELETE ON BOOK
+BEGIN UPDATE CATALOGVERSION SET version = version + 1; END;
+CREATE TRIGGER BOOK_UPDATE_VERSION AFTER UPDATE OF serialnum, type, category, publisher, booktitle, bookreleaseyear,
+    bookcover, description, searchkey ON BOOK
+BEGIN UPDATE CATALOGVERSION SET version = version + 1; END;
+CREATE TRIGGER AUTHORED_INSERT_VERSION AFTER INSERT ON AUTHORED
+BEGIN UPDATE CATALOGVERSION SET version = version + 1; END;
+CREATE TRIGGER AUTHORED_DELETE_VERSION AFTER DELETE ON AUTHORED
+BEGIN UPDATE CATALOGVERSION SET version = version + 1; END;
+CREATE TRIGGER AUTHORED_UPDATE_VERSION AFTER UPDATE ON AUTHORED
+BEGIN UPDATE CATALOGVERSION SET version = version + 1; END;
+CREATE TRIGGER LANGUAGES_INSERT_VERSION AFTER INSERT ON LANGUAGES
+BEGIN UPDATE CATALOGVERSION SET version = version + 1; END;
+CREATE TRIGGER LANGUAGES_DELETE_VERSION AFTER DELETE ON LANGUAGES
+BEGIN UPDATE CATALOGVERSION SET version = version + 1; END;
+CREATE TRIGGER LANGUAGES_UPDATE_VERSION AFTER UPDATE ON LANGUAGES
+BEGIN UPDATE CATALOGVERSION SET version = version + 1; END;
+CREATE TRIGGER CATEGORY_UPDATE_VERSION AFTER UPDATE OF categoryName ON CATEGORY
+BEGIN UPDATE CATALOGVERSION SET version = version + 1; END;
+CREATE TRIGGER STOCK_INSERT_VERSION AFTER INSERT ON STOCK
+BEGIN UPDATE CATALOGVERSION SET version = version + 1; END;
+CREATE TRIGGER STOCK_DELETE_VERSION AFTER DELETE ON STOCK
+BEGIN UPDATE CATALOGVERSION SET version = version + 1; END;
+-- Cached pages hold serial numbers only, stock counts are read when they are served. A borrow or a
+-- return only changes them when the last copy of a campus goes or the first one comes back.
+CREATE TRIGGER STOCK_UPDATE_VERSION AFTER UPDATE ON STOCK
+    WHEN NEW.serialnum IS NOT OLD.serialnum OR NEW.campus IS NOT OLD.campus OR (NEW.instock > 0) <> (OLD.instock > 0)
+BEGIN UPDATE CATALOGVERSION SET version = version + 1; END;
+
+CREATE TABLE STOCKMAP
+(
+    campus TEXT    NOT NULL REFERENCES CAMPUS (campusName) ON UPDATE CASCADE ON DELETE CASCADE,
+    word   INTEGER NOT NULL,
+    bits   INTEGER NOT NULL DEFAULT 0,
+    PRIMARY KEY (campus, word)
+) WITHOUT ROWID;
+INSERT INTO STOCKMAP
+SELECT campus, bookid >> 6, SUM(1 << (bookid & 63))
+FROM STOCK,
+     BOOK
+WHERE STOCK.serialnum = BOOK.serialnum
+  AND instock > 0
+GROUP BY campus, bookid >> 6;
+
+CREATE TRIGGER BOOK_INSERT_BOOKID AFTER INSERT ON BOOK WHEN NEW.bookid IS NULL
+BEGIN UPDATE BOOK SET bookid = (SELECT IFNULL(MAX(bookid), 0) + 1 FROM BOOK) WHERE serialnum = NEW.serialnum; END;
+CREATE TRIGGER BOOK_DELETE_STOCKMAP AFTER DELETE ON BOOK
+BEGIN UPDATE STOCKMAP SET bits = bits & ~(1 << (OLD.bookid & 63)) WHERE word = OLD.bookid >> 6; END;
+CREATE TRIGGER STOCK_INSERT_STOCKMAP AFTER INSERT ON STOCK WHEN NEW.instock > 0
+BEGIN
+    INSERT INTO STOCKMAP (campus, word, bits)
+    SELECT NEW.campus, bookid >> 6, 1 << (bookid & 63) FROM BOOK WHERE serialnum = NEW.serialnum
+    ON CONFLICT (campus, word) DO UPDATE SET bits = bits | excluded.bits;
+END;
+CREATE TRIGGER STOCK_DELETE_STOCKMAP AFTER DELETE ON STOCK
+BEGIN
+    UPDATE STOCKMAP SET bits = bits & ~(1 << ((SELECT bookid FROM BOOK WHERE serialnum = OLD.serialnum) & 63))
+    WHERE campus = OLD.campus AND word = (SELECT bookid FROM BOOK WHERE serialnum = OLD.serialnum) >> 6;
+END;
+
+CREATE TABLE HITHOUR
+(
+    hour      INTEGER NOT NULL,
+    serialnum TEXT    NOT NULL REFERENCES BOOK (serialnum) ON UPDATE CASCADE ON DELETE CASCADE,
+    hits      INTEGER NOT NULL DEFAULT 0,
+    PRIMARY KEY (hour, serialnum)
+) WITHOUT ROWID;
+
+CREATE TABLE HITDAY
+(
+    day       INTEGER NOT NULL,
+    serialnum TEXT    NOT NULL REFERENCES BOOK (serialnum) ON UPDATE CASCADE ON DELETE CASCADE,
+    hits      INTEGER NOT NULL DEFAULT 0,
+    PRIMARY KEY (day, serialnum)
+) WITHOUT ROWID;
+
+-- Hit logs renamed by fold (db/hits.log.<epoch>.<pid>) whose fold is committed but which may not be removed yet
+CREATE TABLE HITFOLD
+(
+    file TEXT NOT NULL PRIMARY KEY
+);
+
+-- Hits of every book, author, publisher and language viewed during the span, kept by fold
+CREATE TABLE TRENDING
+(
+    span TEXT    NOT NULL CHECK (span IN ('24h', '7d', '30d')),
+    kind TEXT    NOT NULL CHECK (kind IN ('book', 'author', 'publisher', 'lang')),
+    name TEXT    NOT NULL,
+    hits INTEGER NOT NULL,
+    PRIMARY KEY (span, kind, name)
+) WITHOUT ROWID;
+CREATE INDEX TRENDING_HITS ON TRENDING (span, kind, hits);
+
+-- First hour (24h) or day (7d, 30d) counted in TRENDING
+CREATE TABLE TRENDINGSPAN
+(
+    span  TEXT    NOT NULL PRIMARY KEY CHECK (span IN ('24h', '7d', '30d')),
+    first INTEGER NOT NULL
+) WITHOUT ROWID;
+INSERT INTO TRENDINGSPAN
+VALUES ('24h', 0),
+       ('7d', 0),
+       ('30d', 0);
+
+CREATE TABLE VIEWERS
+(
+    serialnum TEXT    NOT NULL REFERENCES BOOK (serialnum) ON UPDATE CASCADE ON DELETE CASCADE,
+    day       INTEGER NOT NULL,
+    sketch    BLOB    NOT NULL,
+    PRIMARY KEY (serialnum, day)
+) WITHOUT ROWID;
+CREATE INDEX VIEWERS_DAY ON VIEWERS (day);
+
+CREATE INDEX BOOK_PUBLISHER ON BOOK (publisher);
+CREATE INDEX BOOK_TYPE ON BOOK (type);
+CREATE INDEX BOOK_CATEGORY ON BOOK (category);
+CREATE INDEX AUTHORED_AUTHOR ON AUTHORED (author);
+CREATE INDEX LANGUAGES_LANG ON LANGUAGES (lang);
+
+CREATE TABLE POPULARITY
+(
+    kind TEXT    NOT NULL CHECK (kind IN ('publisher', 'author', 'lang', 'doctype', 'category')),
+    name TEXT    NOT NULL,
+    hits INTEGER NOT NULL DEFAULT 0,
+    PRIMARY KEY (kind, name)
+) WITHOUT ROWID;
+-- Every publisher, author, language, doctype and category has a row, books or not, so that the
+-- listings of query.c can walk POPULARITY_HITS and join the entity instead of aggregating BOOK
+CREATE INDEX POPULARITY_HITS ON POPULARITY (kind, hits);
+INSERT INTO POPULARITY
+SELECT 'publisher', publisherName, IFNULL(SUM(hits), 0)
+FROM PUBLISHER LEFT JOIN BOOK ON publisher = publisherName GROUP BY publisherName
+UNION ALL
+SELECT 'doctype', typeName, IFNULL(SUM(hits), 0) FROM DOCTYPE LEFT JOIN BOOK ON type = typeName GROUP BY typeName
+UNION ALL
+SELECT 'category', categoryClass, IFNULL(SUM(hits), 0)
+FROM CATEGORY LEFT JOIN BOOK ON category = categoryClass GROUP BY categoryClass
+UNION ALL
+SELECT 'author', authorName, IFNULL(SUM(hits), 0)
+FROM AUTHOR LEFT JOIN AUTHORED ON author = authorName LEFT JOIN BOOK ON BOOK.serialnum = AUTHORED.serialnum
+GROUP BY authorName
+UNION ALL
+SELECT 'lang', langCode, IFNULL(SUM(hits), 0)
+FROM LANG LEFT JOIN LANGUAGES ON lang = langCode LEFT JOIN BOOK ON BOOK.serialnum = LANGUAGES.serialnum
+GROUP BY langCode;
+
+CREATE TRIGGER BOOK_INSERT_POPULARITY AFTER INSERT ON BOOK
+BEGIN
+    INSERT INTO POPULARITY VALUES ('publisher', NEW.publisher, NEW.hits), ('doctype', NEW.type, NEW.hits),
+                                  ('category', NEW.category, NEW.hits)
+    ON CONFLICT (kind, name) DO UPDATE SET hits = hits + excluded.hits;
+END;
+CREATE TRIGGER BOOK_DELETE_POPULARITY BEFORE DELETE ON BOOK
+BEGIN
+    UPDATE POPULARITY SET hits = hits - OLD.hits
+    WHERE (kind = 'publisher' AND name = OLD.publisher)
+       OR (kind = 'doctype' AND name = OLD.type)
+       OR (kind = 'category' AND name = OLD.category)
+       OR (kind = 'author' AND name IN (SELECT author FROM AUTHORED WHERE serialnum = OLD.serialnum))
+       OR (kind = 'lang' AND name IN (SELECT lang FROM LANGUAGES WHERE serialnum = OLD.serialnum));
+END;
+CREATE TRIGGER BOOK_UPDATE_POPULARITY AFTER UPDATE OF hits, publisher, type, category ON BOOK
+BEGIN
+    UPDATE POPULARITY SET hits = hits - OLD.hits
+    WHERE (kind = 'publisher' AND name = OLD.publisher)
+       OR (kind = 'doctype' AND name = OLD.type)
+       OR (kind = 'category' AND name = OLD.category);
+    INSERT INTO POPULARITY VALUES ('publisher', NEW.publisher, NEW.hits), ('doctype', NEW.type, NEW.hits),
+                                  ('category', NEW.category, NEW.hits)
+    ON CONFLICT (kind, name) DO UPDATE SET hits = hits + excluded.hits;
+    UPDATE POPULARITY SET hits = hits + NEW.hits - OLD.hits
+    WHERE (kind = 'author' AND name IN (SELECT author FROM AUTHORED WHERE serialnum = NEW.serialnum))
+       OR (kind = 'lang' AND name IN (SELECT lang FROM LANGUAGES WHERE serialnum = NEW.serialnum));
+END;
+CREATE TRIGGER AUTHORED_INSERT_POPULARITY AFTER INSERT ON AUTHORED
+BEGIN
+    INSERT INTO POPULARITY SELECT 'author', NEW.author, hits FROM BOOK WHERE serialnum = NEW.serialnum
+    ON CONFLICT (kind, name) DO UPDATE SET hits = hits + excluded.hits;
+END;
+CREATE TRIGGER AUTHORED_DELETE_POPULARITY AFTER DELETE ON AUTHORED
+BEGIN
+    UPDATE POPULARITY SET hits = hits - IFNULL((SELECT hits FROM BOOK WHERE serialnum = OLD.serialnum), 0)
+    WHERE kind = 'author' AND name = OLD.author;
+END;
+CREATE TRIGGER AUTHORED_UPDATE_POPULARITY AFTER UPDATE OF author ON AUTHORED
+BEGIN
+    UPDATE POPULARITY SET hits = hits - IFNULL((SELECT hits FROM BOOK WHERE serialnum = NEW.serialnum), 0)
+    WHERE kind = 'author' AND name = OLD.author;
+    INSERT INTO POPULARITY SELECT 'author', NEW.author, hits FROM BOOK WHERE serialnum = NEW.serialnum
+    ON CONFLICT (kind, name) DO UPDATE SET hits = hits + excluded.hits;
+END;
+CREATE TRIGGER LANGUAGES_INSERT_POPULARITY AFTER INSERT ON LANGUAGES
+BEGIN
+    INSERT INTO POPULARITY SELECT 'lang', NEW.lang, hits FROM BOOK WHERE serialnum = NEW.serialnum
+    ON CONFLICT (kind, name) DO UPDATE SET hits = hits + excluded.hits;
+END;
+CREATE TRIGGER LANGUAGES_DELETE_POPULARITY AFTER DELETE ON LANGUAGES
+BEGIN
+    UPDATE POPULARITY SET hits = hits - IFNULL((SELECT hits FROM BOOK WHERE serialnum = OLD.serialnum), 0)
+    WHERE kind = 'lang' AND name = OLD.lang;
+END;
+CREATE TRIGGER LANGUAGES_UPDATE_POPULARITY AFTER UPDATE OF lang ON LANGUAGES
+BEGIN
+    UPDATE POPULARITY SET hits = hits - IFNULL((SELECT hits FROM BOOK WHERE serialnum = NEW.serialnum), 0)
+    WHERE kind = 'lang' AND name = OLD.lang;
+    INSERT INTO POPULARITY SELECT 'lang', NEW.lang, hits FROM BOOK WHERE serialnum = NEW.serialnum
+    ON CONFLICT (kind, name) DO UPDATE SET hits = hits + excluded.hits;
+END;
+-- A renamed or deleted key leaves its row behind, emptied by the cascade to BOOK, AUTHORED or LANGUAGES
+-- (whichever runs first, the hits end up under the new key)
+CREATE TRIGGER PUBLISHER_INSERT_POPULARITY AFTER INSERT ON PUBLISHER
+BEGIN INSERT OR IGNORE INTO POPULARITY (kind, name) VALUES ('publisher', NEW.publisherName); END;
+CREATE TRIGGER PUBLISHER_DELETE_POPULARITY AFTER DELETE ON PUBLISHER
+BEGIN DELETE FROM POPULARITY WHERE kind = 'publisher' AND name = OLD.publisherName; END;
+CREATE TRIGGER PUBLISHER_UPDATE_POPULARITY AFTER UPDATE OF publisherName ON PUBLISHER
+BEGIN
+    DELETE FROM POPULARITY WHERE kind = 'publisher' AND name = OLD.publisherName;
+    INSERT OR IGNORE INTO POPULARITY (kind, name) VALUES ('publisher', NEW.publisherName);
+END;
+CREATE TRIGGER AUTHOR_INSERT_POPULARITY AFTER INSERT ON AUTHOR
+BEGIN INSERT OR IGNORE INTO POPULARITY (kind, name) VALUES ('author', NEW.authorName); END;
+CREATE TRIGGER AUTHOR_DELETE_POPULARITY AFTER DELETE ON AUTHOR
+BEGIN DELETE FROM POPULARITY WHERE kind = 'author' AND name = OLD.authorName; END;
+CREATE TRIGGER AUTHOR_UPDATE_POPULARITY AFTER UPDATE OF authorName ON AUTHOR
+BEGIN
+    DELETE FROM POPULARITY WHERE kind = 'author' AND name = OLD.authorName;
+    INSERT OR IGNORE INTO POPULARITY (kind, name) VALUES ('author', NEW.authorName);
+END;
+CREATE TRIGGER LANG_INSERT_POPULARITY AFTER INSERT ON LANG
+BEGIN INSERT OR IGNORE INTO POPULARITY (kind, name) VALUES ('lang', NEW.langCode); END;
+CREATE TRIGGER LANG_DELETE_POPULARITY AFTER DELETE ON LANG
+BEGIN DELETE FROM POPULARITY WHERE kind = 'lang' AND name = OLD.langCode; END;
+CREATE TRIGGER LANG_UPDATE_POPULARITY AFTER UPDATE OF langCode ON LANG
+BEGIN
+    DELETE FROM POPULARITY WHERE kind = 'lang' AND name = OLD.langCode;
+    INSERT OR IGNORE INTO POPULARITY (kind, name) VALUES ('lang', NEW.langCode);
+END;
+CREATE TRIGGER DOCTYPE_INSERT_POPULARITY AFTER INSERT ON DOCTYPE
+BEGIN INSERT OR IGNORE INTO POPULARITY (kind, name) VALUES ('doctype', NEW.typeName); END;
+CREATE TRIGGER DOCTYPE_DELETE_POPULARITY AFTER DELETE ON DOCTYPE
+BEGIN DELETE FROM POPULARITY WHERE kind = 'doctype' AND name = OLD.typeName; END;
+CREATE TRIGGER DOCTYPE_UPDATE_POPULARITY AFTER UPDATE OF typeName ON DOCTYPE
+BEGIN
+    DELETE FROM POPULARITY WHERE kind = 'doctype' AND name = OLD.typeName;
+    INSERT OR IGNORE INTO POPULARITY (kind, name) VALUES ('doctype', NEW.typeName);
+END;
+CREATE TRIGGER CATEGORY_INSERT_POPULARITY AFTER INSERT ON CATEGORY
+BEGIN INSERT OR IGNORE INTO POPULARITY (kind, name) VALUES ('category', NEW.categoryClass); END;
+CREATE TRIGGER CATEGORY_DELETE_POPULARITY AFTER DELETE ON CATEGORY
+BEGIN DELETE FROM POPULARITY WHERE kind = 'category' AND name = OLD.categoryClass; END;
+CREATE TRIGGER CATEGORY_UPDATE_POPULARITY AFTER UPDATE OF categoryClass ON CATEGORY
+BEGIN
+    DELETE FROM POPULARITY WHERE kind = 'category' AND name = OLD.categoryClass;
+    INSERT OR IGNORE INTO POPULARITY (kind, name) VALUES ('category', NEW.categoryClass);
+END;
@@ -0,0 +1,20 @@
+-- Adds the SEARCHKEYFTS trigram index of BOOK.searchkey searched by search.c. Needs SQLite 3.34 or
+-- later built with FTS5. Run once with the endpoints stopped:
+--     sqlite3 db/database.db < misc/migrate-026.sql
+BEGIN IMMEDIATE;
+-- Trigram index of BOOK.searchkey, the exact search GLOBs it (see search.c) instead of scanning BOOK.
+-- The content stays in BOOK, rows are keyed by bookid and kept by the triggers below.
+CREATE VIRTUAL TABLE SEARCHKEYFTS USING fts5(searchkey, content = 'BOOK', content_rowid = 'bookid', tokenize = 'trigram');
+CREATE TRIGGER BOOK_INSERT_SEARCHKEYFTS AFTER INSERT ON BOOK WHEN NEW.bookid IS NOT NULL AND NEW.searchkey IS NOT NULL
+BEGIN INSERT INTO SEARCHKEYFTS (rowid, searchkey) VALUES (NEW.bookid, NEW.searchkey); END;
+CREATE TRIGGER BOOK_DELETE_SEARCHKEYFTS AFTER DELETE ON BOOK WHEN OLD.bookid IS NOT NULL AND OLD.searchkey IS NOT NULL
+BEGIN INSERT INTO SEARCHKEYFTS (SEARCHKEYFTS, rowid, searchkey) VALUES ('delete', OLD.bookid, OLD.searchkey); END;
+CREATE TRIGGER BOOK_UPDATE_SEARCHKEYFTS AFTER UPDATE OF bookid, searchkey ON BOOK
+BEGIN
+    INSERT INTO SEARCHKEYFTS (SEARCHKEYFTS, rowid, searchkey)
+    SELECT 'delete', OLD.bookid, OLD.searchkey WHERE OLD.bookid IS NOT NULL AND OLD.searchkey IS NOT NULL;
+    INSERT INTO SEARCHKEYFTS (rowid, searchkey)
+    SELECT NEW.bookid, NEW.searchkey WHERE NEW.bookid IS NOT NULL AND NEW.searchkey IS NOT NULL;
+END;
+INSERT INTO SEARCHKEYFTS (SEARCHKEYFTS) VALUES ('rebuild');
+COMMIT;
@@ -0,0 +1,7 @@
+-- Drops SEARCHCACHE, search now caches its pages in db/search.cache (see searchcache.h) and no longer
+-- writes to the database. Run once with the endpoints stopped:
+--     sqlite3 db/database.db < misc/migrate-027.sql
+BEGIN IMMEDIATE;
+DROP INDEX IF EXISTS SEARCHCACHE_CREATED;
+DROP TABLE IF EXISTS SEARCHCACHE;
+COMMIT;
@@ -0,0 +1,51 @@
+-- Replaces the TRENDING top lists recomputed by every fold with counts fold keeps by deltas, filled
+-- from the hit buckets. Run once with the endpoints and fold stopped:
+--     sqlite3 db/database.db < misc/migrate-033.sql
+BEGIN IMMEDIATE;
+DROP TABLE TRENDING;
+CREATE TABLE TRENDING
+(
+    span TEXT    NOT NULL CHECK (span IN ('24h', '7d', '30d')),
+    kind TEXT    NOT NULL CHECK (kind IN ('book', 'author', 'publisher', 'lang')),
+    name TEXT    NOT NULL,
+    hits INTEGER NOT NULL,
+    PRIMARY KEY (span, kind, name)
+) WITHOUT ROWID;
+CREATE INDEX TRENDING_HITS ON TRENDING (span, kind, hits);
+CREATE TABLE TRENDINGSPAN
+(
+    span  TEXT    NOT NULL PRIMARY KEY CHECK (span IN ('24h', '7d', '30d')),
+    first INTEGER NOT NULL
+) WITHOUT ROWID;
+INSERT INTO TRENDINGSPAN
+VALUES ('24h', unixepoch() / 3600 - 23),
+       ('7d', unixepoch() / 86400 - 6),
+       ('30d', unixepoch() / 86400 - 29);
+INSERT INTO TRENDING
+WITH H(span, serialnum, hits) AS (SELECT '24h', serialnum, SUM(hits)
+                                  FROM HITHOUR
+                                  WHERE hour >= (SELECT first FROM TRENDINGSPAN WHERE span = '24h')
+                                  GROUP BY serialnum
+                                  UNION ALL
+                                  SELECT span, serialnum, SUM(hits)
+                                  FROM HITDAY
+                                           JOIN TRENDINGSPAN ON span IN ('7d', '30d') AND day >= first
+                                  GROUP BY span, serialnum)
+SELECT span, 'book', serialnum, hits
+FROM H
+UNION ALL
+SELECT span, 'author', author, SUM(hits)
+FROM H
+         JOIN AUTHORED USING (serialnum)
+GROUP BY span, author
+UNION ALL
+SELECT span, 'publisher', publisher, SUM(H.hits)
+FROM H
+         JOIN BOOK USING (serialnum)
+GROUP BY span, publisher
+UNION ALL
+SELECT span, 'lang', lang, SUM(hits)
+FROM H
+         JOIN LANGUAGES USING (serialnum)
+GROUP BY span, lang;
+COMMIT;
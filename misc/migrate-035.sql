@@ -0,0 +1,69 @@
+-- Gives every publisher, author, language, doctype and category a POPULARITY row, books or not,
+-- indexes it by hits and adds the triggers dropping the rows of renamed or deleted keys. Run once
+-- with the endpoints stopped:
+--     sqlite3 db/database.db < misc/migrate-035.sql
+BEGIN IMMEDIATE;
+DELETE FROM POPULARITY;
+CREATE INDEX POPULARITY_HITS ON POPULARITY (kind, hits);
+INSERT INTO POPULARITY
+SELECT 'publisher', publisherName, IFNULL(SUM(hits), 0)
+FROM PUBLISHER LEFT JOIN BOOK ON publisher = publisherName GROUP BY publisherName
+UNION ALL
+SELECT 'doctype', typeName, IFNULL(SUM(hits), 0) FROM DOCTYPE LEFT JOIN BOOK ON type = typeName GROUP BY typeName
+UNION ALL
+SELECT 'category', categoryClass, IFNULL(SUM(hits), 0)
+FROM CATEGORY LEFT JOIN BOOK ON category = categoryClass GROUP BY categoryClass
+UNION ALL
+SELECT 'author', authorName, IFNULL(SUM(hits), 0)
+FROM AUTHOR LEFT JOIN AUTHORED ON author = authorName LEFT JOIN BOOK ON BOOK.serialnum = AUTHORED.serialnum
+GROUP BY authorName
+UNION ALL
+SELECT 'lang', langCode, IFNULL(SUM(hits), 0)
+FROM LANG LEFT JOIN LANGUAGES ON lang = langCode LEFT JOIN BOOK ON BOOK.serialnum = LANGUAGES.serialnum
+GROUP BY langCode;
+CREATE TRIGGER PUBLISHER_INSERT_POPULARITY AFTER INSERT ON PUBLISHER
+BEGIN INSERT OR IGNORE INTO POPULARITY (kind, name) VALUES ('publisher', NEW.publisherName); END;
+CREATE TRIGGER PUBLISHER_DELETE_POPULARITY AFTER DELETE ON PUBLISHER
+BEGIN DELETE FROM POPULARITY WHERE kind = 'publisher' AND name = OLD.publisherName; END;
+CREATE TRIGGER PUBLISHER_UPDATE_POPULARITY AFTER UPDATE OF publisherName ON PUBLISHER
+BEGIN
+    DELETE FROM POPULARITY WHERE kind = 'publisher' AND name = OLD.publisherName;
+    INSERT OR IGNORE INTO POPULARITY (kind, name) VALUES ('publisher', NEW.publisherName);
+END;
+CREATE TRIGGER AUTHOR_INSERT_POPULARITY AFTER INSERT ON AUTHOR
+BEGIN INSERT OR IGNORE INTO POPULARITY (kind, name) VALUES ('author', NEW.authorName); END;
+CREATE TRIGGER AUTHOR_DELETE_POPULARITY AFTER DELETE ON AUTHOR
+BEGIN DELETE FROM POPULARITY WHERE kind = 'author' AND name = OLD.authorName; END;
+CREATE TRIGGER AUTHOR_UPDATE_POPULARITY AFTER UPDATE OF authorName ON AUTHOR
+BEGIN
+    DELETE FROM POPULARITY WHERE kind = 'author' AND name = OLD.authorName;
+    INSERT OR IGNORE INTO POPULARITY (kind, name) VALUES ('author', NEW.authorName);
+END;
+CREATE TRIGGER LANG_INSERT_POPULARITY AFTER INSERT ON LANG
+BEGIN INSERT OR IGNORE INTO POPULARITY (kind, name) VALUES ('lang', NEW.langCode); END;
+CREATE TRIGGER LANG_DELETE_POPULARITY AFTER DELETE ON LANG
+BEGIN DELETE FROM POPULARITY WHERE kind = 'lang' AND name = OLD.langCode; END;
+CREATE TRIGGER LANG_UPDATE_POPULARITY AFTER UPDATE OF langCode ON LANG
+BEGIN
+    DELETE FROM POPULARITY WHERE kind = 'lang' AND name = OLD.langCode;
+    INSERT OR IGNORE INTO POPULARITY (kind, name) VALUES ('lang', NEW.langCode);
+END;
+CREATE TRIGGER DOCTYPE_INSERT_POPULARITY AFTER INSERT ON DOCTYPE
+BEGIN INSERT OR IGNORE INTO POPULARITY (kind, name) VALUES ('doctype', NEW.typeName); END;
+CREATE TRIGGER DOCTYPE_DELETE_POPULARITY AFTER DELETE ON DOCTYPE
+BEGIN DELETE FROM POPULARITY WHERE kind = 'doctype' AND name = OLD.typeName; END;
+CREATE TRIGGER DOCTYPE_UPDATE_POPULARITY AFTER UPDATE OF typeName ON DOCTYPE
+BEGIN
+    DELETE FROM POPULARITY WHERE kind = 'doctype' AND name = OLD.typeName;
+    INSERT OR IGNORE INTO POPULARITY (kind, name) VALUES ('doctype', NEW.typeName);
+END;
+CREATE TRIGGER CATEGORY_INSERT_POPULARITY AFTER INSERT ON CATEGORY
+BEGIN INSERT OR IGNORE INTO POPULARITY (kind, name) VALUES ('category', NEW.categoryClass); END;
+CREATE TRIGGER CATEGORY_DELETE_POPULARITY AFTER DELETE ON CATEGORY
+BEGIN DELETE FROM POPULARITY WHERE kind = 'category' AND name = OLD.categoryClass; END;
+CREATE TRIGGER CATEGORY_UPDATE_POPULARITY AFTER UPDATE OF categoryClass ON CATEGORY
+BEGIN
+    DELETE FROM POPULARITY WHERE kind = 'category' AND name = OLD.categoryClass;
+    INSERT OR IGNORE INTO POPULARITY (kind, name) VALUES ('category', NEW.categoryClass);
+END;
+COMMIT;
@@ -0,0 +1,104 @@
+-- Moves a database created before integer action codes and epoch timestamps to the current schema:
+-- HISTORY.actiondate and INVENTORY.rentdate (local DATETIME text) become epochs, HISTORY.action an
+-- ACTION.actionCode. Run once with the endpoints stopped, and ingest drained:
+--     sqlite3 db/database.db < misc/migrate-047.sql
+-- Partitions under db/history are left as they are, move them back into HISTORY before migrating.
+PRAGMA foreign_keys = OFF;
+BEGIN IMMEDIATE;
+
+CREATE TABLE ACTION_NEW
+(
+    actionCode INTEGER PRIMARY KEY NOT NULL,
+    actionName TEXT UNIQUE NOT NULL
+);
+INSERT INTO ACTION_NEW
+VALUES (1, 'ADD'),
+       (2, 'REMOVE'),
+       (3, 'EDIT'),
+       (4, 'QUERY'),
+       (5, 'LOGIN'),
+       (6, 'LOGOUT'),
+       (7, 'SIGNUP'),
+       (8, 'BORROW'),
+       (9, 'RETURN');
+-- Actions added locally keep a code of their own
+INSERT INTO ACTION_NEW (actionName)
+SELECT actionName
+FROM ACTION
+WHERE actionName NOT IN (SELECT actionName FROM ACTION_NEW)
+ORDER BY actionName;
+
+CREATE TABLE HISTORY_NEW
+(
+    UUID        TEXT DEFAULT NULL,
+    UUID_ISSUER TEXT DEFAULT NULL,
+    serialnum   TEXT DEFAULT NULL,
+    IP          TEXT DEFAULT NULL,
+    action      INTEGER  NOT NULL REFERENCES ACTION (actionCode) ON UPDATE CASCADE ON DELETE CASCADE,
+    actiontime  INTEGER  NOT NULL, -- epoch
+    details     TEXT DEFAULT NULL,
+    -- Reads logged by query and search have JSON details, see audit.h
+    querypage      TEXT GENERATED ALWAYS AS (CASE WHEN json_valid(details) THEN json_extract(details, '$.page') END) VIRTUAL,
+    queryserialnum TEXT GENERATED ALWAYS AS (CASE WHEN json_valid(details) THEN json_extract(details, '$.serialnum') END) VIRTUAL
+);
+INSERT INTO HISTORY_NEW (rowid, UUID, UUID_ISSUER, serialnum, IP, action, actiontime, details)
+SELECT H.rowid,
+       UUID,
+       UUID_ISSUER,
+       serialnum,
+       IP,
+       actionCode,
+       CAST(strftime('%s', actiondate, 'utc') AS INTEGER),
+       details
+FROM HISTORY H
+         JOIN ACTION_NEW ON actionName = H.action
+ORDER BY H.rowid;
+
+CREATE TABLE INVENTORY_NEW
+(
+    UUID         TEXT     NOT NULL REFERENCES ACCOUNT (UUID) ON UPDATE CASCADE ON DELETE CASCADE,
+    serialnum    TEXT     NOT NULL REFERENCES BOOK (serialnum) ON UPDATE CASCADE ON DELETE CASCADE,
+    rentduration INTEGER  NOT NULL CHECK (rentduration > 0),
+    rentdate     INTEGER  NOT NULL, -- epoch
+    extended     BOOLEAN  NOT NULL,
+    UNIQUE (UUID, serialnum)
+);
+-- edit used to bind epochs into rentdate already
+INSERT INTO INVENTORY_NEW (rowid, UUID, serialnum, rentduration, rentdate, extended)
+SELECT rowid,
+       UUID,
+       serialnum,
+       rentduration,
+       CASE
+           WHEN typeof(rentdate) = 'integer' THEN rentdate
+           ELSE CAST(strftime('%s', rentdate, 'utc') AS INTEGER) END,
+       extended
+FROM INVENTORY;
+
+DROP TABLE HISTORY;
+DROP TABLE INVENTORY;
+DROP TABLE ACTION;
+ALTER TABLE ACTION_NEW RENAME TO ACTION;
+ALTER TABLE HISTORY_NEW RENAME TO HISTORY;
+ALTER TABLE INVENTORY_NEW RENAME TO INVENTORY;
+
+CREATE INDEX HISTORY_ACTIONTIME ON HISTORY (actiontime);
+CREATE INDEX HISTORY_UUID ON HISTORY (UUID);
+CREATE INDEX HISTORY_SERIALNUM ON HISTORY (serialnum);
+CREATE INDEX HISTORY_QUERYPAGE ON HISTORY (querypage);
+CREATE INDEX HISTORY_QUERYSERIALNUM ON HISTORY (queryserialnum);
+-- HISTORY as the history page shows it, action names and local dates
+CREATE VIEW HISTORYTEXT AS
+SELECT H.UUID, UUID_ISSUER, serialnum, IP, actionName AS action,
+       datetime(actiontime, 'unixepoch', 'localtime') AS actiondate, details, querypage, queryserialnum, actiontime,
+       H.action AS actioncode
+FROM HISTORY H
+         JOIN ACTION ON actionCode = H.action;
+CREATE VIEW INVENTORYTEXT AS
+SELECT UUID, serialnum, rentduration, datetime(rentdate, 'unixepoch', 'localtime') AS rentdate, extended,
+       rentdate AS renttime
+FROM INVENTORY;
+
+PRAGMA foreign_key_check;
+COMMIT;
+PRAGMA foreign_keys = ON;
@@ -0,0 +1,44 @@
+-- Adds INVENTORY.campus and INVENTORY.duedate to a database migrated by migrate-047.sql. Loans
+-- already out are given the campus of their account. Run once with the endpoints stopped:
+--     sqlite3 db/database.db < misc/migrate-050.sql
+PRAGMA foreign_keys = OFF;
+BEGIN IMMEDIATE;
+
+CREATE TABLE INVENTORY_NEW
+(
+    UUID         TEXT     NOT NULL REFERENCES ACCOUNT (UUID) ON UPDATE CASCADE ON DELETE CASCADE,
+    serialnum    TEXT     NOT NULL REFERENCES BOOK (serialnum) ON UPDATE CASCADE ON DELETE CASCADE,
+    rentduration INTEGER  NOT NULL CHECK (rentduration > 0),
+    rentdate     INTEGER  NOT NULL, -- epoch
+    extended     BOOLEAN  NOT NULL,
+    -- Campus the copy was lent from
+    campus       TEXT     NOT NULL REFERENCES CAMPUS (campusName) ON UPDATE CASCADE ON DELETE CASCADE,
+    -- rentdate + rentduration days, computed when read and kept up to date in INVENTORY_DUEDATE
+    duedate      INTEGER  GENERATED ALWAYS AS (rentdate + rentduration * 86400) VIRTUAL,
+    UNIQUE (UUID, serialnum)
+);
+INSERT INTO INVENTORY_NEW (rowid, UUID, serialnum, rentduration, rentdate, extended, campus)
+SELECT I.rowid,
+       I.UUID,
+       serialnum,
+       rentduration,
+       rentdate,
+       extended,
+       A.campus
+FROM INVENTORY I
+         JOIN ACCOUNT A ON A.UUID = I.UUID;
+
+DROP VIEW INVENTORYTEXT;
+DROP TABLE INVENTORY;
+ALTER TABLE INVENTORY_NEW RENAME TO INVENTORY;
+
+-- The overdue report of a campus is read in this order, see query.c
+CREATE INDEX INVENTORY_DUEDATE ON INVENTORY (campus, duedate, UUID, serialnum);
+CREATE VIEW INVENTORYTEXT AS
+SELECT UUID, serialnum, rentduration, datetime(rentdate, 'unixepoch', 'localtime') AS rentdate, extended,
+       campus, datetime(duedate, 'unixepoch', 'localtime') AS duedate, rentdate AS renttime, duedate AS duetime
+FROM INVENTORY;
+
+PRAGMA foreign_key_check;
+COMMIT;
+PRAGMA foreign_keys = ON;
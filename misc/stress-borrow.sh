@@ -0,0 +1,73 @@
+#!/bin/sh
+# Runs BORROWERS concurrent requests of the built borrow endpoint, each lending one of the last
+# COPIES copies of a book to its own account, and checks that no copy was lent twice: the loans
+# recorded in INVENTORY, the copies left in STOCK and the requests answered 200 must all agree,
+# and the campus bit of STOCKMAP must be cleared once the shelf is empty.
+# The endpoint runs as a CGI program from a scratch directory holding db/, with the session of the
+# administrator of misc/database-scheme.sql. Build it first with `make build/borrow`.
+# Usage: misc/stress-borrow.sh [borrowers] [copies]
+set -e
+
+BORROWERS=${1:-50}
+COPIES=${2:-1}
+BOOK=9780131101630
+CAMPUS='El Kseur'
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+BORROW=$ROOT/build/borrow
+COOKIE=stress-borrow-session
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+
+if [ ! -x "$BORROW" ]; then
+    echo "$BORROW not found, run make build/borrow first" >&2
+    exit 1
+fi
+# SESSIONS holds the SHA-256 of the cookie
+if command -v sha256 > /dev/null; then
+    DIGEST=$(printf '%s' "$COOKIE" | sha256 -q)
+else
+    DIGEST=$(printf '%s' "$COOKIE" | sha256sum | cut -d ' ' -f 1)
+fi
+
+mkdir "$DIR/db"
+sqlite3 "$DIR/db/database.db" < "$ROOT/misc/database-scheme.sql"
+sqlite3 "$DIR/db/database.db" > /dev/null <<EOF
+PRAGMA journal_mode = WAL;
+WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i + 1 FROM n WHERE i < $BORROWERS)
+INSERT INTO ACCOUNT (UUID, displayname, pwhash, campus, role)
+SELECT 'stress' || i, 'Stress ' || i, '', '$CAMPUS', 'STUDENT'
+FROM n;
+INSERT INTO SESSIONS (account, sessionID, expiresAt)
+VALUES ('teto', '$DIGEST', datetime('now', 'localtime', '+1 hour'));
+UPDATE STOCK SET instock = $COPIES WHERE (serialnum, campus) = ('$BOOK', '$CAMPUS');
+EOF
+
+borrow() {
+    (cd "$DIR" && env -i GATEWAY_INTERFACE=CGI/1.1 SERVER_PROTOCOL=HTTP/1.1 REQUEST_METHOD=GET \
+        SCRIPT_NAME=/borrow REMOTE_ADDR=127.0.0.1 HTTP_COOKIE="sessionID=$COOKIE" \
+        QUERY_STRING="uuid=stress$1&serialnum=$BOOK&duration=14" "$BORROW")
+}
+
+i=1
+while [ "$i" -le "$BORROWERS" ]; do
+    (borrow "$i" > "$DIR/out.$i" 2> /dev/null || true) &
+    i=$((i + 1))
+done
+wait
+
+LENT=$(grep -l '^Status: 200' "$DIR"/out.* | wc -l | tr -d ' ')
+LOANS=$(sqlite3 "$DIR/db/database.db" "SELECT COUNT(*) FROM INVENTORY WHERE serialnum = '$BOOK';")
+LEFT=$(sqlite3 "$DIR/db/database.db" "SELECT instock FROM STOCK WHERE (serialnum, campus) = ('$BOOK', '$CAMPUS');")
+MAPPED=$(sqlite3 "$DIR/db/database.db" "SELECT COUNT(*) FROM STOCKMAP JOIN BOOK ON word = bookid >> 6
+WHERE campus = '$CAMPUS' AND serialnum = '$BOOK' AND bits & (1 << (bookid & 63));")
+echo "== $BORROWERS borrowers, $COPIES copies: $LENT borrows answered 200, $LOANS loans, $LEFT left on the shelf"
+if [ "$LOANS" -ne "$LENT" ] || [ "$LOANS" -gt "$COPIES" ] || [ "$LEFT" -lt 0 ] ||
+    [ $((LOANS + LEFT)) -ne "$COPIES" ]; then
+    echo "FAIL: a copy was lent twice or lost" >&2
+    exit 1
+fi
+if [ "$LEFT" -eq 0 ] && [ "$MAPPED" -ne 0 ]; then
+    echo "FAIL: the empty shelf is still in STOCKMAP" >&2
+    exit 1
+fi
+echo "OK"
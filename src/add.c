@@ -11,11 +11,15 @@
 #include <kcgi.h>
 #include <kcgijson.h>
 #include <sqlbox.h>
+#include <sha2.h> /* SHA256Data() */
 #include <stdbool.h>
 #include <stdio.h>
 #include <time.h>
 #include <pwd.h>
 #include <unistd.h>
+#include "searchkey.h"
+#include "token.h"
+#include "session.h"
 #define HASHLEN 32
 #define SALTLEN 16
 #ifndef __BSD_VISIBLE
@@ -146,6 +150,8 @@ enum statement {
     STMTS_LOGIN,
     STMTS_SAVE,
     STMTS_DEFAULT_STOCK,
+    STMTS_SEARCHKEY,
+    STMTS_SEARCHKEY_LAST = STMTS_SEARCHKEY + SEARCHKEY__MAX - 1,
     STMTS__MAX
 };
 
@@ -159,29 +165,30 @@ static struct sqlbox_pstmt pstmts[STMTS__MAX] = {
     {(char *) "INSERT INTO ROLE VALUES (?,?)"},
     {(char *) "INSERT INTO CATEGORY VALUES (?,?,?)"},
     {(char *) "INSERT INTO ACCOUNT VALUES (?,?,?,?,?,?)"},
-    {(char *) "INSERT INTO BOOK VALUES (?,?,?,?,?,?,?,?,0)"},
+    {
+        (char *)
+        "INSERT INTO BOOK (serialnum, type, category, publisher, booktitle, bookreleaseyear, bookcover, description) "
+        "VALUES (?,?,?,?,?,?,?,?)"
+    },
     {(char *) "INSERT INTO LANGUAGES VALUES(?,?)"},
     {(char *) "INSERT INTO AUTHORED VALUES(?,?)"},
     {(char *) "INSERT INTO STOCK VALUES(?,?,?)"},
-    {(char *) "INSERT INTO INVENTORY VALUES(?,?,?,?,?)"},
     {
         (char *)
-        "SELECT ACCOUNT.UUID, displayname, pwhash, campus, role, perms, frozen "
-        "FROM ROLE,"
-        "ACCOUNT "
-        "LEFT JOIN SESSIONS S on ACCOUNT.UUID = S.account "
-        "WHERE ACCOUNT.role = ROLE.roleName "
-        "AND sessionID = (?) "
-        "GROUP BY ACCOUNT.UUID, displayname, pwhash, campus, perms, frozen "
+        "INSERT INTO INVENTORY (UUID, serialnum, rentduration, rentdate, extended, campus) "
+        "VALUES (?1,?2,?3,?4,?5,(SELECT campus FROM ACCOUNT WHERE UUID = ?1))"
     },
+    SESSION_LOGIN_PSTMT,
     {
         (char *)
-        "INSERT INTO HISTORY (UUID, IP, action, actiondate, details) "
-        "VALUES ((?),(?),'ADD',datetime('now','localtime'),(?))"
+        "INSERT INTO HISTORY (UUID, IP, action, actiontime, details) "
+        "VALUES ((?),(?),(SELECT actionCode FROM ACTION WHERE actionName = 'ADD'),"
+        "CAST(strftime('%s', 'now') AS INTEGER),(?))"
     },
     {
         (char *) "INSERT INTO STOCK(serialnum, campus) SELECT(?) AS serialnum ,campusName AS campus FROM CAMPUS"
-    }
+    },
+    SEARCHKEY_PSTMTS
 };
 
 static enum keys switch_keys[STMTS__MAX][10] = {
@@ -256,36 +263,19 @@ struct usr curr_usr = {
 
 void fill_user() {
     struct kpair *field;
-
-    if ((field = r.cookiemap[COOKIE_SESSIONID])) {
-        size_t stmtid;
-        size_t parmsz = 1;
-        const struct sqlbox_parmset *res;
-        struct sqlbox_parm parms[] = {
-            {.type = SQLBOX_PARM_STRING, .sparm = field->parsed.s},
-        };
-        if (!(stmtid = sqlbox_prepare_bind(boxctx, dbid, STMTS_LOGIN, parmsz, parms, 0)))
-            errx(EXIT_FAILURE, "sqlbox_prepare_bind");
-        if ((res = sqlbox_step(boxctx, stmtid)) == NULL)
-            errx(EXIT_FAILURE, "sqlbox_step");
-        if (res->psz != 0) {
-            curr_usr.authenticated = true;
-            kasprintf(&curr_usr.UUID, "%s", res->ps[0].sparm);
-
-            kasprintf(&curr_usr.disp_name, "%s", res->ps[1].sparm);
-
-            kasprintf(&curr_usr.campus, "%s", res->ps[3].sparm);
-
-            kasprintf(&curr_usr.role, "%s", res->ps[4].sparm);
-
-            kasprintf(&curr_usr.sessionID, "%s", field->parsed.s);
-
-            curr_usr.perms = int_to_accperms((int) res->ps[5].iparm);
-
-            curr_usr.frozen = res->ps[6].iparm;
-        }
-        sqlbox_finalise(boxctx, stmtid);
-    }
+    struct token tok;
+
+    if ((field = r.cookiemap[COOKIE_SESSIONID]) == NULL ||
+        !session_resolve(field->parsed.s, boxctx, dbid, STMTS_LOGIN, &tok))
+        return;
+    curr_usr.authenticated = true;
+    curr_usr.UUID = tok.UUID;
+    curr_usr.disp_name = tok.disp_name;
+    curr_usr.campus = tok.campus;
+    curr_usr.role = tok.role;
+    kasprintf(&curr_usr.sessionID, "%s", field->parsed.s);
+    curr_usr.perms = int_to_accperms(tok.perms);
+    curr_usr.frozen = tok.frozen;
 }
 
 
@@ -424,6 +414,8 @@ enum khttp process() {
             temp_field = temp_field->next;
         }
     }
+    if (r.page == PG_BOOK || r.page == PG_LANGUAGES || r.page == PG_AUTHORED)
+        searchkey_refresh(boxctx, dbid, STMTS_SEARCHKEY, r.fieldmap[KEY_SERIALNUM]->parsed.s);
     return KHTTP_200;
 }
 
@@ -0,0 +1,421 @@
+#include <sys/types.h> /* size_t */
+#include <err.h> /* err(), errx() */
+#include <stdlib.h> /* EXIT_FAILURE */
+#include <string.h> /* memset() */
+#include <zlib.h> /* compress2() */
+#include "archive.h"
+
+#define HEADER_SIZE (4 + 8 + 8 + COL__MAX * 8)
+
+struct buf {
+    uint8_t *p;
+    size_t len;
+    size_t cap;
+};
+
+static const bool dictionary[COL__MAX] = {
+    [COL_UUID] = true,
+    [COL_UUID_ISSUER] = true,
+    [COL_IP] = true,
+    [COL_ACTION] = true
+};
+
+static void buf_put(struct buf *b, const void *data, size_t len) {
+    if (b->len + len > b->cap) {
+        b->cap = (b->len + len) * 2;
+        if ((b->p = realloc(b->p, b->cap)) == NULL)
+            err(EXIT_FAILURE, "realloc");
+    }
+    memcpy(b->p + b->len, data, len);
+    b->len += len;
+}
+
+static void put_varint(struct buf *b, uint64_t v) {
+    uint8_t byte;
+
+    do {
+        byte = v & 0x7f;
+        v >>= 7;
+        if (v != 0)
+            byte |= 0x80;
+        buf_put(b, &byte, 1);
+    } while (v != 0);
+}
+
+static bool get_varint(const uint8_t **p, const uint8_t *end, uint64_t *v) {
+    *v = 0;
+    for (int shift = 0; *p < end && shift < 64; shift += 7) {
+        const uint8_t byte = *(*p)++;
+        *v |= (uint64_t) (byte & 0x7f) << shift;
+        if (!(byte & 0x80))
+            return true;
+    }
+    return false;
+}
+
+static void put_be(uint8_t *p, uint64_t v, int size) {
+    for (int i = size - 1; i >= 0; --i, v >>= 8)
+        p[i] = (uint8_t) v;
+}
+
+static uint64_t get_be(const uint8_t *p, int size) {
+    uint64_t v = 0;
+    for (int i = 0; i < size; ++i)
+        v = v << 8 | p[i];
+    return v;
+}
+
+static int compare(const void *a, const void *b) {
+    return strcmp(*(char *const *) a, *(char *const *) b);
+}
+
+void archive_writer_init(struct archive_writer *w, FILE *f) {
+    memset(w, 0, sizeof(struct archive_writer));
+    w->f = f;
+    if (fwrite(ARCHIVE_MAGIC, 1, sizeof(ARCHIVE_MAGIC) - 1, f) != sizeof(ARCHIVE_MAGIC) - 1)
+        err(EXIT_FAILURE, "fwrite");
+}
+
+/*
+ * Sorted distinct values of a column, the strings still belong to the writer
+ */
+static size_t build_dictionary(char **strs, size_t rows, char **dict) {
+    size_t n = 0, distinct = 0;
+
+    for (size_t i = 0; i < rows; ++i)
+        if (strs[i] != NULL)
+            dict[n++] = strs[i];
+    qsort(dict, n, sizeof(char *), compare);
+    for (size_t i = 0; i < n; ++i)
+        if (distinct == 0 || strcmp(dict[distinct - 1], dict[i]) != 0)
+            dict[distinct++] = dict[i];
+    return distinct;
+}
+
+/*
+ * Dates are deltas from the previous one, starting from min, zigzag encoded
+ */
+static void encode(struct archive_writer *w, enum archive_column col, int64_t min, struct buf *raw) {
+    char *dict[ARCHIVE_BLOCK], **found;
+    size_t dictsz, len;
+    int64_t prev = min, delta;
+
+    if (col == COL_ACTIONTIME) {
+        for (size_t i = 0; i < w->rows; ++i) {
+            delta = w->dates[i] - prev;
+            prev = w->dates[i];
+            put_varint(raw, ((uint64_t) delta << 1) ^ (uint64_t) (delta >> 63));
+        }
+    } else if (dictionary[col]) {
+        dictsz = build_dictionary(w->strs[col], w->rows, dict);
+        put_varint(raw, dictsz);
+        for (size_t i = 0; i < dictsz; ++i) {
+            len = strlen(dict[i]);
+            put_varint(raw, len);
+            buf_put(raw, dict[i], len);
+        }
+        for (size_t i = 0; i < w->rows; ++i) {
+            if (w->strs[col][i] == NULL) {
+                put_varint(raw, 0);
+                continue;
+            }
+            found = bsearch(&w->strs[col][i], dict, dictsz, sizeof(char *), compare);
+            put_varint(raw, (uint64_t) (found - dict) + 1);
+        }
+    } else {
+        for (size_t i = 0; i < w->rows; ++i) {
+            if (w->strs[col][i] == NULL) {
+                put_varint(raw, 0);
+                continue;
+            }
+            len = strlen(w->strs[col][i]);
+            put_varint(raw, len + 1);
+            buf_put(raw, w->strs[col][i], len);
+        }
+    }
+}
+
+static void flush(struct archive_writer *w) {
+    uint8_t header[HEADER_SIZE];
+    struct buf raw[COL__MAX] = {{0}};
+    uint8_t *packed[COL__MAX];
+    uLongf packedsz[COL__MAX];
+    int64_t min = w->dates[0], max = w->dates[0];
+
+    if (w->rows == 0)
+        return;
+    for (size_t i = 0; i < w->rows; ++i) {
+        min = (w->dates[i] < min) ? w->dates[i] : min;
+        max = (w->dates[i] > max) ? w->dates[i] : max;
+    }
+    put_be(header, w->rows, 4);
+    put_be(header + 4, (uint64_t) min, 8);
+    put_be(header + 12, (uint64_t) max, 8);
+    for (int col = 0; col < COL__MAX; ++col) {
+        encode(w, col, min, &raw[col]);
+        if (raw[col].len > ARCHIVE_RAW_MAX)
+            errx(EXIT_FAILURE, "archive column too large");
+        packedsz[col] = compressBound(raw[col].len);
+        if ((packed[col] = malloc(packedsz[col])) == NULL)
+            err(EXIT_FAILURE, "malloc");
+        if (compress2(packed[col], &packedsz[col], raw[col].p ? raw[col].p : (uint8_t *) "", raw[col].len,
+                      Z_BEST_COMPRESSION) != Z_OK)
+            errx(EXIT_FAILURE, "compress2");
+        put_be(header + 20 + col * 8, raw[col].len, 4);
+        put_be(header + 24 + col * 8, packedsz[col], 4);
+        free(raw[col].p);
+    }
+    if (fwrite(header, 1, HEADER_SIZE, w->f) != HEADER_SIZE)
+        err(EXIT_FAILURE, "fwrite");
+    for (int col = 0; col < COL__MAX; ++col) {
+        if (fwrite(packed[col], 1, packedsz[col], w->f) != packedsz[col])
+            err(EXIT_FAILURE, "fwrite");
+        free(packed[col]);
+        for (size_t i = 0; i < w->rows; ++i)
+            free(w->strs[col][i]);
+    }
+    w->rows = 0;
+}
+
+void archive_write(struct archive_writer *w, const struct archive_row *row) {
+    const char *values[COL__MAX] = {
+        row->UUID, row->UUID_ISSUER, row->serialnum, row->IP, row->action, NULL, row->details
+    };
+
+    for (int col = 0; col < COL__MAX; ++col) {
+        w->strs[col][w->rows] = NULL;
+        if (values[col] != NULL && (w->strs[col][w->rows] = strdup(values[col])) == NULL)
+            err(EXIT_FAILURE, "strdup");
+    }
+    w->dates[w->rows] = row->actiontime;
+    if (++w->rows == ARCHIVE_BLOCK)
+        flush(w);
+}
+
+void archive_writer_finish(struct archive_writer *w) {
+    flush(w);
+    if (fflush(w->f) == EOF)
+        err(EXIT_FAILURE, "fflush");
+}
+
+bool archive_reader_init(struct archive_reader *rd, FILE *f) {
+    char magic[sizeof(ARCHIVE_MAGIC) - 1];
+
+    memset(rd, 0, sizeof(struct archive_reader));
+    rd->f = f;
+    return fread(magic, 1, sizeof(magic), f) == sizeof(magic) && memcmp(magic, ARCHIVE_MAGIC, sizeof(magic)) == 0;
+}
+
+void archive_reader_free(struct archive_reader *rd) {
+    for (int col = 0; col < COL__MAX; ++col) {
+        free(rd->cols[col].raw);
+        free(rd->cols[col].strs);
+        free(rd->cols[col].index);
+    }
+    memset(rd->cols, 0, sizeof(rd->cols));
+    rd->rows = rd->row = 0;
+}
+
+/*
+ * Copies the next length prefixed string of [*p, end) into the arena, NUL terminated
+ */
+static char *take(const uint8_t **p, const uint8_t *end, uint64_t len, char **arena) {
+    char *s = *arena;
+
+    if ((uint64_t) (end - *p) < len)
+        errx(EXIT_FAILURE, "corrupt archive");
+    memcpy(s, *p, len);
+    s[len] = '\0';
+    *p += len;
+    *arena += len + 1;
+    return s;
+}
+
+static void decode(struct archive_reader *rd, enum archive_column col, const uint8_t *packed, uLong packedsz,
+                   uLongf rawsz) {
+    struct archive_column_data *c = &rd->cols[col];
+    uint8_t *raw;
+    const uint8_t *p, *end;
+    char *arena;
+    uint64_t v, n = rd->rows;
+    int64_t delta, prev;
+    const uLongf expected = rawsz;
+
+    if ((raw = malloc(rawsz + 1)) == NULL)
+        err(EXIT_FAILURE, "malloc");
+    if (uncompress(raw, &rawsz, packed, packedsz) != Z_OK || rawsz != expected)
+        errx(EXIT_FAILURE, "corrupt archive");
+    p = raw;
+    end = raw + rawsz;
+    // Every string takes at least its length byte, so the arena never outgrows the column
+    if ((c->raw = malloc(rawsz + 1)) == NULL)
+        err(EXIT_FAILURE, "malloc");
+    arena = (char *) c->raw;
+    if (col == COL_ACTIONTIME) {
+        prev = rd->dates[0];
+        for (uint32_t i = 0; i < rd->rows; ++i) {
+            if (!get_varint(&p, end, &v))
+                errx(EXIT_FAILURE, "corrupt archive");
+            delta = (int64_t) (v >> 1) ^ -(int64_t) (v & 1);
+            rd->dates[i] = prev = prev + delta;
+        }
+    } else {
+        if (dictionary[col]) {
+            if (!get_varint(&p, end, &n) || n > rd->rows)
+                errx(EXIT_FAILURE, "corrupt archive");
+            c->dictsz = (uint32_t) n;
+        }
+        if ((c->strs = calloc(n ? n : 1, sizeof(char *))) == NULL)
+            err(EXIT_FAILURE, "calloc");
+        for (uint64_t i = 0; i < n; ++i) {
+            if (!get_varint(&p, end, &v))
+                errx(EXIT_FAILURE, "corrupt archive");
+            if (dictionary[col])
+                c->strs[i] = take(&p, end, v, &arena);
+            else if (v != 0)
+                c->strs[i] = take(&p, end, v - 1, &arena);
+        }
+        if (dictionary[col]) {
+            if ((c->index = calloc(rd->rows, sizeof(uint32_t))) == NULL)
+                err(EXIT_FAILURE, "calloc");
+            for (uint32_t i = 0; i < rd->rows; ++i) {
+                if (!get_varint(&p, end, &v) || v > c->dictsz)
+                    errx(EXIT_FAILURE, "corrupt archive");
+                c->index[i] = (uint32_t) v;
+            }
+        }
+    }
+    free(raw);
+}
+
+/*
+ * Dictionary index of value in a decoded column, 0 when it is absent
+ */
+static uint32_t lookup(const struct archive_column_data *c, const char *value) {
+    char **found = bsearch(&value, c->strs, c->dictsz, sizeof(char *), compare);
+    return found ? (uint32_t) (found - c->strs) + 1 : 0;
+}
+
+/*
+ * Reads blocks up to one that may hold a row matching filter
+ */
+static bool load_block(struct archive_reader *rd, const struct archive_filter *filter) {
+    static const enum archive_column filtered[] = {COL_ACTION, COL_UUID, COL_UUID_ISSUER};
+    uint8_t header[HEADER_SIZE], *packed;
+    const uint8_t *at[COL__MAX];
+    uint32_t rawsz[COL__MAX], packedsz[COL__MAX];
+    size_t total, got;
+    int64_t min, max;
+    bool skip;
+
+    for (;;) {
+        if ((got = fread(header, 1, HEADER_SIZE, rd->f)) == 0)
+            return false;
+        if (got != HEADER_SIZE)
+            errx(EXIT_FAILURE, "truncated archive");
+        rd->rows = (uint32_t) get_be(header, 4);
+        min = (int64_t) get_be(header + 4, 8);
+        max = (int64_t) get_be(header + 12, 8);
+        total = 0;
+        for (int col = 0; col < COL__MAX; ++col) {
+            rawsz[col] = (uint32_t) get_be(header + 20 + col * 8, 4);
+            packedsz[col] = (uint32_t) get_be(header + 24 + col * 8, 4);
+            if (rawsz[col] > ARCHIVE_RAW_MAX || packedsz[col] > ARCHIVE_RAW_MAX)
+                errx(EXIT_FAILURE, "corrupt archive");
+            total += packedsz[col];
+        }
+        if (rd->rows == 0 || rd->rows > ARCHIVE_BLOCK)
+            errx(EXIT_FAILURE, "corrupt archive");
+        if (max < filter->lower || min > filter->upper) {
+            if (fseek(rd->f, (long) total, SEEK_CUR) == -1)
+                err(EXIT_FAILURE, "fseek");
+            continue;
+        }
+        if ((packed = malloc(total ? total : 1)) == NULL)
+            err(EXIT_FAILURE, "malloc");
+        if (fread(packed, 1, total, rd->f) != total)
+            errx(EXIT_FAILURE, "truncated archive");
+        at[0] = packed;
+        for (int col = 1; col < COL__MAX; ++col)
+            at[col] = at[col - 1] + packedsz[col - 1];
+        // The filtered dictionaries go first, a value missing from one rules out the whole block
+        const char *values[COL__MAX] = {
+            [COL_UUID] = filter->UUID, [COL_UUID_ISSUER] = filter->UUID_ISSUER, [COL_ACTION] = filter->action
+        };
+        memset(rd->wanted, 0, sizeof(rd->wanted));
+        skip = false;
+        for (size_t i = 0; i < sizeof(filtered) / sizeof(filtered[0]) && !skip; ++i) {
+            if (values[filtered[i]] == NULL)
+                continue;
+            decode(rd, filtered[i], at[filtered[i]], packedsz[filtered[i]], rawsz[filtered[i]]);
+            skip = (rd->wanted[filtered[i]] = lookup(&rd->cols[filtered[i]], values[filtered[i]])) == 0;
+        }
+        if (skip) {
+            free(packed);
+            archive_reader_free(rd);
+            continue;
+        }
+        rd->dates[0] = min; // where the deltas start
+        for (int col = 0; col < COL__MAX; ++col)
+            if (rd->cols[col].raw == NULL)
+                decode(rd, col, at[col], packedsz[col], rawsz[col]);
+        free(packed);
+        rd->row = 0;
+        return true;
+    }
+}
+
+/*
+ * Whether the JSON details of a read logged by query (see audit.h) filtered on serialnum, the
+ * archived counterpart of HISTORY.queryserialnum
+ */
+static bool queried(const char *details, const char *serialnum) {
+    const char *p;
+
+    if (details == NULL || details[0] != '{' || (p = strstr(details, "\"serialnum\":\"")) == NULL)
+        return false;
+    for (p += sizeof("\"serialnum\":\"") - 1; *serialnum != '\0'; ++p, ++serialnum) {
+        if (*p == '\\')
+            ++p;
+        else if (*p == '"')
+            return false;
+        if (*p != *serialnum)
+            return false;
+    }
+    return *p == '"';
+}
+
+static const char *value(const struct archive_column_data *c, uint32_t row) {
+    return c->index[row] ? c->strs[c->index[row] - 1] : NULL;
+}
+
+bool archive_next(struct archive_reader *rd, const struct archive_filter *filter, struct archive_row *row) {
+    uint32_t i;
+
+    for (;;) {
+        if (rd->row >= rd->rows) {
+            archive_reader_free(rd);
+            if (!load_block(rd, filter))
+                return false;
+        }
+        i = rd->row++;
+        if (rd->dates[i] < filter->lower || rd->dates[i] > filter->upper)
+            continue;
+        if ((rd->wanted[COL_UUID] && rd->cols[COL_UUID].index[i] != rd->wanted[COL_UUID]) ||
+            (rd->wanted[COL_UUID_ISSUER] && rd->cols[COL_UUID_ISSUER].index[i] != rd->wanted[COL_UUID_ISSUER]) ||
+            (rd->wanted[COL_ACTION] && rd->cols[COL_ACTION].index[i] != rd->wanted[COL_ACTION]))
+            continue;
+        if (filter->serialnum && (rd->cols[COL_SERIALNUM].strs[i] == NULL ||
+                                  strcmp(rd->cols[COL_SERIALNUM].strs[i], filter->serialnum) != 0) &&
+            !queried(rd->cols[COL_DETAILS].strs[i], filter->serialnum))
+            continue;
+        row->UUID = value(&rd->cols[COL_UUID], i);
+        row->UUID_ISSUER = value(&rd->cols[COL_UUID_ISSUER], i);
+        row->serialnum = rd->cols[COL_SERIALNUM].strs[i];
+        row->IP = value(&rd->cols[COL_IP], i);
+        row->action = value(&rd->cols[COL_ACTION], i);
+        row->actiontime = rd->dates[i];
+        row->details = rd->cols[COL_DETAILS].strs[i];
+        return true;
+    }
+}
@@ -0,0 +1,117 @@
+#ifndef ARCHIVE_H
+#define ARCHIVE_H
+
+#include <stdbool.h>
+#include <stddef.h> /* size_t */
+#include <stdint.h> /* int64_t */
+#include <stdio.h> /* FILE */
+
+/*
+ * Compacted HISTORY partitions, written by compact next to the partitions rollover archived.
+ * The file is ARCHIVE_MAGIC followed by blocks of at most ARCHIVE_BLOCK rows sorted by date, each
+ * one a header (row count, first and last date, raw and zlib sizes of every column) followed by
+ * its zlib compressed columns. UUID, UUID_ISSUER, IP and action are dictionary encoded, dates are
+ * delta encoded. Integers are big endian in headers and LEB128 varints inside columns.
+ */
+#define ARCHIVE_EXT ".hca"
+#define ARCHIVE_MAGIC "HCA1"
+#define ARCHIVE_BLOCK 4096
+/*
+ * Largest decompressed column accepted from a file
+ */
+#define ARCHIVE_RAW_MAX (64 * 1024 * 1024)
+
+enum archive_column {
+    COL_UUID,
+    COL_UUID_ISSUER,
+    COL_SERIALNUM,
+    COL_IP,
+    COL_ACTION,
+    COL_ACTIONTIME,
+    COL_DETAILS,
+    COL__MAX
+};
+
+/*
+ * One HISTORY row, with action resolved to its name and actiontime the epoch compared with
+ * ?lowerdate and ?upperdate
+ */
+struct archive_row {
+    const char *UUID;
+    const char *UUID_ISSUER;
+    const char *serialnum;
+    const char *IP;
+    const char *action;
+    int64_t actiontime;
+    const char *details;
+};
+
+/*
+ * Equality filters of the history page, NULL to match anything, and an inclusive date range. As
+ * with HISTORY.queryserialnum, serialnum also matches the reads of query filtering on it.
+ */
+struct archive_filter {
+    const char *UUID;
+    const char *UUID_ISSUER;
+    const char *serialnum;
+    const char *action;
+    int64_t lower;
+    int64_t upper;
+};
+
+struct archive_column_data {
+    uint8_t *raw;
+    size_t rawsz;
+    char **strs; /* one per row, NULL for NULL */
+    uint32_t *index; /* dictionary columns: per row, 0 for NULL, i + 1 for strs[i] */
+    uint32_t dictsz;
+};
+
+struct archive_writer {
+    FILE *f;
+    size_t rows;
+    char *strs[COL__MAX][ARCHIVE_BLOCK];
+    int64_t dates[ARCHIVE_BLOCK];
+};
+
+struct archive_reader {
+    FILE *f;
+    uint32_t rows;
+    uint32_t row;
+    struct archive_column_data cols[COL__MAX];
+    int64_t dates[ARCHIVE_BLOCK];
+    uint32_t wanted[COL__MAX]; /* dictionary index of the filtered value, 0 when not filtered */
+};
+
+/*
+ * Starts writing to f, which must be open for writing
+ */
+void archive_writer_init(struct archive_writer *w, FILE *f);
+
+/*
+ * Buffers a row, rows must come sorted by actiontime
+ */
+void archive_write(struct archive_writer *w, const struct archive_row *row);
+
+/*
+ * Writes the last block, f is left open
+ */
+void archive_writer_finish(struct archive_writer *w);
+
+/*
+ * Starts reading f, false when it is not an archive
+ */
+bool archive_reader_init(struct archive_reader *rd, FILE *f);
+
+/*
+ * Gets the next row matching filter, decompressing only the blocks whose date range and
+ * dictionaries can hold one. The row is valid until the next call, false at the end of the file.
+ */
+bool archive_next(struct archive_reader *rd, const struct archive_filter *filter, struct archive_row *row);
+
+/*
+ * Frees the current block, f is left open
+ */
+void archive_reader_free(struct archive_reader *rd);
+
+#endif
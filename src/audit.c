@@ -0,0 +1,110 @@
+#include <sys/types.h> /* size_t */
+#include <sys/file.h> /* flock() */
+#include <sys/stat.h> /* fstat() */
+#include <err.h> /* err() */
+#include <errno.h> /* ENOENT */
+#include <fcntl.h> /* open() */
+#include <stdio.h> /* snprintf() */
+#include <inttypes.h> /* PRId64 */
+#include <stdint.h> /* uint32_t */
+#include <stdlib.h> /* EXIT_FAILURE */
+#include <string.h> /* strlen() */
+#include <time.h> /* time() */
+#include <unistd.h> /* write() */
+#include "audit.h"
+
+static void put32(uint8_t *p, uint32_t v) {
+    p[0] = (uint8_t) (v >> 24);
+    p[1] = (uint8_t) (v >> 16);
+    p[2] = (uint8_t) (v >> 8);
+    p[3] = (uint8_t) v;
+}
+
+/*
+ * Opens the current log under a shared lock, ingest renames it and then takes an exclusive lock
+ * to seal it, so a log found renamed once locked is given up for the new one
+ */
+static int open_log() {
+    struct stat held, current;
+    int fd;
+
+    for (;;) {
+        if ((fd = open(AUDIT_LOG, O_WRONLY | O_APPEND | O_CREAT, 0600)) == -1)
+            err(EXIT_FAILURE, "open");
+        if (flock(fd, LOCK_SH) == -1)
+            err(EXIT_FAILURE, "flock");
+        if (fstat(fd, &held) == -1)
+            err(EXIT_FAILURE, "fstat");
+        if (stat(AUDIT_LOG, &current) == -1) {
+            if (errno != ENOENT)
+                err(EXIT_FAILURE, "stat");
+        } else if (held.st_dev == current.st_dev && held.st_ino == current.st_ino)
+            return fd;
+        close(fd);
+    }
+}
+
+void audit_append(const struct audit_event *ev) {
+    const char *fields[AUDIT_FIELDS] = {ev->UUID, ev->UUID_ISSUER, ev->serialnum, ev->IP, ev->action, NULL, ev->details};
+    char date[21];
+    size_t len = 4, lens[AUDIT_FIELDS];
+    uint8_t *buf, *p;
+    int fd;
+
+    snprintf(date, sizeof(date), "%lld", (long long) time(NULL));
+    fields[5] = date;
+    for (size_t i = 0; i < AUDIT_FIELDS; ++i) {
+        lens[i] = fields[i] ? strlen(fields[i]) : 0;
+        len += 4 + lens[i];
+    }
+    if ((buf = malloc(len)) == NULL)
+        err(EXIT_FAILURE, "malloc");
+    put32(buf, (uint32_t) (len - 4));
+    p = buf + 4;
+    for (size_t i = 0; i < AUDIT_FIELDS; ++i) {
+        put32(p, fields[i] ? (uint32_t) lens[i] : UINT32_MAX);
+        memcpy(p + 4, fields[i] ? fields[i] : "", lens[i]);
+        p += 4 + lens[i];
+    }
+    fd = open_log();
+    if (write(fd, buf, len) != (ssize_t) len)
+        err(EXIT_FAILURE, "write");
+    close(fd);
+    free(buf);
+}
+
+void audit_json_string(FILE *f, const char *s) {
+    fputc('"', f);
+    for (; *s != '\0'; ++s) {
+        if (*s == '"' || *s == '\\')
+            fprintf(f, "\\%c", *s);
+        else if ((unsigned char) *s < 0x20)
+            fprintf(f, "\\u%04x", (unsigned char) *s);
+        else
+            fputc(*s, f);
+    }
+    fputc('"', f);
+}
+
+void audit_json_parms(FILE *f, const struct sqlbox_parm *parms, size_t parmsz) {
+    fputc('[', f);
+    for (size_t i = 0; i < parmsz; ++i) {
+        if (i > 0)
+            fputc(',', f);
+        switch (parms[i].type) {
+            case SQLBOX_PARM_INT:
+                fprintf(f, "%" PRId64, parms[i].iparm);
+                break;
+            case SQLBOX_PARM_STRING:
+                audit_json_string(f, parms[i].sparm);
+                break;
+            case SQLBOX_PARM_FLOAT:
+                fprintf(f, "%g", parms[i].fparm);
+                break;
+            default:
+                fputs("null", f);
+                break;
+        }
+    }
+    fputc(']', f);
+}
@@ -0,0 +1,50 @@
+#ifndef AUDIT_H
+#define AUDIT_H
+
+#include <stddef.h> /* size_t */
+#include <stdio.h> /* FILE */
+#include <sqlbox.h>
+
+/*
+ * Append-only log of HISTORY rows for the endpoints that must not write to the database on every
+ * request, moved into HISTORY by ingest. A record is its length (4 bytes, big endian) followed by
+ * AUDIT_FIELDS fields, each one its length (0xffffffff for NULL) and its bytes.
+ */
+#define AUDIT_LOG "db/audit.log"
+/*
+ * Prefix of the logs ingest renamed and did not finish moving yet
+ */
+#define AUDIT_PENDING "audit.log."
+#define AUDIT_FIELDS 7
+
+/*
+ * One HISTORY row, NULL fields stay NULL, action is an ACTION.actionName and actiontime is filled
+ * by audit_append()
+ */
+struct audit_event {
+    const char *UUID;
+    const char *UUID_ISSUER;
+    const char *serialnum;
+    const char *IP;
+    const char *action;
+    const char *details;
+};
+
+/*
+ * Appends the event with a single write(), only waiting (if at all) for ingest to finish sealing
+ * a log it just renamed
+ */
+void audit_append(const struct audit_event *ev);
+
+/*
+ * Writes s as a JSON string, for the details of the reads logged by query and search which are
+ * JSON objects ({"page": ..., "mask": ..., "serialnum": ..., "parms": [...]}, see HISTORY.querypage)
+ */
+void audit_json_string(FILE *f, const char *s);
+
+/*
+ * Writes the bound parameters of a statement as a JSON array
+ */
+void audit_json_parms(FILE *f, const struct sqlbox_parm *parms, size_t parmsz);
+
+#endif
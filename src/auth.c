@@ -1,9 +1,12 @@
 #include <sys/types.h> /* size_t, ssize_t */
+#include <sys/file.h> /* flock() */
 #include <stdarg.h> /* va_list */
 #include <stddef.h> /* NULL */
 #include <stdint.h> /* int64_t */
 #include <unistd.h> /* pledge() */
 #include <err.h> /* err(), warnx() */
+#include <errno.h> /* EWOULDBLOCK */
+#include <fcntl.h> /* open() */
 #include <inttypes.h>
 #include <stdlib.h> /* EXIT_FAILURE */
 #include <string.h> /* memset() */
@@ -16,11 +19,32 @@
 #include <pwd.h>
 #include <unistd.h>
 #include <argon2.h>
-#define HASHLEN 32
-#define SALTLEN 16
-#ifndef __BSD_VISIBLE
-#define	_PASSWORD_LEN		128
-#endif
+#include <sha2.h> /* SHA256Data() */
+#include "token.h"
+#include "ratelimit.h"
+#include "audit.h"
+#define TOKENLEN 32
+/*
+ * Token buckets of the client address (a whole classroom can share one) and of the account
+ */
+#define RATE_IP_BURST 60
+#define RATE_IP_PER_MINUTE 30
+#define RATE_UUID_BURST 5
+#define RATE_UUID_PER_MINUTE 6
+/*
+ * Every argon2id_verify() allocates the memory cost of the stored hash (m=47104 KiB), logins run
+ * in at most LOGIN_SLOTS_MAX slots (fewer on small machines, see login_slots()) while up to
+ * LOGIN_QUEUE_MAX others wait for one during LOGIN_DEADLINE milliseconds, the rest is told to come
+ * back after LOGIN_RETRY_AFTER seconds
+ */
+#define ARGON2_MEMORY (47104L * 1024)
+#define LOGIN_SLOT "db/login.slot.%d"
+#define LOGIN_SLOTS_MAX 16
+#define LOGIN_QUEUE "db/login.queue.%d"
+#define LOGIN_QUEUE_MAX 64
+#define LOGIN_DEADLINE 3000
+#define LOGIN_POLL 20
+#define LOGIN_RETRY_AFTER 5
 
 struct kreq r;
 struct kjsonreq req;
@@ -93,8 +117,9 @@ static struct sqlbox_pstmt pstmts_data[STMTS__MAX] = {
     },
     {
         (char *)
-        "INSERT INTO HISTORY (UUID, IP, action, actiondate, details) "
-        "VALUES ((?),(?),'LOGIN',datetime('now','localtime'),(?))"
+        "INSERT INTO HISTORY (UUID, IP, action, actiontime, details) "
+        "VALUES ((?),(?),(SELECT actionCode FROM ACTION WHERE actionName = 'LOGIN'),"
+        "CAST(strftime('%s', 'now') AS INTEGER),(?))"
     }
 };
 
@@ -188,20 +213,125 @@ bool check_passwd() {
     return true;
 }
 
+/*
+ * Takes a token from the buckets of the client and of the account, before any database or argon2
+ * work. Returns 0, or the seconds to wait when one of them is empty.
+ */
+int throttle() {
+    char *key;
+    int wait;
+    kasprintf(&key, "ip %s", r.remote);
+    wait = ratelimit_take(key, RATE_IP_BURST, RATE_IP_PER_MINUTE);
+    free(key);
+    if (wait == 0 && r.fieldmap[KEY_UUID]) {
+        kasprintf(&key, "uuid %s", r.fieldmap[KEY_UUID]->parsed.s);
+        wait = ratelimit_take(key, RATE_UUID_BURST, RATE_UUID_PER_MINUTE);
+        free(key);
+    }
+    return wait;
+}
+
+/*
+ * Wait of one login for a slot: how many logins were already queued on arrival and for how long
+ * (milliseconds) it waited, both end up in its HISTORY row
+ */
+struct admission {
+    int queued;
+    long waited;
+};
+
+/*
+ * One slot per core, as long as the verifications fit in a quarter of the memory
+ */
+int login_slots() {
+    const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    const long pages = sysconf(_SC_PHYS_PAGES), pagesz = sysconf(_SC_PAGESIZE);
+    long slots = (cpus > 0) ? cpus : 1;
+
+    if (pages > 0 && pagesz > 0 && pages / 4 / (ARGON2_MEMORY / pagesz) < slots)
+        slots = pages / 4 / (ARGON2_MEMORY / pagesz);
+    if (slots < 1)
+        slots = 1;
+    return (int) ((slots > LOGIN_SLOTS_MAX) ? LOGIN_SLOTS_MAX : slots);
+}
+
+/*
+ * Locks the first free file among the n named after fmt and returns it, -1 when they are all held.
+ * held (if not NULL) counts the ones found held on the way.
+ */
+int lock_any(const char *fmt, int n, int *held) {
+    char path[32];
+    int fd;
+    for (int i = 0; i < n; ++i) {
+        snprintf(path, sizeof(path), fmt, i);
+        if ((fd = open(path, O_RDWR | O_CREAT, 0600)) == -1)
+            err(EXIT_FAILURE, "open");
+        if (flock(fd, LOCK_EX | LOCK_NB) == 0)
+            return fd;
+        if (errno != EWOULDBLOCK)
+            err(EXIT_FAILURE, "flock");
+        close(fd);
+        if (held)
+            (*held)++;
+    }
+    return -1;
+}
+
+/*
+ * Returns the slot (a locked file, closing it frees the slot) the login may verify its password
+ * in, -1 when the queue is full or the deadline passed. Slots and queue places are flock()s so
+ * that they are given back even when a process dies.
+ */
+int admit(struct admission *adm) {
+    const struct timespec poll = {0, LOGIN_POLL * 1000000L};
+    const int slots = login_slots();
+    struct timespec start, now;
+    int slot, queue;
+
+    adm->queued = 0;
+    adm->waited = 0;
+    if ((slot = lock_any(LOGIN_SLOT, slots, NULL)) != -1)
+        return slot;
+    if ((queue = lock_any(LOGIN_QUEUE, LOGIN_QUEUE_MAX, &adm->queued)) == -1)
+        return -1;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    do {
+        nanosleep(&poll, NULL);
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        adm->waited = (now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000;
+    } while ((slot = lock_any(LOGIN_SLOT, slots, NULL)) == -1 && adm->waited < LOGIN_DEADLINE);
+    close(queue);
+    return slot;
+}
+
+/*
+ * Session tokens are TOKENLEN bytes of arc4random_buf() sent as unpadded base64url, SESSIONS only
+ * holds their SHA-256 (hex) so that every endpoint looks sessions up by a fixed width key and a
+ * copy of the table cannot be replayed as cookies. When a signing key is installed the token is
+ * a signed one instead (see token.h), which the endpoints verify without reading SESSIONS, the
+ * row is still written so that sessions can be listed and closed.
+ */
 void open_session() {
     size_t parmsz = 3;
-    char *timestamp, sessionID[_PASSWORD_LEN + 64];
-    kasprintf(&timestamp, "%"PRId64"", time(NULL));
-    uint8_t salt[SALTLEN];
-    arc4random_buf(salt,SALTLEN);
-    uint8_t pwd[_PASSWORD_LEN];
-    arc4random_buf(pwd,_PASSWORD_LEN);
-    uint32_t t_cost = 1;
-    uint32_t m_cost = 47104;
-    uint32_t parallelism = 1;
-    argon2id_hash_encoded(t_cost, m_cost, parallelism, pwd,_PASSWORD_LEN, salt, SALTLEN,HASHLEN, sessionID,
-                          _PASSWORD_LEN);
-    strlcat(sessionID, timestamp,_PASSWORD_LEN + 64);
+    const int maxage = (r.fieldmap[KEY_REMEMBER]) ? 7 * 24 * 60 * 60 : 60 * 60 * 3;
+    uint8_t random[TOKENLEN];
+    char *sessionID, digest[SHA256_DIGEST_STRING_LENGTH];
+    struct token tok = {
+        .UUID = curr_usr.UUID,
+        .disp_name = curr_usr.disp_name,
+        .campus = curr_usr.campus,
+        .role = curr_usr.role,
+        .perms = curr_usr.perms.numeric,
+        .frozen = curr_usr.frozen,
+        .issued = time(NULL),
+        .expires = time(NULL) + maxage
+    };
+    if ((sessionID = token_issue(&tok)) == NULL) {
+        arc4random_buf(random, TOKENLEN);
+        sessionID = kmalloc((TOKENLEN * 4 + 2) / 3 + 1);
+        b64url_encode(random, TOKENLEN, sessionID);
+    }
+    SHA256Data((const uint8_t *) sessionID, strlen(sessionID), digest);
     struct sqlbox_parm parms[] = {
         {
             .type = SQLBOX_PARM_STRING,
@@ -209,7 +339,7 @@ void open_session() {
         },
         {
             .type = SQLBOX_PARM_STRING,
-            .sparm = sessionID
+            .sparm = digest
         },
         {
             .type = SQLBOX_PARM_STRING,
@@ -222,8 +352,7 @@ void open_session() {
     khttp_head(&r, kresps[KRESP_STATUS], "%s", khttps[KHTTP_200]);
     khttp_head(&r, kresps[KRESP_CONTENT_TYPE], "%s", kmimetypes[KMIME_APP_JSON]);
     khttp_head(&r, kresps[KRESP_SET_COOKIE],
-               "sessionID=%s; Path=/; Max-Age=%d", sessionID,
-               ((r.fieldmap[KEY_REMEMBER]) ? 7 * 24 * 60 * 60 : 60 * 60 * 3));
+               "sessionID=%s; Path=/; Max-Age=%d", sessionID, maxage);
     khttp_body(&r);
     kjson_open(&req, &r);
     kjson_obj_open(&req);
@@ -248,10 +377,16 @@ void open_session() {
 
     kjson_obj_close(&req);
     kjson_obj_close(&req);
+    free(sessionID);
 }
 
-void save(const bool failed) {
+void save(const char *outcome, const struct admission *adm) {
     size_t parmsz_save = 3;
+    char *details;
+    if (adm)
+        kasprintf(&details, "%s (queued: %d, waited: %ld ms)", outcome, adm->queued, adm->waited);
+    else
+        kasprintf(&details, "%s", outcome);
     struct sqlbox_parm parms_save[] = {
         {
             .type = (r.fieldmap[KEY_UUID]) ? SQLBOX_PARM_STRING : SQLBOX_PARM_NULL,
@@ -263,22 +398,57 @@ void save(const bool failed) {
         },
         {
             .type = SQLBOX_PARM_STRING,
-            .sparm = failed ? "ACCESS DENIED" : "LOGIN SUCCESSFUL"
+            .sparm = details
         },
     };
     if (sqlbox_exec(boxctx_data, dbid_data, __STMT_STORE__, parmsz_save, parms_save,SQLBOX_STMT_CONSTRAINT) !=
         SQLBOX_CODE_OK)
         errx(EXIT_FAILURE, "sqlbox_exec");
+    free(details);
+}
+
+/*
+ * Logins turned away while busy go to the audit log (see ingest) rather than HISTORY, so that a
+ * burst of them adds no database write to the load that caused it
+ */
+void save_busy(const struct admission *adm) {
+    char *details;
+    kasprintf(&details, "LOGIN BUSY (queued: %d, waited: %ld ms)", adm->queued, adm->waited);
+    const struct audit_event ev = {
+        .UUID = (r.fieldmap[KEY_UUID]) ? r.fieldmap[KEY_UUID]->parsed.s : NULL,
+        .IP = r.remote,
+        .action = "LOGIN",
+        .details = details
+    };
+    audit_append(&ev);
+    free(details);
 }
 
 int main() {
     enum khttp er;
+    struct admission adm;
+    int slot;
+    bool verified;
+    int wait;
     if (khttp_parse(&r, keys, KEY__MAX, NULL, 0, 0) != KCGI_OK)
         return EXIT_FAILURE;
 
     khttp_head(&r, "Access-Control-Allow-Origin", "https://seele.serveo.net");
     khttp_head(&r, "Access-Control-Allow-Methods", "GET, POST, PUT, DELETE, OPTIONS");
     khttp_head(&r, "Access-Control-Allow-Credentials", "true");
+    if ((wait = throttle()) != 0) {
+        khttp_head(&r, kresps[KRESP_STATUS], "%s", khttps[KHTTP_429]);
+        khttp_head(&r, kresps[KRESP_RETRY_AFTER], "%d", wait);
+        khttp_head(&r, kresps[KRESP_CONTENT_TYPE], "%s", kmimetypes[KMIME_APP_JSON]);
+        khttp_body(&r);
+        kjson_open(&req, &r);
+        kjson_obj_open(&req);
+        kjson_putboolp(&req, "authenticated",false);
+        kjson_putstringp(&req, "error", "Too many login attempts, please wait before trying again");
+        kjson_obj_close(&req);
+        khttp_free(&r);
+        return EXIT_SUCCESS;
+    }
     alloc_ctx_cfg();
     if ((er = sanitize()) != KHTTP_200) {
         khttp_head(&r, kresps[KRESP_STATUS], "%s", khttps[er]);
@@ -286,10 +456,25 @@ int main() {
         khttp_body(&r);
         if (r.mime == KMIME_TEXT_HTML)
             khttp_puts(&r, "Could not service request.");
-        save(true);
+        save("ACCESS DENIED", NULL);
+        goto cleanup;
+    }
+    if ((slot = admit(&adm)) == -1) {
+        khttp_head(&r, kresps[KRESP_STATUS], "%s", khttps[KHTTP_503]);
+        khttp_head(&r, kresps[KRESP_RETRY_AFTER], "%d", LOGIN_RETRY_AFTER);
+        khttp_head(&r, kresps[KRESP_CONTENT_TYPE], "%s", kmimetypes[KMIME_APP_JSON]);
+        khttp_body(&r);
+        kjson_open(&req, &r);
+        kjson_obj_open(&req);
+        kjson_putboolp(&req, "authenticated",false);
+        kjson_putstringp(&req, "error", "Too many logins at once, please try again in a few seconds");
+        kjson_obj_close(&req);
+        save_busy(&adm);
         goto cleanup;
     }
-    if (check_passwd() == false) {
+    verified = check_passwd();
+    close(slot);
+    if (verified == false) {
         khttp_head(&r, kresps[KRESP_STATUS], "%s", khttps[KHTTP_200]);
         khttp_head(&r, kresps[KRESP_CONTENT_TYPE], "%s", kmimetypes[KMIME_APP_JSON]);
         khttp_body(&r);
@@ -298,11 +483,11 @@ int main() {
         kjson_putboolp(&req, "authenticated",false);
         kjson_putstringp(&req, "error", "The Username or Password that you provided are wrong");
         kjson_obj_close(&req);
-        save(true);
+        save("ACCESS DENIED", &adm);
         goto cleanup;
     }
     open_session();
-    save(false);
+    save("LOGIN SUCCESSFUL", &adm);
 cleanup:
     sqlbox_close(boxctx_data, dbid_data);
     sqlbox_free(boxctx_data);
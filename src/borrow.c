@@ -10,11 +10,21 @@
 #include <kcgi.h>
 #include <kcgijson.h>
 #include <sqlbox.h>
+#include <sha2.h> /* SHA256Data() */
 #include <stdbool.h>
 #include <stdio.h>
 #include <time.h>
 #include <pwd.h>
 #include <unistd.h>
+#include "token.h"
+#include "session.h"
+#include "audit.h"
+
+/*
+ * Most serial numbers accepted in a single request (serialnum may be repeated, one per book of
+ * the cart)
+ */
+#define CART_MAX 50
 
 struct kreq r;
 struct kjsonreq req;
@@ -66,6 +76,11 @@ enum statement {
     STMTS_INVENTORY,
     STMTS_LOGIN,
     STMTS_SAVE,
+    STMTS_STOCKMAP,
+    STMTS_CHANGES,
+    STMTS_SAVEPOINT,
+    STMTS_RELEASE,
+    STMTS_ROLLBACK_TO,
     STMTS__MAX
 };
 
@@ -75,24 +90,28 @@ static struct sqlbox_pstmt pstmts[STMTS__MAX] = {
     },
     {
         (char *)
-        "INSERT INTO INVENTORY(UUID, serialnum, rentduration, rentdate, extended) VALUES (?,?,?,datetime('now','localtime'),FALSE)"
+        "INSERT INTO INVENTORY(UUID, serialnum, rentduration, rentdate, extended, campus) "
+        "VALUES (?1,?2,?3,CAST(strftime('%s', 'now') AS INTEGER),FALSE,?4)"
     },
+    SESSION_LOGIN_PSTMT,
     {
         (char *)
-        "SELECT ACCOUNT.UUID, displayname, pwhash, campus, role, perms, frozen "
-        "FROM ROLE,"
-        "ACCOUNT "
-        "LEFT JOIN SESSIONS S on ACCOUNT.UUID = S.account "
-        "WHERE ACCOUNT.role = ROLE.roleName "
-        "AND sessionID = (?) "
-        "GROUP BY ACCOUNT.UUID, displayname, pwhash, campus, perms, frozen "
+        "INSERT INTO HISTORY (UUID,UUID_ISSUER, IP, action, actiontime, details) "
+        "VALUES ((?),(?),(?),(SELECT actionCode FROM ACTION WHERE actionName = 'BORROW'),"
+        "CAST(strftime('%s', 'now') AS INTEGER),(?))"
     },
     {
         (char *)
-        "INSERT INTO HISTORY (UUID,UUID_ISSUER, IP, action, actiondate, details) "
-        "VALUES ((?),(?),(?),'BORROW',datetime('now','localtime'),(?))"
-    }
-
+        "UPDATE STOCKMAP SET bits = bits & ~(1 << ((SELECT bookid FROM BOOK WHERE serialnum = ?1) & 63)) "
+        "WHERE campus = ?2 "
+        "AND word = (SELECT bookid FROM BOOK WHERE serialnum = ?1) >> 6 "
+        "AND EXISTS (SELECT 1 FROM STOCK WHERE serialnum = ?1 AND campus = ?2 AND instock = 0)"
+    },
+    {(char *) "SELECT changes()"},
+    // Each book of the cart is applied or undone on its own inside the transaction
+    {(char *) "SAVEPOINT item"},
+    {(char *) "RELEASE item"},
+    {(char *) "ROLLBACK TO item"}
 };
 
 struct sqlbox_src srcs[] = {
@@ -145,44 +164,31 @@ struct usr curr_usr = {
 
 void fill_user() {
     struct kpair *field;
-
-    if ((field = r.cookiemap[COOKIE_SESSIONID])) {
-        size_t stmtid;
-        size_t parmsz = 1;
-        const struct sqlbox_parmset *res;
-        struct sqlbox_parm parms[] = {
-            {.type = SQLBOX_PARM_STRING, .sparm = field->parsed.s},
-        };
-        if (!(stmtid = sqlbox_prepare_bind(boxctx, dbid, STMTS_LOGIN, parmsz, parms, 0)))
-            errx(EXIT_FAILURE, "sqlbox_prepare_bind");
-        if ((res = sqlbox_step(boxctx, stmtid)) == NULL)
-            errx(EXIT_FAILURE, "sqlbox_step");
-        if (res->psz != 0) {
-            curr_usr.authenticated = true;
-            kasprintf(&curr_usr.UUID, "%s", res->ps[0].sparm);
-
-            kasprintf(&curr_usr.disp_name, "%s", res->ps[1].sparm);
-
-            kasprintf(&curr_usr.campus, "%s", res->ps[3].sparm);
-
-            kasprintf(&curr_usr.role, "%s", res->ps[4].sparm);
-
-            kasprintf(&curr_usr.sessionID, "%s", field->parsed.s);
-
-            curr_usr.perms = int_to_accperms((int) res->ps[5].iparm);
-
-            curr_usr.frozen = res->ps[6].iparm;
-        }
-        sqlbox_finalise(boxctx, stmtid);
-    }
+    struct token tok;
+
+    if ((field = r.cookiemap[COOKIE_SESSIONID]) == NULL ||
+        !session_resolve(field->parsed.s, boxctx, dbid, STMTS_LOGIN, &tok))
+        return;
+    curr_usr.authenticated = true;
+    curr_usr.UUID = tok.UUID;
+    curr_usr.disp_name = tok.disp_name;
+    curr_usr.campus = tok.campus;
+    curr_usr.role = tok.role;
+    kasprintf(&curr_usr.sessionID, "%s", field->parsed.s);
+    curr_usr.perms = int_to_accperms(tok.perms);
+    curr_usr.frozen = tok.frozen;
 }
 
 
 enum khttp sanitize() {
+    size_t serialsz = 0;
     if (r.method != KMETHOD_GET)
         return KHTTP_405;
     if (!(r.fieldmap[KEY_SERIALNUM] && r.fieldmap[KEY_DURATION] && r.fieldmap[KEY_UUID]))
         return KHTTP_403;
+    for (struct kpair *field = r.fieldmap[KEY_SERIALNUM]; field; field = field->next)
+        if (++serialsz > CART_MAX)
+            return KHTTP_400;
     return KHTTP_200;
 }
 
@@ -195,35 +201,154 @@ enum khttp second_pass() {
     return KHTTP_200;
 }
 
-enum khttp process() {
+/*
+ * Outcome of each book of the cart, error is NULL once it is borrowed
+ */
+struct item {
+    const char *serialnum;
+    const char *error;
+};
+
+struct item items[CART_MAX];
+size_t itemsz = 0;
+
+void exec(size_t stmt) {
+    if (sqlbox_exec(boxctx, dbid, stmt, 0, NULL, 0) != SQLBOX_CODE_OK)
+        errx(EXIT_FAILURE, "sqlbox_exec");
+}
+
+int64_t changes() {
+    size_t stmtid;
+    int64_t nbr;
+    const struct sqlbox_parmset *res;
+
+    if (!(stmtid = sqlbox_prepare_bind(boxctx, dbid, STMTS_CHANGES, 0, 0, SQLBOX_STMT_MULTI)))
+        errx(EXIT_FAILURE, "sqlbox_prepare_bind");
+    if ((res = sqlbox_step(boxctx, stmtid)) == NULL)
+        errx(EXIT_FAILURE, "sqlbox_step");
+    nbr = res->ps[0].iparm;
+    sqlbox_finalise(boxctx, stmtid);
+    return nbr;
+}
+
+/*
+ * Runs a statement of a book, constraint violations are reported as error. sqlbox already sleeps
+ * and retries while SQLite reports the database busy or locked, any other failure means its server
+ * is gone and ends the request.
+ */
+const char *apply(size_t stmt, size_t parmsz, struct sqlbox_parm *parms, const char *error) {
+    switch (sqlbox_exec(boxctx, dbid, stmt, parmsz, parms, SQLBOX_STMT_CONSTRAINT)) {
+        case SQLBOX_CODE_OK:
+            return NULL;
+        case SQLBOX_CODE_CONSTRAINT:
+            return error;
+        default:
+            errx(EXIT_FAILURE, "sqlbox_exec");
+    }
+}
+
+/*
+ * Takes one copy off the shelf of the campus for the account, returns why it could not
+ */
+const char *borrow(const char *serialnum) {
     struct sqlbox_parm parms[] = {
-        {.type = SQLBOX_PARM_STRING, .sparm = r.fieldmap[KEY_SERIALNUM]->parsed.s},
+        {.type = SQLBOX_PARM_STRING, .sparm = serialnum},
         {.type = SQLBOX_PARM_STRING, .sparm = curr_usr.campus},
     };
-
     struct sqlbox_parm parms2[] = {
         {.type = SQLBOX_PARM_STRING, .sparm = r.fieldmap[KEY_UUID]->parsed.s},
-        {.type = SQLBOX_PARM_STRING, .sparm = r.fieldmap[KEY_SERIALNUM]->parsed.s},
+        {.type = SQLBOX_PARM_STRING, .sparm = serialnum},
         {.type = SQLBOX_PARM_INT, .iparm = r.fieldmap[KEY_DURATION]->parsed.i},
+        {.type = SQLBOX_PARM_STRING, .sparm = curr_usr.campus},
     };
-    sqlbox_trans_immediate(boxctx, dbid, 1);
+    const char *error;
+
+    if ((error = apply(STMTS_STOCK, 2, parms, "Empty stock")) != NULL)
+        return error;
+    if (changes() == 0)
+        return "Empty stock";
+    // The campus lost its last copy: clear the book from its in-stock bitmap
+    if ((error = apply(STMTS_STOCKMAP, 2, parms, "Stock unavailable")) != NULL)
+        return error;
+    return apply(STMTS_INVENTORY, 4, parms2, "Book already borrowed");
+}
 
-    if (sqlbox_exec(boxctx, dbid, STMTS_STOCK, 2, parms,SQLBOX_STMT_CONSTRAINT) !=
-        SQLBOX_CODE_OK) {
-        sqlbox_trans_rollback(boxctx, dbid, 1);
-        return KHTTP_400;
+/*
+ * One HISTORY row for the whole cart, details lists the books borrowed
+ */
+void save() {
+    char *details = NULL;
+    size_t detailsz = 0;
+    FILE *f;
+    bool first = true;
+
+    if ((f = open_memstream(&details, &detailsz)) == NULL)
+        err(EXIT_FAILURE, "open_memstream");
+    fprintf(f, "{\"duration\":%" PRId64 ",\"serialnums\":[", r.fieldmap[KEY_DURATION]->parsed.i);
+    for (size_t i = 0; i < itemsz; ++i) {
+        if (items[i].error)
+            continue;
+        if (!first)
+            fputc(',', f);
+        audit_json_string(f, items[i].serialnum);
+        first = false;
     }
+    fputs("]}", f);
+    if (fclose(f) == EOF)
+        err(EXIT_FAILURE, "fclose");
+    struct sqlbox_parm parms[] = {
+        {.type = SQLBOX_PARM_STRING, .sparm = r.fieldmap[KEY_UUID]->parsed.s},
+        {.type = SQLBOX_PARM_STRING, .sparm = curr_usr.UUID},
+        {.type = SQLBOX_PARM_STRING, .sparm = r.remote},
+        {.type = SQLBOX_PARM_STRING, .sparm = details},
+    };
+    if (sqlbox_exec(boxctx, dbid, STMTS_SAVE, 4, parms, SQLBOX_STMT_CONSTRAINT) != SQLBOX_CODE_OK)
+        errx(EXIT_FAILURE, "sqlbox_exec");
+    free(details);
+}
 
-    if (sqlbox_exec(boxctx, dbid, STMTS_INVENTORY, 3, parms2,SQLBOX_STMT_CONSTRAINT) !=
-        SQLBOX_CODE_OK) {
+/*
+ * Borrows every book of the cart in a single immediate transaction, the books that cannot be
+ * borrowed are rolled back alone and reported in items
+ */
+enum khttp process() {
+    size_t borrowed = 0;
+
+    if (!sqlbox_trans_immediate(boxctx, dbid, 1))
+        errx(EXIT_FAILURE, "sqlbox_trans_immediate");
+    for (struct kpair *field = r.fieldmap[KEY_SERIALNUM]; field; field = field->next) {
+        struct item *item = &items[itemsz++];
+        item->serialnum = field->parsed.s;
+        exec(STMTS_SAVEPOINT);
+        if ((item->error = borrow(item->serialnum)) != NULL)
+            exec(STMTS_ROLLBACK_TO);
+        else
+            borrowed++;
+        exec(STMTS_RELEASE);
+    }
+    if (borrowed == 0) {
         sqlbox_trans_rollback(boxctx, dbid, 1);
         return KHTTP_400;
     }
-    sqlbox_trans_commit(boxctx, dbid, 1);
-
+    save();
+    if (!sqlbox_trans_commit(boxctx, dbid, 1))
+        errx(EXIT_FAILURE, "sqlbox_trans_commit");
     return KHTTP_200;
 }
 
+void put_items() {
+    kjson_arrayp_open(&req, "items");
+    for (size_t i = 0; i < itemsz; ++i) {
+        kjson_obj_open(&req);
+        kjson_putstringp(&req, "serialnum", items[i].serialnum);
+        kjson_putboolp(&req, "borrowed", items[i].error == NULL);
+        if (items[i].error)
+            kjson_putstringp(&req, "error", items[i].error);
+        kjson_obj_close(&req);
+    }
+    kjson_array_close(&req);
+}
+
 int main() {
     enum khttp er;
     if (khttp_parse(&r, keys, KEY__MAX, 0, 0, 0) != KCGI_OK)
@@ -262,6 +387,7 @@ int main() {
         kjson_obj_close(&req);
     }
 
+    put_items();
     kjson_putstringp(&req, "status", "Book borrowed successfully!");
     kjson_obj_close(&req);
     kjson_close(&req);
@@ -293,6 +419,7 @@ access_denied:
         kjson_obj_close(&req);
     }
 
+    put_items();
     kjson_putstringp(&req, "error", "Empty Stock,Book already borrowed or Permission denied!");
     kjson_obj_close(&req);
     kjson_close(&req);
@@ -0,0 +1,133 @@
+#include <sys/types.h> /* size_t */
+#include <stdarg.h> /* va_list */
+#include <stddef.h> /* NULL */
+#include <stdint.h> /* int64_t */
+#include <err.h> /* err(), warnx() */
+#include <limits.h> /* PATH_MAX */
+#include <stdlib.h> /* EXIT_FAILURE */
+#include <string.h> /* memset() */
+#include <unistd.h> /* fsync() */
+#include <sqlbox.h>
+#include <stdio.h>
+#include "archive.h"
+
+/*
+ * Command line tool converting HISTORY partitions (see history.h), usually the ones rollover moved
+ * to HISTORY_ARCHIVE, into compacted archives (see archive.h) written next to them as
+ * YYYY-MM.hca, which the history page reads with ?archive=1. A partition is deleted once its
+ * archive is safely written, an existing archive is never overwritten.
+ * Usage: compact partition...
+ */
+
+enum statement {
+    STMTS_ROWS,
+    STMTS__MAX
+};
+
+static struct sqlbox_pstmt pstmts[STMTS__MAX] = {
+    {
+        (char *)
+        "SELECT H.UUID, UUID_ISSUER, serialnum, IP, actionName, actiontime, details "
+        "FROM HISTORY H LEFT JOIN ACTION ON actionCode = H.action "
+        "ORDER BY actiontime"
+    },
+};
+
+struct sqlbox_src srcs[] = {
+    {
+        .fname = NULL,
+        .mode = SQLBOX_SRC_RO
+    }
+};
+struct sqlbox *boxctx;
+struct sqlbox_cfg cfg;
+size_t dbid;
+
+void alloc_ctx_cfg() {
+    memset(&cfg, 0, sizeof(struct sqlbox_cfg));
+    cfg.msg.func_short = warnx;
+    cfg.srcs.srcsz = 1;
+    cfg.srcs.srcs = srcs;
+    cfg.stmts.stmtsz = STMTS__MAX;
+    cfg.stmts.stmts = pstmts;
+    if ((boxctx = sqlbox_alloc(&cfg)) == NULL)
+        errx(EXIT_FAILURE, "sqlbox_alloc");
+    if (!(dbid = sqlbox_open(boxctx, 0)))
+        errx(EXIT_FAILURE, "sqlbox_open");
+}
+
+static const char *text(const struct sqlbox_parm *parm) {
+    return (parm->type == SQLBOX_PARM_STRING) ? parm->sparm : NULL;
+}
+
+/*
+ * Writes the archive of one partition, returns the number of rows archived
+ */
+int64_t compact(const char *partition, const char *archive) {
+    char tmp[PATH_MAX];
+    size_t stmtid;
+    int64_t rows = 0;
+    const struct sqlbox_parmset *res;
+    static struct archive_writer w;
+    struct archive_row row;
+    FILE *f;
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", archive);
+    if ((f = fopen(tmp, "w")) == NULL)
+        err(EXIT_FAILURE, "%s", tmp);
+    archive_writer_init(&w, f);
+    srcs[0].fname = (char *) partition;
+    alloc_ctx_cfg();
+    if (!(stmtid = sqlbox_prepare_bind(boxctx, dbid, STMTS_ROWS, 0, 0, SQLBOX_STMT_MULTI)))
+        errx(EXIT_FAILURE, "sqlbox_prepare_bind");
+    while ((res = sqlbox_step(boxctx, stmtid)) != NULL && res->code == SQLBOX_CODE_OK && res->psz != 0) {
+        row.UUID = text(&res->ps[0]);
+        row.UUID_ISSUER = text(&res->ps[1]);
+        row.serialnum = text(&res->ps[2]);
+        row.IP = text(&res->ps[3]);
+        row.action = text(&res->ps[4]);
+        row.actiontime = res->ps[5].iparm;
+        row.details = text(&res->ps[6]);
+        archive_write(&w, &row);
+        rows++;
+    }
+    if (res == NULL || res->code != SQLBOX_CODE_OK)
+        errx(EXIT_FAILURE, "sqlbox_step");
+    if (!sqlbox_finalise(boxctx, stmtid))
+        errx(EXIT_FAILURE, "sqlbox_finalise");
+    sqlbox_free(boxctx);
+    archive_writer_finish(&w);
+    if (fsync(fileno(f)) == -1)
+        err(EXIT_FAILURE, "fsync");
+    fclose(f);
+    if (rename(tmp, archive) == -1)
+        err(EXIT_FAILURE, "rename");
+    return rows;
+}
+
+int main(int argc, char *argv[]) {
+    char archive[PATH_MAX];
+    size_t len;
+    int status = EXIT_SUCCESS;
+
+    if (argc < 2)
+        errx(EXIT_FAILURE, "usage: compact partition...");
+    for (int i = 1; i < argc; ++i) {
+        len = strlen(argv[i]);
+        if (len < sizeof(".db") || strcmp(argv[i] + len - sizeof(".db") + 1, ".db") != 0) {
+            warnx("%s: not a partition", argv[i]);
+            status = EXIT_FAILURE;
+            continue;
+        }
+        snprintf(archive, sizeof(archive), "%.*s" ARCHIVE_EXT, (int) (len - sizeof(".db") + 1), argv[i]);
+        if (access(archive, F_OK) == 0) {
+            warnx("%s: already exists", archive);
+            status = EXIT_FAILURE;
+            continue;
+        }
+        printf("%s: %lld rows archived\n", archive, (long long) compact(argv[i], archive));
+        if (unlink(argv[i]) == -1)
+            err(EXIT_FAILURE, "unlink");
+    }
+    return status;
+}
@@ -10,11 +10,14 @@
 #include <kcgi.h>
 #include <kcgijson.h>
 #include <sqlbox.h>
+#include <sha2.h> /* SHA256Data() */
 #include <stdbool.h>
 #include <stdio.h>
 #include <time.h>
 #include <pwd.h>
 #include <unistd.h>
+#include "token.h"
+#include "session.h"
 struct kreq r;
 struct kjsonreq req;
 
@@ -44,20 +47,12 @@ static const struct kvalid keys[KEY__MAX] = {
 static struct sqlbox_pstmt pstmts[STMTS__MAX] = {
     {(char *) "DELETE FROM SESSIONS WHERE sessionID = (?)"},
     {(char *) "DELETE FROM SESSIONS WHERE account = (?)"},
+    SESSION_LOGIN_PSTMT,
     {
         (char *)
-        "SELECT ACCOUNT.UUID, displayname, pwhash, campus, role, perms, frozen "
-        "FROM ROLE,"
-        "ACCOUNT "
-        "LEFT JOIN SESSIONS S on ACCOUNT.UUID = S.account "
-        "WHERE ACCOUNT.role = ROLE.roleName "
-        "AND sessionID = (?) "
-        "GROUP BY ACCOUNT.UUID, displayname, pwhash, campus, perms, frozen "
-    },
-    {
-        (char *)
-        "INSERT INTO HISTORY (UUID,UUID_ISSUER, IP, action, actiondate, details) "
-        "VALUES ((?),(?),(?),'LOGOUT',datetime('now','localtime'),(?))"
+        "INSERT INTO HISTORY (UUID,UUID_ISSUER, IP, action, actiontime, details) "
+        "VALUES ((?),(?),(?),(SELECT actionCode FROM ACTION WHERE actionName = 'LOGOUT'),"
+        "CAST(strftime('%s', 'now') AS INTEGER),(?))"
     },
 };
 
@@ -132,39 +127,20 @@ struct usr curr_usr = {
 
 void fill_user() {
     struct kpair *field;
-    if (r.cookiemap[KEY_SESSION] || r.fieldmap[KEY_SESSION]) {
-        if (r.cookiemap[KEY_SESSION])
-            field = r.cookiemap[KEY_SESSION];
-        else
-            field = r.fieldmap[KEY_SESSION];
-        size_t stmtid;
-        size_t parmsz = 1;
-        const struct sqlbox_parmset *res;
-        struct sqlbox_parm parms[] = {
-            {.type = SQLBOX_PARM_STRING, .sparm = field->parsed.s},
-        };
-        if (!(stmtid = sqlbox_prepare_bind(boxctx_data, dbid_data, __STMTS_LOGIN__, parmsz, parms, 0)))
-            errx(EXIT_FAILURE, "sqlbox_prepare_bind");
-        if ((res = sqlbox_step(boxctx_data, stmtid)) == NULL)
-            errx(EXIT_FAILURE, "sqlbox_step");
-        if (res->psz != 0) {
-            curr_usr.authenticated = true;
-            kasprintf(&curr_usr.UUID, "%s", res->ps[0].sparm);
-
-            kasprintf(&curr_usr.disp_name, "%s", res->ps[1].sparm);
-
-            kasprintf(&curr_usr.campus, "%s", res->ps[3].sparm);
+    struct token tok;
 
-            kasprintf(&curr_usr.role, "%s", res->ps[4].sparm);
-
-            kasprintf(&curr_usr.sessionID, "%s", field->parsed.s);
-
-            curr_usr.perms = int_to_accperms((int) res->ps[5].iparm);
-
-            curr_usr.frozen = res->ps[6].iparm;
-        }
-        sqlbox_finalise(boxctx_data, stmtid);
-    }
+    if ((field = r.cookiemap[KEY_SESSION]) == NULL)
+        field = r.fieldmap[KEY_SESSION];
+    if (field == NULL || !session_resolve(field->parsed.s, boxctx_data, dbid_data, __STMTS_LOGIN__, &tok))
+        return;
+    curr_usr.authenticated = true;
+    curr_usr.UUID = tok.UUID;
+    curr_usr.disp_name = tok.disp_name;
+    curr_usr.campus = tok.campus;
+    curr_usr.role = tok.role;
+    kasprintf(&curr_usr.sessionID, "%s", field->parsed.s);
+    curr_usr.perms = int_to_accperms(tok.perms);
+    curr_usr.frozen = tok.frozen;
 }
 
 enum khttp sanitize() {
@@ -186,6 +162,7 @@ int process(const enum statement STMT) {
     size_t parmsz = 1;
     struct sqlbox_parm *parms = kcalloc(parmsz, sizeof(struct sqlbox_parm));
     int reset_cookie = 0;
+    char digest[SHA256_DIGEST_STRING_LENGTH];
     parms[0].type = SQLBOX_PARM_STRING;
     if (r.fieldmap[KEY_SESSIONMOD])
         parms[0].sparm = r.fieldmap[KEY_SESSIONMOD]->parsed.s;
@@ -195,12 +172,19 @@ int process(const enum statement STMT) {
         parms[0].sparm = curr_usr.UUID;
         reset_cookie = 1;
     } else {
-        parms[0].sparm = curr_usr.sessionID;
+        SHA256Data((const uint8_t *) curr_usr.sessionID, strlen(curr_usr.sessionID), digest);
+        parms[0].sparm = digest;
         reset_cookie = 1;
     }
     if (sqlbox_exec(boxctx_data, dbid_data, STMT, parmsz, parms,SQLBOX_STMT_CONSTRAINT) !=
         SQLBOX_CODE_OK)
         errx(EXIT_FAILURE, "sqlbox_exec");
+    // Signed tokens and cached sessions are not looked up in SESSIONS, they have to be dropped as well
+    token_revoke((STMT == STMTS_LOGOUTALL) ? REVOKE_ACCOUNT : REVOKE_SESSION, parms[0].sparm);
+    if (STMT == STMTS_LOGOUTALL)
+        session_invalidate();
+    else
+        session_forget(parms[0].sparm);
     free(parms);
     return reset_cookie;
 }
@@ -211,7 +195,9 @@ void save(const enum statement STMT, const int self) {
         if (STMT == STMTS_LOGOUTALL) {
             kasprintf(&requestDesc, "DEAUTH ALL");
         } else {
-            kasprintf(&requestDesc, "DEAUTH OWN SESSION: %s", curr_usr.sessionID);
+            char digest[SHA256_DIGEST_STRING_LENGTH];
+            SHA256Data((const uint8_t *) curr_usr.sessionID, strlen(curr_usr.sessionID), digest);
+            kasprintf(&requestDesc, "DEAUTH OWN SESSION: %s", digest);
         }
     } else if (r.fieldmap[KEY_SESSIONMOD]) {
         kasprintf(&requestDesc, "DEAUTH SESSION: %s", r.fieldmap[KEY_SESSIONMOD]->parsed.s);
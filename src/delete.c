@@ -10,11 +10,15 @@
 #include <kcgi.h>
 #include <kcgijson.h>
 #include <sqlbox.h>
+#include <sha2.h> /* SHA256Data() */
 #include <stdbool.h>
 #include <stdio.h>
 #include <time.h>
 #include <pwd.h>
 #include <unistd.h>
+#include "token.h"
+#include "session.h"
+#include "searchkey.h"
 
 struct kreq r;
 struct kjsonreq req;
@@ -142,6 +146,9 @@ enum statement {
     STMTS_SAVE,
     STMTS_DEFAULT_STOCK,
     STMTS_CHANGES,
+    STMTS_SEARCHKEY_BOOKS,
+    STMTS_SEARCHKEY,
+    STMTS_SEARCHKEY_LAST = STMTS_SEARCHKEY + SEARCHKEY__MAX - 1,
     STMTS__MAX
 };
 
@@ -160,25 +167,19 @@ static struct sqlbox_pstmt pstmts[STMTS__MAX] = {
     {(char *) "DELETE FROM AUTHORED WHERE (serialnum,author) = (?,?)"},
     {(char *) "DELETE FROM STOCK WHERE (serialnum,campus) = (?,?)"},
     {(char *) "DELETE FROM INVENTORY WHERE (UUID,serialnum) =(?,?)"},
+    SESSION_LOGIN_PSTMT,
     {
         (char *)
-        "SELECT ACCOUNT.UUID, displayname, pwhash, campus, role, perms, frozen "
-        "FROM ROLE,"
-        "ACCOUNT "
-        "LEFT JOIN SESSIONS S on ACCOUNT.UUID = S.account "
-        "WHERE ACCOUNT.role = ROLE.roleName "
-        "AND sessionID = (?) "
-        "GROUP BY ACCOUNT.UUID, displayname, pwhash, campus, perms, frozen "
-    },
-    {
-        (char *)
-        "INSERT INTO HISTORY (UUID, IP, action, actiondate, details) "
-        "VALUES ((?),(?),'EDIT',datetime('now','localtime'),(?))"
+        "INSERT INTO HISTORY (UUID, IP, action, actiontime, details) "
+        "VALUES ((?),(?),(SELECT actionCode FROM ACTION WHERE actionName = 'EDIT'),"
+        "CAST(strftime('%s', 'now') AS INTEGER),(?))"
     },
     {
         (char *) "INSERT INTO STOCK(serialnum, campus) SELECT(?) AS serialnum ,campusName AS campus FROM CAMPUS"
     },
-    {(char *) "SELECT changes()"}
+    {(char *) "SELECT changes()"},
+    {(char *) "SELECT NULL"},
+    SEARCHKEY_PSTMTS
 };
 
 static enum keys switch_keys[STMTS__MAX][10] = {
@@ -197,6 +198,28 @@ static enum keys switch_keys[STMTS__MAX][10] = {
     {KEY_SERIALNUM, KEY_CAMPUS, KEY__MAX},
     {KEY_UUID, KEY_SERIALNUM, KEY__MAX}
 };
+
+/*
+ * Books whose search key embeds the deleted row, looked up by the first key of the page. Deleting a
+ * publisher, a document type or a category deletes its books along with their search words.
+ */
+static const char *searchkey_books[PG__MAX] = {
+    NULL,
+    "SELECT serialnum FROM AUTHORED WHERE author = (?)",
+    "SELECT serialnum FROM LANGUAGES WHERE lang = (?)",
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    "SELECT serialnum FROM BOOK WHERE serialnum = (?)",
+    "SELECT serialnum FROM BOOK WHERE serialnum = (?)",
+    NULL,
+    NULL
+};
+
 struct sqlbox_src srcs[] = {
     {
         .fname = (char *) "db/database.db",
@@ -247,36 +270,19 @@ struct usr curr_usr = {
 
 void fill_user() {
     struct kpair *field;
-
-    if ((field = r.cookiemap[COOKIE_SESSIONID])) {
-        size_t stmtid;
-        size_t parmsz = 1;
-        const struct sqlbox_parmset *res;
-        struct sqlbox_parm parms[] = {
-            {.type = SQLBOX_PARM_STRING, .sparm = field->parsed.s},
-        };
-        if (!(stmtid = sqlbox_prepare_bind(boxctx, dbid, STMTS_LOGIN, parmsz, parms, 0)))
-            errx(EXIT_FAILURE, "sqlbox_prepare_bind");
-        if ((res = sqlbox_step(boxctx, stmtid)) == NULL)
-            errx(EXIT_FAILURE, "sqlbox_step");
-        if (res->psz != 0) {
-            curr_usr.authenticated = true;
-            kasprintf(&curr_usr.UUID, "%s", res->ps[0].sparm);
-
-            kasprintf(&curr_usr.disp_name, "%s", res->ps[1].sparm);
-
-            kasprintf(&curr_usr.campus, "%s", res->ps[3].sparm);
-
-            kasprintf(&curr_usr.role, "%s", res->ps[4].sparm);
-
-            kasprintf(&curr_usr.sessionID, "%s", field->parsed.s);
-
-            curr_usr.perms = int_to_accperms((int) res->ps[5].iparm);
-
-            curr_usr.frozen = res->ps[6].iparm;
-        }
-        sqlbox_finalise(boxctx, stmtid);
-    }
+    struct token tok;
+
+    if ((field = r.cookiemap[COOKIE_SESSIONID]) == NULL ||
+        !session_resolve(field->parsed.s, boxctx, dbid, STMTS_LOGIN, &tok))
+        return;
+    curr_usr.authenticated = true;
+    curr_usr.UUID = tok.UUID;
+    curr_usr.disp_name = tok.disp_name;
+    curr_usr.campus = tok.campus;
+    curr_usr.role = tok.role;
+    kasprintf(&curr_usr.sessionID, "%s", field->parsed.s);
+    curr_usr.perms = int_to_accperms(tok.perms);
+    curr_usr.frozen = tok.frozen;
 }
 
 
@@ -297,10 +303,38 @@ enum khttp second_pass() {
     return KHTTP_200;
 }
 
+/*
+ * Lists the books whose search key embeds the row about to be deleted, they are refreshed once it
+ * is gone
+ */
+size_t searchkey_serials(char ***serials) {
+    size_t serialsz = 0, stmtid;
+    const struct sqlbox_parmset *res;
+    struct kpair *field;
+
+    *serials = NULL;
+    if (searchkey_books[r.page] == NULL || (field = r.fieldmap[switch_keys[r.page][0]]) == NULL)
+        return 0;
+    struct sqlbox_parm parms[] = {
+        {.type = SQLBOX_PARM_STRING, .sparm = field->parsed.s},
+    };
+    if (!(stmtid = sqlbox_prepare_bind(boxctx, dbid, STMTS_SEARCHKEY_BOOKS, 1, parms, SQLBOX_STMT_MULTI)))
+        errx(EXIT_FAILURE, "sqlbox_prepare_bind");
+    while ((res = sqlbox_step(boxctx, stmtid)) != NULL && res->code == SQLBOX_CODE_OK && res->psz != 0) {
+        *serials = kreallocarray(*serials, serialsz + 1, sizeof(char *));
+        (*serials)[serialsz++] = kstrdup(res->ps[0].sparm);
+    }
+    if (!sqlbox_finalise(boxctx, stmtid))
+        errx(EXIT_FAILURE, "sqlbox_finalise");
+    return serialsz;
+}
+
 enum khttp process() {
     struct sqlbox_parm parms[8];
     size_t parmsz = 0;
     struct kpair *field;
+    char **serials;
+    size_t serialsz;
     for (int i = 0; switch_keys[r.page][i] != KEY__MAX; ++i) {
         if ((field = r.fieldmap[switch_keys[r.page][i]])) {
             switch (field->type) {
@@ -318,9 +352,17 @@ enum khttp process() {
         }
     }
 
+    if (!sqlbox_trans_immediate(boxctx, dbid, 1))
+        errx(EXIT_FAILURE, "sqlbox_trans_immediate");
+    serialsz = searchkey_serials(&serials);
     if ((sqlbox_exec(boxctx, dbid, r.page, parmsz, parms,SQLBOX_STMT_CONSTRAINT)) !=
-        SQLBOX_CODE_OK)
+        SQLBOX_CODE_OK) {
+        sqlbox_trans_rollback(boxctx, dbid, 1);
+        for (size_t i = 0; i < serialsz; ++i)
+            free(serials[i]);
+        free(serials);
         return KHTTP_400;
+    }
     size_t stmtid_count;
     const struct sqlbox_parmset *res;
     if (!(stmtid_count = sqlbox_prepare_bind(boxctx, dbid, STMTS_CHANGES, 0, 0, SQLBOX_STMT_MULTI)))
@@ -329,10 +371,32 @@ enum khttp process() {
         errx(EXIT_FAILURE, "sqlbox_step");
     const int nbr = (int) res->ps[0].iparm;
     sqlbox_finalise(boxctx, stmtid_count);
+    for (size_t i = 0; i < serialsz; ++i) {
+        if (nbr != 0)
+            searchkey_refresh(boxctx, dbid, STMTS_SEARCHKEY, serials[i]);
+        free(serials[i]);
+    }
+    free(serials);
+    if (!sqlbox_trans_commit(boxctx, dbid, 1))
+        errx(EXIT_FAILURE, "sqlbox_trans_commit");
 
     return (nbr != 0) ? KHTTP_200 : KHTTP_400;
 }
 
+/*
+ * Signed session tokens and cached sessions of a deleted account, role or campus must not outlive it
+ */
+void revoke_sessions() {
+    if (r.page == PG_ACCOUNT || r.page == PG_ROLE || r.page == PG_CAMPUS)
+        session_invalidate();
+    if (r.page == PG_ACCOUNT)
+        token_revoke(REVOKE_ACCOUNT, r.fieldmap[KEY_UUID]->parsed.s);
+    else if (r.page == PG_ROLE)
+        token_revoke(REVOKE_ROLE, r.fieldmap[KEY_NAME]->parsed.s);
+    else if (r.page == PG_CAMPUS)
+        token_revoke(REVOKE_CAMPUS, r.fieldmap[KEY_NAME]->parsed.s);
+}
+
 int main() {
     enum khttp er;
     if (khttp_parse(&r, keys, KEY__MAX, pages, PG__MAX, PG__MAX) != KCGI_OK)
@@ -341,10 +405,13 @@ int main() {
     khttp_head(&r, "Access-Control-Allow-Methods", "GET, POST, PUT, DELETE, OPTIONS");
     khttp_head(&r, "Access-Control-Allow-Credentials", "true");
     if ((er = sanitize()) != KHTTP_200)goto error;
+    if (searchkey_books[r.page] != NULL)
+        pstmts[STMTS_SEARCHKEY_BOOKS].stmt = (char *) searchkey_books[r.page];
     alloc_ctx_cfg();
     fill_user();
     //if ((er = second_pass()) != KHTTP_200)goto access_denied;
     if ((er = process()) != KHTTP_200) goto access_denied;
+    revoke_sessions();
     khttp_head(&r, kresps[KRESP_STATUS], "%s", khttps[KHTTP_200]);
     khttp_head(&r, kresps[KRESP_CONTENT_TYPE], "%s", kmimetypes[KMIME_APP_JSON]);
     khttp_body(&r);
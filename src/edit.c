@@ -11,11 +11,15 @@
 #include <kcgi.h>
 #include <kcgijson.h>
 #include <sqlbox.h>
+#include <sha2.h> /* SHA256Data() */
 #include <stdbool.h>
 #include <stdio.h>
 #include <time.h>
 #include <pwd.h>
 #include <unistd.h>
+#include "searchkey.h"
+#include "token.h"
+#include "session.h"
 #define HASHLEN 32
 #define SALTLEN 16
 #ifndef __BSD_VISIBLE
@@ -246,11 +250,41 @@ static enum key_sels bottom_keys[STMTS__MAX][3] = {
     {KEY_SEL_PK, KEY_SEL_PK2, (enum key_sels) KEY__MAX}
 };
 
+/*
+ * Books whose search key embeds a row of the edited table, and the modifier that holds the new
+ * identifier of that row
+ */
+static const char *searchkey_books[STMTS__MAX] = {
+    "SELECT serialnum FROM BOOK WHERE publisher = (?)",
+    "SELECT serialnum FROM AUTHORED WHERE author = (?)",
+    "SELECT serialnum FROM LANGUAGES WHERE lang = (?)",
+    NULL,
+    "SELECT serialnum FROM BOOK WHERE type = (?)",
+    NULL,
+    NULL,
+    "SELECT serialnum FROM BOOK WHERE category = (?)",
+    NULL,
+    "SELECT serialnum FROM BOOK WHERE serialnum = (?)",
+    "SELECT serialnum FROM BOOK WHERE serialnum = (?)",
+    "SELECT serialnum FROM BOOK WHERE serialnum = (?)",
+    NULL,
+    NULL
+};
+static enum key_mods searchkey_keys[STMTS__MAX] = {
+    KEY_MOD_NAME, KEY_MOD_NAME, KEY_MOD_NAME, KEY__MAX, KEY_MOD_NAME, KEY__MAX, KEY__MAX, KEY_MOD_CLASS, KEY__MAX,
+    KEY_MOD_SERIALNUM, KEY_MOD_SERIALNUM, KEY_MOD_SERIALNUM, KEY__MAX, KEY__MAX
+};
+
 enum statement {
     STMT_EDIT,
     __STMT_SAVE__,
     __STMT_LOGIN__,
     __STMT_COUNT__,
+    __STMT_SEARCHKEY_BOOKS__,
+    __STMT_SEARCHKEY__,
+    __STMT_SEARCHKEY_LAST__ = __STMT_SEARCHKEY__ + SEARCHKEY__MAX - 1,
+    __STMT_STOCKMAP_CLEAR__,
+    __STMT_STOCKMAP_SET__,
     STMT__REAL__MAX
 };
 
@@ -258,20 +292,30 @@ static struct sqlbox_pstmt pstmts[STMT__REAL__MAX] = {
     {NULL},
     {
         (char *)
-        "INSERT INTO HISTORY (UUID, IP, action, actiondate, details) "
-        "VALUES ((?),(?),'EDIT',datetime('now','localtime'),(?))"
+        "INSERT INTO HISTORY (UUID, IP, action, actiontime, details) "
+        "VALUES ((?),(?),(SELECT actionCode FROM ACTION WHERE actionName = 'EDIT'),"
+        "CAST(strftime('%s', 'now') AS INTEGER),(?))"
     },
+    SESSION_LOGIN_PSTMT,
+    {(char *) "SELECT changes()"},
+    {(char *) "SELECT NULL"},
+    SEARCHKEY_PSTMTS,
     {
         (char *)
-        "SELECT ACCOUNT.UUID, displayname, pwhash, campus, role, perms, frozen "
-        "FROM ROLE,"
-        "ACCOUNT "
-        "LEFT JOIN SESSIONS S on ACCOUNT.UUID = S.account "
-        "WHERE ACCOUNT.role = ROLE.roleName "
-        "AND sessionID = (?) "
-        "GROUP BY ACCOUNT.UUID, displayname, pwhash, campus, perms, frozen "
+        "UPDATE STOCKMAP SET bits = bits & ~(1 << ((SELECT bookid FROM BOOK WHERE serialnum = ?1) & 63)) "
+        "WHERE campus = ?2 "
+        "AND word = (SELECT bookid FROM BOOK WHERE serialnum = ?1) >> 6 "
+        "AND NOT EXISTS (SELECT 1 FROM STOCK WHERE serialnum = ?1 AND campus = ?2 AND instock > 0)"
     },
-    {(char *) "SELECT changes()"}
+    {
+        (char *)
+        "INSERT INTO STOCKMAP (campus, word, bits) "
+        "SELECT ?2, bookid >> 6, 1 << (bookid & 63) "
+        "FROM BOOK "
+        "WHERE serialnum = ?1 "
+        "AND EXISTS (SELECT 1 FROM STOCK WHERE serialnum = ?1 AND campus = ?2 AND instock > 0) "
+        "ON CONFLICT (campus, word) DO UPDATE SET bits = bits | excluded.bits"
+    }
 };
 
 
@@ -346,40 +390,20 @@ struct usr curr_usr = {
 
 void fill_user() {
     struct kpair *field;
-
-    if (r.cookiemap[COOKIE_SESSIONID] || r.fieldmap[COOKIE_SESSIONID]) {
-        if (r.cookiemap[COOKIE_SESSIONID])
-            field = r.cookiemap[COOKIE_SESSIONID];
-        else
-            field = r.fieldmap[COOKIE_SESSIONID];
-        size_t stmtid;
-        size_t parmsz = 1;
-        const struct sqlbox_parmset *res;
-        struct sqlbox_parm parms[] = {
-            {.type = SQLBOX_PARM_STRING, .sparm = field->parsed.s},
-        };
-        if (!(stmtid = sqlbox_prepare_bind(boxctx_data, dbid_data, __STMT_LOGIN__, parmsz, parms, 0)))
-            errx(EXIT_FAILURE, "sqlbox_prepare_bind");
-        if ((res = sqlbox_step(boxctx_data, stmtid)) == NULL)
-            errx(EXIT_FAILURE, "sqlbox_step");
-        if (res->psz != 0) {
-            curr_usr.authenticated = true;
-            kasprintf(&curr_usr.UUID, "%s", res->ps[0].sparm);
-
-            kasprintf(&curr_usr.disp_name, "%s", res->ps[1].sparm);
-
-            kasprintf(&curr_usr.campus, "%s", res->ps[3].sparm);
-
-            kasprintf(&curr_usr.role, "%s", res->ps[4].sparm);
-
-            kasprintf(&curr_usr.sessionID, "%s", field->parsed.s);
-
-            curr_usr.perms = int_to_accperms((int) res->ps[5].iparm);
-
-            curr_usr.frozen = res->ps[6].iparm;
-        }
-        sqlbox_finalise(boxctx_data, stmtid);
-    }
+    struct token tok;
+
+    if ((field = r.cookiemap[COOKIE_SESSIONID]) == NULL)
+        field = r.fieldmap[COOKIE_SESSIONID];
+    if (field == NULL || !session_resolve(field->parsed.s, boxctx_data, dbid_data, __STMT_LOGIN__, &tok))
+        return;
+    curr_usr.authenticated = true;
+    curr_usr.UUID = tok.UUID;
+    curr_usr.disp_name = tok.disp_name;
+    curr_usr.campus = tok.campus;
+    curr_usr.role = tok.role;
+    kasprintf(&curr_usr.sessionID, "%s", field->parsed.s);
+    curr_usr.perms = int_to_accperms(tok.perms);
+    curr_usr.frozen = tok.frozen;
 }
 
 enum khttp sanitize() {
@@ -512,6 +536,82 @@ int process(const enum statement_comp STMT, const int parmsz) {
 }
 
 
+/*
+ * Refreshes the search key of every book that embeds the edited row, looked up both by its old
+ * identifier (key1) and by its new one when it was modified
+ */
+void refresh_searchkeys(const enum statement_comp STMT) {
+    const char *ids[2] = {NULL, NULL};
+    char **serials = NULL;
+    size_t serialsz = 0, stmtid;
+    const struct sqlbox_parmset *res;
+
+    if (searchkey_books[STMT] == NULL)
+        return;
+    ids[0] = r.fieldmap[KEY_SEL_PK]->parsed.s;
+    if (r.fieldmap[searchkey_keys[STMT]])
+        ids[1] = r.fieldmap[searchkey_keys[STMT]]->parsed.s;
+    for (int i = 0; i < 2 && ids[i] != NULL; ++i) {
+        struct sqlbox_parm parms[] = {
+            {.type = SQLBOX_PARM_STRING, .sparm = ids[i]},
+        };
+        if (!(stmtid = sqlbox_prepare_bind(boxctx_data, dbid_data, __STMT_SEARCHKEY_BOOKS__, 1, parms,
+                                           SQLBOX_STMT_MULTI)))
+            errx(EXIT_FAILURE, "sqlbox_prepare_bind");
+        while ((res = sqlbox_step(boxctx_data, stmtid)) != NULL && res->code == SQLBOX_CODE_OK && res->psz != 0) {
+            serials = kreallocarray(serials, serialsz + 1, sizeof(char *));
+            serials[serialsz++] = kstrdup(res->ps[0].sparm);
+        }
+        if (!sqlbox_finalise(boxctx_data, stmtid))
+            errx(EXIT_FAILURE, "sqlbox_finalise");
+    }
+    for (size_t i = 0; i < serialsz; ++i) {
+        searchkey_refresh(boxctx_data, dbid_data, __STMT_SEARCHKEY__, serials[i]);
+        free(serials[i]);
+    }
+    free(serials);
+}
+
+/*
+ * Signed session tokens and the session cache carry the account, its role and its campus, editing
+ * any of them revokes every token issued so far for the edited row (key1) and empties the cache so
+ * that freezes and permission changes apply at once
+ */
+void revoke_sessions(const enum statement_comp STMT) {
+    if (STMT == STMTS_ACCOUNT || STMT == STMTS_ROLE || STMT == STMTS_CAMPUS)
+        session_invalidate();
+    if (STMT == STMTS_ACCOUNT)
+        token_revoke(REVOKE_ACCOUNT, r.fieldmap[KEY_SEL_PK]->parsed.s);
+    else if (STMT == STMTS_ROLE)
+        token_revoke(REVOKE_ROLE, r.fieldmap[KEY_SEL_PK]->parsed.s);
+    else if (STMT == STMTS_CAMPUS)
+        token_revoke(REVOKE_CAMPUS, r.fieldmap[KEY_SEL_PK]->parsed.s);
+}
+
+/*
+ * Brings the campus in-stock bitmaps in line with an edited STOCK row, both for the row it was
+ * (key1, key2) and for the one it became
+ */
+void refresh_stockmap() {
+    const char *serials[2] = {r.fieldmap[KEY_SEL_PK]->parsed.s, r.fieldmap[KEY_SEL_PK]->parsed.s};
+    const char *campuses[2] = {r.fieldmap[KEY_SEL_PK2]->parsed.s, r.fieldmap[KEY_SEL_PK2]->parsed.s};
+
+    if (r.fieldmap[KEY_MOD_SERIALNUM])
+        serials[1] = r.fieldmap[KEY_MOD_SERIALNUM]->parsed.s;
+    if (r.fieldmap[KEY_MOD_CAMPUS])
+        campuses[1] = r.fieldmap[KEY_MOD_CAMPUS]->parsed.s;
+    for (int i = 0; i < 2; ++i) {
+        struct sqlbox_parm parms[] = {
+            {.type = SQLBOX_PARM_STRING, .sparm = serials[i]},
+            {.type = SQLBOX_PARM_STRING, .sparm = campuses[i]},
+        };
+        if (sqlbox_exec(boxctx_data, dbid_data, __STMT_STOCKMAP_CLEAR__, 2, parms, 0) != SQLBOX_CODE_OK)
+            errx(EXIT_FAILURE, "sqlbox_exec");
+        if (sqlbox_exec(boxctx_data, dbid_data, __STMT_STOCKMAP_SET__, 2, parms, 0) != SQLBOX_CODE_OK)
+            errx(EXIT_FAILURE, "sqlbox_exec");
+    }
+}
+
 void save(const enum statement_comp STMT, const bool failed, const int affected) {
     char *requestDesc = NULL;
     if (!failed) {
@@ -590,6 +690,8 @@ int main() {
     int nbr_parms = 0;
     if ((er = second_pass(STMT, &nbr_parms)) != KHTTP_200)goto error;
     if ((er = third_pass(STMT, &nbr_parms)) != KHTTP_200)goto error;
+    if (searchkey_books[STMT] != NULL)
+        pstmts[__STMT_SEARCHKEY_BOOKS__].stmt = (char *) searchkey_books[STMT];
     alloc_ctx_cfg();
     fill_user();
     //if ((er = forth_pass(STMT)) != KHTTP_200)goto access_denied;
@@ -620,6 +722,12 @@ int main() {
     }
     kjson_obj_close(&req);
     const int affected = process(STMT, nbr_parms);
+    if (affected > 0)
+        refresh_searchkeys(STMT);
+    if (affected > 0 && STMT == STMTS_STOCK)
+        refresh_stockmap();
+    if (affected > 0)
+        revoke_sessions(STMT);
     kjson_putintp(&req, "changes", affected);
     kjson_obj_close(&req);
     kjson_close(&req);
@@ -0,0 +1,553 @@
+#include <sys/types.h> /* size_t, ssize_t */
+#include <sys/file.h> /* flock() */
+#include <sys/stat.h> /* fstat() */
+#include <dirent.h> /* scandir() */
+#include <stdarg.h> /* va_list */
+#include <stddef.h> /* NULL */
+#include <stdint.h> /* int64_t */
+#include <err.h> /* err(), warnx() */
+#include <errno.h> /* ENOENT */
+#include <fcntl.h> /* open() */
+#include <math.h> /* ldexp(), log() */
+#include <stdbool.h>
+#include <stdlib.h> /* EXIT_FAILURE */
+#include <string.h> /* memset() */
+#include <time.h> /* time() */
+#include <unistd.h> /* sleep() */
+#include <sqlbox.h>
+#include <stdio.h>
+#include "hitlog.h"
+
+/*
+ * Daemon folding the views appended by hit into BOOK.hits, to be run from the directory holding
+ * db/ (the chroot of the endpoints). Every INTERVAL seconds the current log is renamed to
+ * db/hits.log.<epoch>.<pid> and each renamed log is folded in a single transaction, so at most
+ * INTERVAL seconds of hits are ever waiting in the log if the machine goes down before they reach
+ * the disk. The transaction folding a log records its name in HITFOLD, so a fold cut short before
+ * the commit is redone by the next one and a fold cut short after it only has the file left to
+ * remove.
+ * Usage: fold [database]
+ */
+
+#define INTERVAL 60 /* seconds */
+#define HITS_DIR "db"
+/*
+ * Each fold also adds the hits to the hourly and daily buckets of their books and keeps the
+ * TRENDING counts of books, authors, publishers and languages over the last 24 hours (HITHOUR)
+ * and the last 7 and 30 days (HITDAY) by deltas: the rows of the books just viewed get their hits
+ * added, and the buckets leaving a span since the last fold (TRENDINGSPAN holds the first bucket
+ * of each span) get theirs subtracted, rows falling to 0 are dropped. Hits are credited to the
+ * authors, publisher and languages a book has when they are added or subtracted. Buckets older
+ * than the longest span are dropped.
+ */
+#define TRENDING_UPSERT(h) \
+    "INSERT INTO TRENDING (span, kind, name, hits) " \
+    "WITH H(serialnum, hits) AS (" h ") " \
+    "SELECT (?1), 'book', serialnum, H.hits FROM H JOIN BOOK USING (serialnum) " \
+    "UNION ALL " \
+    "SELECT (?1), 'author', author, H.hits FROM H JOIN AUTHORED USING (serialnum) " \
+    "UNION ALL " \
+    "SELECT (?1), 'publisher', publisher, H.hits FROM H JOIN BOOK USING (serialnum) " \
+    "UNION ALL " \
+    "SELECT (?1), 'lang', lang, H.hits FROM H JOIN LANGUAGES USING (serialnum) WHERE true " \
+    "ON CONFLICT (span, kind, name) DO UPDATE SET hits = hits + excluded.hits"
+/*
+ * Unique viewers are counted with one HyperLogLog sketch per book and day (VIEWERS), made of
+ * HLL_REGISTERS one byte registers. The viewer is the account when logged in, the IP otherwise,
+ * keyhash()ed by hit. BOOK.viewers holds the estimate over the last 30 days, refreshed when the
+ * book is viewed or when one of its sketches expires.
+ */
+#define HLL_BITS 8
+#define HLL_REGISTERS (1 << HLL_BITS)
+
+enum statement {
+    STMTS_HIT,
+    STMTS_HOUR,
+    STMTS_DAY,
+    STMTS_HOUR_PRUNE,
+    STMTS_DAY_PRUNE,
+    STMTS_SPAN_GET,
+    STMTS_SPAN_SET,
+    STMTS_TRENDING_ADD,
+    STMTS_TRENDING_EXPIRE_HOUR,
+    STMTS_TRENDING_EXPIRE_DAY,
+    STMTS_TRENDING_DROP,
+    STMTS_VIEWERS_GET,
+    STMTS_VIEWERS_SET,
+    STMTS_VIEWERS_SPAN,
+    STMTS_VIEWERS_EXPIRED,
+    STMTS_VIEWERS_PRUNE,
+    STMTS_VIEWERS_COUNT,
+    STMTS_FOLDED,
+    STMTS_FOLD_RECORD,
+    STMTS_FOLD_FORGET,
+    STMTS__MAX
+};
+
+static struct sqlbox_pstmt pstmts[STMTS__MAX] = {
+    {
+        (char *) "UPDATE BOOK SET hits = hits + (?) WHERE serialnum = (?)"
+    },
+    {
+        (char *)
+        "INSERT INTO HITHOUR (hour, serialnum, hits) "
+        "SELECT (?1), serialnum, (?2) FROM BOOK WHERE serialnum = (?3) "
+        "ON CONFLICT (hour, serialnum) DO UPDATE SET hits = hits + excluded.hits"
+    },
+    {
+        (char *)
+        "INSERT INTO HITDAY (day, serialnum, hits) "
+        "SELECT (?1), serialnum, (?2) FROM BOOK WHERE serialnum = (?3) "
+        "ON CONFLICT (day, serialnum) DO UPDATE SET hits = hits + excluded.hits"
+    },
+    {(char *) "DELETE FROM HITHOUR WHERE hour <= (?) - 24"},
+    {(char *) "DELETE FROM HITDAY WHERE day <= (?) - 30"},
+    {(char *) "SELECT first FROM TRENDINGSPAN WHERE span = (?)"},
+    {(char *) "UPDATE TRENDINGSPAN SET first = (?) WHERE span = (?)"},
+    {(char *) TRENDING_UPSERT("SELECT (?3), (?2)")},
+    {
+        (char *) TRENDING_UPSERT("SELECT serialnum, -SUM(hits) FROM HITHOUR WHERE hour >= (?2) AND hour < (?3) "
+                                 "GROUP BY serialnum")
+    },
+    {
+        (char *) TRENDING_UPSERT("SELECT serialnum, -SUM(hits) FROM HITDAY WHERE day >= (?2) AND day < (?3) "
+                                 "GROUP BY serialnum")
+    },
+    {(char *) "DELETE FROM TRENDING WHERE hits <= 0"},
+    {(char *) "SELECT sketch FROM VIEWERS WHERE serialnum = (?) AND day = (?)"},
+    {
+        (char *)
+        "INSERT INTO VIEWERS (serialnum, day, sketch) "
+        "SELECT serialnum, (?2), (?3) FROM BOOK WHERE serialnum = (?1) "
+        "ON CONFLICT (serialnum, day) DO UPDATE SET sketch = excluded.sketch"
+    },
+    {(char *) "SELECT sketch FROM VIEWERS WHERE serialnum = (?) AND day > (?) - 30"},
+    {(char *) "SELECT DISTINCT serialnum FROM VIEWERS WHERE day <= (?) - 30"},
+    {(char *) "DELETE FROM VIEWERS WHERE day <= (?) - 30"},
+    {(char *) "UPDATE BOOK SET viewers = (?) WHERE serialnum = (?)"},
+    {(char *) "SELECT 1 FROM HITFOLD WHERE file = (?)"},
+    {(char *) "INSERT INTO HITFOLD (file) VALUES ((?))"},
+    {(char *) "DELETE FROM HITFOLD WHERE file = (?)"}
+};
+
+struct sqlbox_src srcs[] = {
+    {
+        .fname = (char *) "db/database.db",
+        .mode = SQLBOX_SRC_RW
+    }
+};
+struct sqlbox *boxctx;
+struct sqlbox_cfg cfg;
+size_t dbid;
+
+void alloc_ctx_cfg() {
+    memset(&cfg, 0, sizeof(struct sqlbox_cfg));
+    cfg.msg.func_short = warnx;
+    cfg.srcs.srcsz = 1;
+    cfg.srcs.srcs = srcs;
+    cfg.stmts.stmtsz = STMTS__MAX;
+    cfg.stmts.stmts = pstmts;
+    if ((boxctx = sqlbox_alloc(&cfg)) == NULL)
+        errx(EXIT_FAILURE, "sqlbox_alloc");
+    if (!(dbid = sqlbox_open(boxctx, 0)))
+        errx(EXIT_FAILURE, "sqlbox_open");
+}
+
+
+/*
+ * A TRENDING span: its name and the last buckets of width seconds it covers
+ */
+static const struct span {
+    const char *name;
+    int64_t width;
+    int64_t buckets;
+    enum statement expire;
+} spans[] = {
+    {"24h", 3600, 24, STMTS_TRENDING_EXPIRE_HOUR},
+    {"7d", 86400, 7, STMTS_TRENDING_EXPIRE_DAY},
+    {"30d", 86400, 30, STMTS_TRENDING_EXPIRE_DAY},
+};
+#define SPANS (sizeof(spans) / sizeof(spans[0]))
+
+struct hit {
+    int64_t epoch;
+    uint64_t viewer;
+    char *serialnum;
+};
+
+/*
+ * The top HLL_BITS bits pick the register, which keeps the longest run of leading zeros (+1)
+ * seen in the remaining bits
+ */
+void hll_add(unsigned char *regs, uint64_t h) {
+    uint64_t w = h << HLL_BITS;
+    unsigned char rank = 1;
+    while (rank <= 64 - HLL_BITS && !(w & ((uint64_t) 1 << 63))) {
+        rank++;
+        w <<= 1;
+    }
+    if (rank > regs[h >> (64 - HLL_BITS)])
+        regs[h >> (64 - HLL_BITS)] = rank;
+}
+
+/*
+ * Raw HyperLogLog estimate, with linear counting while many registers are still empty
+ */
+int64_t hll_estimate(const unsigned char *regs) {
+    const double m = HLL_REGISTERS, alpha = 0.7213 / (1 + 1.079 / m);
+    double sum = 0;
+    int zeros = 0;
+    for (int i = 0; i < HLL_REGISTERS; ++i) {
+        sum += ldexp(1.0, -regs[i]);
+        zeros += regs[i] == 0;
+    }
+    double e = alpha * m * m / sum;
+    if (e <= 2.5 * m && zeros > 0)
+        e = m * log(m / zeros);
+    return (int64_t) (e + 0.5);
+}
+
+/*
+ * Adds the viewers of a run of hits of the same book and day to the sketch of that day
+ */
+void merge_viewers(const struct hit *hits, size_t hitsz) {
+    size_t stmtid;
+    const struct sqlbox_parmset *res;
+    unsigned char regs[HLL_REGISTERS] = {0};
+    struct sqlbox_parm parms[] = {
+        {.type = SQLBOX_PARM_STRING, .sparm = hits[0].serialnum},
+        {.type = SQLBOX_PARM_INT, .iparm = hits[0].epoch / 86400},
+        {.type = SQLBOX_PARM_BLOB, .bparm = regs, .sz = HLL_REGISTERS},
+    };
+
+    if (!(stmtid = sqlbox_prepare_bind(boxctx, dbid, STMTS_VIEWERS_GET, 2, parms, 0)))
+        errx(EXIT_FAILURE, "sqlbox_prepare_bind");
+    if ((res = sqlbox_step(boxctx, stmtid)) == NULL)
+        errx(EXIT_FAILURE, "sqlbox_step");
+    if (res->psz != 0 && res->ps[0].type == SQLBOX_PARM_BLOB && res->ps[0].sz == HLL_REGISTERS)
+        memcpy(regs, res->ps[0].bparm, HLL_REGISTERS);
+    sqlbox_finalise(boxctx, stmtid);
+    for (size_t i = 0; i < hitsz; ++i)
+        hll_add(regs, hits[i].viewer);
+    if (sqlbox_exec(boxctx, dbid, STMTS_VIEWERS_SET, 3, parms, 0) != SQLBOX_CODE_OK)
+        errx(EXIT_FAILURE, "sqlbox_exec");
+}
+
+/*
+ * Sets BOOK.viewers from the union (register wise maximum) of the sketches of the span
+ */
+void count_viewers(const char *serialnum, int64_t today) {
+    size_t stmtid;
+    const struct sqlbox_parmset *res;
+    unsigned char regs[HLL_REGISTERS] = {0};
+    struct sqlbox_parm parms[] = {
+        {.type = SQLBOX_PARM_STRING, .sparm = serialnum},
+        {.type = SQLBOX_PARM_INT, .iparm = today},
+    };
+
+    if (!(stmtid = sqlbox_prepare_bind(boxctx, dbid, STMTS_VIEWERS_SPAN, 2, parms, SQLBOX_STMT_MULTI)))
+        errx(EXIT_FAILURE, "sqlbox_prepare_bind");
+    while ((res = sqlbox_step(boxctx, stmtid)) != NULL && res->code == SQLBOX_CODE_OK && res->psz != 0) {
+        if (res->ps[0].type != SQLBOX_PARM_BLOB || res->ps[0].sz != HLL_REGISTERS)
+            continue;
+        for (int i = 0; i < HLL_REGISTERS; ++i)
+            if (((const unsigned char *) res->ps[0].bparm)[i] > regs[i])
+                regs[i] = ((const unsigned char *) res->ps[0].bparm)[i];
+    }
+    if (!sqlbox_finalise(boxctx, stmtid))
+        errx(EXIT_FAILURE, "sqlbox_finalise");
+    struct sqlbox_parm parms_count[] = {
+        {.type = SQLBOX_PARM_INT, .iparm = hll_estimate(regs)},
+        {.type = SQLBOX_PARM_STRING, .sparm = serialnum},
+    };
+    if (sqlbox_exec(boxctx, dbid, STMTS_VIEWERS_COUNT, 2, parms_count, 0) != SQLBOX_CODE_OK)
+        errx(EXIT_FAILURE, "sqlbox_exec");
+}
+
+int cmp_hit(const void *a, const void *b) {
+    const struct hit *x = a, *y = b;
+    int cmp = strcmp(x->serialnum, y->serialnum);
+    if (cmp != 0)
+        return cmp;
+    return (x->epoch > y->epoch) - (x->epoch < y->epoch);
+}
+
+/*
+ * Whether two sorted hits fall in the same run: same book and, when width is not 0, same
+ * bucket of width seconds
+ */
+bool same_run(const struct hit *a, const struct hit *b, int64_t width) {
+    if (strcmp(a->serialnum, b->serialnum) != 0)
+        return false;
+    return width == 0 || a->epoch / width == b->epoch / width;
+}
+
+/*
+ * Moves a span up to the buckets ending now, subtracting the buckets it leaves from TRENDING.
+ * Returns its new first bucket.
+ */
+int64_t advance_span(const struct span *span, time_t now) {
+    size_t stmtid;
+    const struct sqlbox_parmset *res;
+    const int64_t first = (int64_t) now / span->width - span->buckets + 1;
+    int64_t previous = first;
+    struct sqlbox_parm parms[] = {
+        {.type = SQLBOX_PARM_STRING, .sparm = span->name},
+    };
+
+    if (!(stmtid = sqlbox_prepare_bind(boxctx, dbid, STMTS_SPAN_GET, 1, parms, 0)))
+        errx(EXIT_FAILURE, "sqlbox_prepare_bind");
+    if ((res = sqlbox_step(boxctx, stmtid)) == NULL)
+        errx(EXIT_FAILURE, "sqlbox_step");
+    if (res->psz != 0)
+        previous = res->ps[0].iparm;
+    if (!sqlbox_finalise(boxctx, stmtid))
+        errx(EXIT_FAILURE, "sqlbox_finalise");
+    if (previous >= first)
+        return previous;
+    struct sqlbox_parm parms_expire[] = {
+        {.type = SQLBOX_PARM_STRING, .sparm = span->name},
+        {.type = SQLBOX_PARM_INT, .iparm = previous},
+        {.type = SQLBOX_PARM_INT, .iparm = first},
+    };
+    if (sqlbox_exec(boxctx, dbid, span->expire, 3, parms_expire, 0) != SQLBOX_CODE_OK)
+        errx(EXIT_FAILURE, "sqlbox_exec");
+    struct sqlbox_parm parms_set[] = {
+        {.type = SQLBOX_PARM_INT, .iparm = first},
+        {.type = SQLBOX_PARM_STRING, .sparm = span->name},
+    };
+    if (sqlbox_exec(boxctx, dbid, STMTS_SPAN_SET, 2, parms_set, 0) != SQLBOX_CODE_OK)
+        errx(EXIT_FAILURE, "sqlbox_exec");
+    return first;
+}
+
+/*
+ * Whether the fold of a renamed log was already committed
+ */
+bool fold_recorded(const char *file) {
+    size_t stmtid;
+    const struct sqlbox_parmset *res;
+    bool recorded;
+    struct sqlbox_parm parms[] = {
+        {.type = SQLBOX_PARM_STRING, .sparm = file},
+    };
+
+    if (!(stmtid = sqlbox_prepare_bind(boxctx, dbid, STMTS_FOLDED, 1, parms, 0)))
+        errx(EXIT_FAILURE, "sqlbox_prepare_bind");
+    if ((res = sqlbox_step(boxctx, stmtid)) == NULL)
+        errx(EXIT_FAILURE, "sqlbox_step");
+    recorded = res->psz != 0;
+    if (!sqlbox_finalise(boxctx, stmtid))
+        errx(EXIT_FAILURE, "sqlbox_finalise");
+    return recorded;
+}
+
+/*
+ * Removes a renamed log once its fold is committed, a restart between the two only finds a
+ * recorded fold to forget
+ */
+void fold_forget(const char *path, const char *file) {
+    struct sqlbox_parm parms[] = {
+        {.type = SQLBOX_PARM_STRING, .sparm = file},
+    };
+
+    if (unlink(path) == -1 && errno != ENOENT)
+        err(EXIT_FAILURE, "unlink");
+    if (sqlbox_exec(boxctx, dbid, STMTS_FOLD_FORGET, 1, parms, 0) != SQLBOX_CODE_OK)
+        errx(EXIT_FAILURE, "sqlbox_exec");
+}
+
+/*
+ * Adds the hits of a renamed log to BOOK.hits, to the hit buckets and to TRENDING, and
+ * removes the log. Returns the number of hits folded, 0 when it was folded before a restart.
+ */
+int64_t fold_hits(const char *file, time_t now) {
+    struct stat st;
+    char path[128], *buf, *line, *end, *viewer, *serialnum, **expired = NULL;
+    struct hit *hits = NULL;
+    size_t hitsz = 0, expiredsz = 0, i, j, k, stmtid;
+    const struct sqlbox_parmset *res;
+    int64_t total = 0, first[SPANS];
+    ssize_t got;
+    size_t off = 0;
+    int fd;
+
+    snprintf(path, sizeof(path), HITS_DIR "/%s", file);
+    if ((fd = open(path, O_RDONLY)) == -1) {
+        if (errno != ENOENT)
+            err(EXIT_FAILURE, "open");
+        return 0;
+    }
+    if (flock(fd, LOCK_EX) == -1)
+        err(EXIT_FAILURE, "flock");
+    if (fstat(fd, &st) == -1)
+        err(EXIT_FAILURE, "fstat");
+    if ((buf = malloc(st.st_size + 1)) == NULL)
+        err(EXIT_FAILURE, "malloc");
+    while (off < (size_t) st.st_size && (got = pread(fd, buf + off, st.st_size - off, off)) > 0)
+        off += got;
+    buf[off] = '\0';
+
+    // Sorting by book then time makes the hits of a book, and of each of its buckets, contiguous
+    for (line = buf; (end = strchr(line, '\n')) != NULL; line = end + 1) {
+        *end = '\0';
+        if ((viewer = strchr(line, ' ')) == NULL || (serialnum = strchr(viewer + 1, ' ')) == NULL)
+            continue;
+        if ((hits = reallocarray(hits, hitsz + 1, sizeof(struct hit))) == NULL)
+            err(EXIT_FAILURE, "reallocarray");
+        hits[hitsz++] = (struct hit){
+            .epoch = strtoll(line, NULL, 10),
+            .viewer = strtoull(viewer + 1, NULL, 16),
+            .serialnum = serialnum + 1
+        };
+    }
+    qsort(hits, hitsz, sizeof(struct hit), cmp_hit);
+
+    if (!sqlbox_trans_immediate(boxctx, dbid, 1))
+        errx(EXIT_FAILURE, "sqlbox_trans_immediate");
+    // A log whose fold was committed before a restart only has to be removed
+    if (fold_recorded(file)) {
+        if (!sqlbox_trans_rollback(boxctx, dbid, 1))
+            errx(EXIT_FAILURE, "sqlbox_trans_rollback");
+        fold_forget(path, file);
+        close(fd);
+        free(hits);
+        free(buf);
+        return 0;
+    }
+    // Windows move before the new hits are bucketed, a late hit falling behind one is left out of it
+    for (k = 0; k < SPANS; ++k)
+        first[k] = advance_span(&spans[k], now);
+    for (i = 0; i < hitsz; i = j) {
+        for (j = i + 1; j < hitsz && same_run(&hits[i], &hits[j], 0); ++j);
+        struct sqlbox_parm parms[] = {
+            {.type = SQLBOX_PARM_INT, .iparm = (int64_t) (j - i)},
+            {.type = SQLBOX_PARM_STRING, .sparm = hits[i].serialnum},
+        };
+        if (sqlbox_exec(boxctx, dbid, STMTS_HIT, 2, parms, 0) != SQLBOX_CODE_OK)
+            errx(EXIT_FAILURE, "sqlbox_exec");
+        total += (int64_t) (j - i);
+    }
+    for (k = 0; k < 2; ++k) {
+        const int64_t width = k == 0 ? 3600 : 86400;
+        for (i = 0; i < hitsz; i = j) {
+            for (j = i + 1; j < hitsz && same_run(&hits[i], &hits[j], width); ++j);
+            struct sqlbox_parm parms[] = {
+                {.type = SQLBOX_PARM_INT, .iparm = hits[i].epoch / width},
+                {.type = SQLBOX_PARM_INT, .iparm = (int64_t) (j - i)},
+                {.type = SQLBOX_PARM_STRING, .sparm = hits[i].serialnum},
+            };
+            if (sqlbox_exec(boxctx, dbid, k == 0 ? STMTS_HOUR : STMTS_DAY, 3, parms, 0) != SQLBOX_CODE_OK)
+                errx(EXIT_FAILURE, "sqlbox_exec");
+            for (size_t l = 0; l < SPANS; ++l) {
+                if (spans[l].width != width || hits[i].epoch / width < first[l])
+                    continue;
+                struct sqlbox_parm parms_span[] = {
+                    {.type = SQLBOX_PARM_STRING, .sparm = spans[l].name},
+                    {.type = SQLBOX_PARM_INT, .iparm = (int64_t) (j - i)},
+                    {.type = SQLBOX_PARM_STRING, .sparm = hits[i].serialnum},
+                };
+                if (sqlbox_exec(boxctx, dbid, STMTS_TRENDING_ADD, 3, parms_span, 0) != SQLBOX_CODE_OK)
+                    errx(EXIT_FAILURE, "sqlbox_exec");
+            }
+            if (k == 1)
+                merge_viewers(&hits[i], j - i);
+        }
+    }
+
+    struct sqlbox_parm parms_hour[] = {
+        {.type = SQLBOX_PARM_INT, .iparm = (int64_t) now / 3600},
+    };
+    struct sqlbox_parm parms_day[] = {
+        {.type = SQLBOX_PARM_INT, .iparm = (int64_t) now / 86400},
+    };
+    if (sqlbox_exec(boxctx, dbid, STMTS_HOUR_PRUNE, 1, parms_hour, 0) != SQLBOX_CODE_OK)
+        errx(EXIT_FAILURE, "sqlbox_exec");
+    if (sqlbox_exec(boxctx, dbid, STMTS_DAY_PRUNE, 1, parms_day, 0) != SQLBOX_CODE_OK)
+        errx(EXIT_FAILURE, "sqlbox_exec");
+
+    // Books losing a sketch get their count refreshed along with the books just viewed
+    if (!(stmtid = sqlbox_prepare_bind(boxctx, dbid, STMTS_VIEWERS_EXPIRED, 1, parms_day, SQLBOX_STMT_MULTI)))
+        errx(EXIT_FAILURE, "sqlbox_prepare_bind");
+    while ((res = sqlbox_step(boxctx, stmtid)) != NULL && res->code == SQLBOX_CODE_OK && res->psz != 0) {
+        if ((expired = reallocarray(expired, expiredsz + 1, sizeof(char *))) == NULL)
+            err(EXIT_FAILURE, "reallocarray");
+        if ((expired[expiredsz++] = strdup(res->ps[0].sparm)) == NULL)
+            err(EXIT_FAILURE, "strdup");
+    }
+    if (!sqlbox_finalise(boxctx, stmtid))
+        errx(EXIT_FAILURE, "sqlbox_finalise");
+    if (sqlbox_exec(boxctx, dbid, STMTS_VIEWERS_PRUNE, 1, parms_day, 0) != SQLBOX_CODE_OK)
+        errx(EXIT_FAILURE, "sqlbox_exec");
+    for (i = 0; i < expiredsz; ++i) {
+        count_viewers(expired[i], (int64_t) now / 86400);
+        free(expired[i]);
+    }
+    free(expired);
+    for (i = 0; i < hitsz; i = j) {
+        for (j = i + 1; j < hitsz && same_run(&hits[i], &hits[j], 0); ++j);
+        count_viewers(hits[i].serialnum, (int64_t) now / 86400);
+    }
+
+    if (sqlbox_exec(boxctx, dbid, STMTS_TRENDING_DROP, 0, 0, 0) != SQLBOX_CODE_OK)
+        errx(EXIT_FAILURE, "sqlbox_exec");
+    struct sqlbox_parm parms_file[] = {
+        {.type = SQLBOX_PARM_STRING, .sparm = file},
+    };
+    if (sqlbox_exec(boxctx, dbid, STMTS_FOLD_RECORD, 1, parms_file, 0) != SQLBOX_CODE_OK)
+        errx(EXIT_FAILURE, "sqlbox_exec");
+    if (!sqlbox_trans_commit(boxctx, dbid, 1))
+        errx(EXIT_FAILURE, "sqlbox_trans_commit");
+    fold_forget(path, file);
+    close(fd);
+    free(hits);
+    free(buf);
+    return total;
+}
+
+static int pending(const struct dirent *d) {
+    return strncmp(d->d_name, HITLOG_PENDING, sizeof(HITLOG_PENDING) - 1) == 0;
+}
+
+/*
+ * Moves the current log aside, empty logs are left in place
+ */
+void rotate() {
+    char name[64];
+    struct stat st;
+
+    if (stat(HITLOG, &st) == -1) {
+        if (errno != ENOENT)
+            err(EXIT_FAILURE, "stat");
+        return;
+    }
+    if (st.st_size == 0)
+        return;
+    snprintf(name, sizeof(name), HITS_DIR "/" HITLOG_PENDING "%010lld.%d", (long long) time(NULL), (int) getpid());
+    if (rename(HITLOG, name) == -1)
+        err(EXIT_FAILURE, "rename");
+}
+
+int main(int argc, char *argv[]) {
+    struct dirent **logs;
+    int64_t folded;
+    int n;
+
+    if (argc > 1)
+        srcs[0].fname = argv[1];
+    alloc_ctx_cfg();
+    setvbuf(stdout, NULL, _IOLBF, 0);
+    for (;;) {
+        rotate();
+        // Zero-padded epochs, the names sort in the order the logs were renamed
+        if ((n = scandir(HITS_DIR, &logs, pending, alphasort)) == -1)
+            err(EXIT_FAILURE, "scandir");
+        for (int i = 0; i < n; ++i) {
+            if ((folded = fold_hits(logs[i]->d_name, time(NULL))) > 0)
+                printf("%s: %lld hits folded\n", logs[i]->d_name, (long long) folded);
+            free(logs[i]);
+        }
+        free(logs);
+        sleep(INTERVAL);
+    }
+}
@@ -0,0 +1,227 @@
+#include <err.h> /* err() */
+#include <stdint.h> /* uint32_t, uint64_t */
+#include <stdlib.h> /* EXIT_FAILURE */
+#include <string.h> /* strlen() */
+#include "normalize.h"
+#include "fuzzy.h"
+
+struct buf {
+    char *s;
+    size_t len;
+    size_t cap;
+};
+
+static void buf_write(struct buf *b, const char *s, size_t len) {
+    if (b->len + len + 1 > b->cap) {
+        b->cap = (b->len + len + 1) * 2;
+        if ((b->s = realloc(b->s, b->cap)) == NULL)
+            err(EXIT_FAILURE, "realloc");
+    }
+    memcpy(b->s + b->len, s, len);
+    b->len += len;
+    b->s[b->len] = '\0';
+}
+
+/*
+ * Word characters are ASCII letters and digits and any non-ASCII code point outside of the
+ * punctuation blocks, normalize_text() already folded case and accents.
+ */
+static int is_word(uint32_t cp) {
+    if (cp < 0x80)
+        return (cp >= 'a' && cp <= 'z') || (cp >= 'A' && cp <= 'Z') || (cp >= '0' && cp <= '9');
+    if ((cp >= 0xA0 && cp <= 0xBF) || cp == 0xD7 || cp == 0xF7)
+        return 0;
+    if ((cp >= 0x2000 && cp <= 0x206F) || (cp >= 0x3000 && cp <= 0x303F))
+        return 0;
+    if (cp == 0x60C || cp == 0x61B || cp == 0x61F || cp == 0x6D4 || cp == 0xFFFD)
+        return 0;
+    return 1;
+}
+
+size_t fuzzy_split(const char *text, size_t fields, char ***words) {
+    const unsigned char *s = (const unsigned char *) text;
+    const unsigned char *start = NULL;
+    size_t wordsz = 0, cps = 0, field = 0, len, i;
+    uint32_t cp;
+    int dup;
+
+    *words = NULL;
+    for (;;) {
+        len = *s ? utf8_decode(s, &cp) : 0;
+        if (len != 0 && is_word(cp)) {
+            if (start == NULL)
+                start = s;
+            cps++;
+            s += len;
+            continue;
+        }
+        if (start != NULL && cps <= FUZZY_WORD_MAX) {
+            dup = 0;
+            for (i = 0; i < wordsz && !dup; ++i)
+                dup = strlen((*words)[i]) == (size_t) (s - start) && memcmp((*words)[i], start, s - start) == 0;
+            if (!dup) {
+                if ((*words = reallocarray(*words, wordsz + 1, sizeof(char *))) == NULL)
+                    err(EXIT_FAILURE, "reallocarray");
+                if (((*words)[wordsz++] = strndup((const char *) start, s - start)) == NULL)
+                    err(EXIT_FAILURE, "strndup");
+            }
+        }
+        start = NULL;
+        cps = 0;
+        if (len == 0)
+            break;
+        if (cp == '\n' && fields != 0 && ++field == fields)
+            break;
+        s += len;
+    }
+    return wordsz;
+}
+
+void fuzzy_free(char **words, size_t wordsz) {
+    for (size_t i = 0; i < wordsz; ++i)
+        free(words[i]);
+    free(words);
+}
+
+/*
+ * Byte offsets of the code points of " word ", the padding lets the first and last letters
+ * start and end a trigram of their own. Returns the number of code points.
+ */
+static size_t padded_offsets(const char *word, char **padded, size_t *offsets) {
+    const unsigned char *s;
+    size_t n = 0;
+    uint32_t cp;
+    size_t len = strlen(word);
+
+    if ((*padded = malloc(len + 3)) == NULL)
+        err(EXIT_FAILURE, "malloc");
+    (*padded)[0] = ' ';
+    memcpy(*padded + 1, word, len);
+    (*padded)[len + 1] = ' ';
+    (*padded)[len + 2] = '\0';
+    for (s = (const unsigned char *) *padded; *s; s += utf8_decode(s, &cp))
+        offsets[n++] = (const char *) s - *padded;
+    offsets[n] = len + 2;
+    return n;
+}
+
+char *fuzzy_words_json(char *const *words, size_t wordsz) {
+    struct buf b = {NULL, 0, 0};
+
+    buf_write(&b, "[", 1);
+    for (size_t i = 0; i < wordsz; ++i) {
+        if (i > 0)
+            buf_write(&b, ",", 1);
+        buf_write(&b, "\"", 1);
+        buf_write(&b, words[i], strlen(words[i]));
+        buf_write(&b, "\"", 1);
+    }
+    buf_write(&b, "]", 1);
+    return b.s;
+}
+
+char *fuzzy_grams_json(char *const *words, size_t wordsz) {
+    struct buf b = {NULL, 0, 0};
+    size_t offsets[FUZZY_WORD_MAX + 3], n;
+    char *padded;
+    int first = 1;
+
+    buf_write(&b, "[", 1);
+    for (size_t i = 0; i < wordsz; ++i) {
+        n = padded_offsets(words[i], &padded, offsets);
+        for (size_t j = 0; j + 3 <= n; ++j) {
+            if (!first)
+                buf_write(&b, ",", 1);
+            first = 0;
+            buf_write(&b, "[\"", 2);
+            buf_write(&b, padded + offsets[j], offsets[j + 3] - offsets[j]);
+            buf_write(&b, "\",\"", 3);
+            buf_write(&b, words[i], strlen(words[i]));
+            buf_write(&b, "\"]", 2);
+        }
+        free(padded);
+    }
+    buf_write(&b, "]", 1);
+    return b.s;
+}
+
+char *fuzzy_word_grams_json(const char *word, size_t *gramsz) {
+    struct buf b = {NULL, 0, 0};
+    size_t offsets[FUZZY_WORD_MAX + 3], n, glen;
+    char *padded;
+    int dup;
+
+    *gramsz = 0;
+    n = padded_offsets(word, &padded, offsets);
+    buf_write(&b, "[", 1);
+    for (size_t j = 0; j + 3 <= n; ++j) {
+        glen = offsets[j + 3] - offsets[j];
+        dup = 0;
+        for (size_t i = 0; i < j && !dup; ++i)
+            dup = offsets[i + 3] - offsets[i] == glen && memcmp(padded + offsets[i], padded + offsets[j], glen) == 0;
+        if (dup)
+            continue;
+        if ((*gramsz)++ > 0)
+            buf_write(&b, ",", 1);
+        buf_write(&b, "\"", 1);
+        buf_write(&b, padded + offsets[j], glen);
+        buf_write(&b, "\"", 1);
+    }
+    buf_write(&b, "]", 1);
+    free(padded);
+    return b.s;
+}
+
+static size_t decode_all(const char *in, uint32_t *cps) {
+    const unsigned char *s = (const unsigned char *) in;
+    size_t n = 0;
+    while (*s && n < FUZZY_WORD_MAX)
+        s += utf8_decode(s, &cps[n++]);
+    return n;
+}
+
+int fuzzy_max_edits(const char *word) {
+    uint32_t cps[FUZZY_WORD_MAX];
+    size_t n = decode_all(word, cps);
+    return n <= 3 ? 0 : n <= 6 ? 1 : 2;
+}
+
+/*
+ * Myers' bit-parallel edit distance (Hyyro's formulation for the global distance): one bit per
+ * pattern code point, the score of the last row is tracked while the text is consumed.
+ */
+int fuzzy_within(const char *pattern, const char *text, int k) {
+    uint32_t p[FUZZY_WORD_MAX], t[FUZZY_WORD_MAX];
+    size_t m = decode_all(pattern, p), n = decode_all(text, t);
+    uint64_t pv, mv = 0, eq, xv, xh, ph, mh, high;
+    int score = (int) m;
+
+    if ((m > n ? m - n : n - m) > (size_t) k)
+        return 0;
+    if (m == 0)
+        return (int) n <= k;
+    pv = (m == 64) ? ~(uint64_t) 0 : (((uint64_t) 1 << m) - 1);
+    high = (uint64_t) 1 << (m - 1);
+    for (size_t j = 0; j < n; ++j) {
+        eq = 0;
+        for (size_t i = 0; i < m; ++i)
+            if (p[i] == t[j])
+                eq |= (uint64_t) 1 << i;
+        xv = eq | mv;
+        xh = (((eq & pv) + pv) ^ pv) | eq;
+        ph = mv | ~(xh | pv);
+        mh = pv & xh;
+        if (ph & high)
+            score++;
+        else if (mh & high)
+            score--;
+        ph = (ph << 1) | 1;
+        mh <<= 1;
+        pv = mh | ~(xv | ph);
+        mv = ph & xv;
+        /* each remaining text code point can lower the score by at most one */
+        if (score - (int) (n - j - 1) > k)
+            return 0;
+    }
+    return score <= k;
+}
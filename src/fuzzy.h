@@ -0,0 +1,49 @@
+#ifndef FUZZY_H
+#define FUZZY_H
+
+#include <stddef.h> /* size_t */
+
+/*
+ * Number of leading BOOK.searchkey fields indexed for fuzzy search: title, authors and publisher
+ */
+#define FUZZY_FIELDS 3
+/*
+ * Longest word (in code points) that is indexed and compared, the width of the bit-vectors
+ */
+#define FUZZY_WORD_MAX 64
+
+/*
+ * Splits normalized text into its distinct words, only looking at the first fields newline
+ * separated fields (all of them when fields is 0). Words longer than FUZZY_WORD_MAX are skipped.
+ * Returns the number of words, *words is allocated and must be freed with fuzzy_free().
+ */
+size_t fuzzy_split(const char *text, size_t fields, char ***words);
+
+void fuzzy_free(char **words, size_t wordsz);
+
+/*
+ * JSON array of the words, as consumed by json_each()
+ */
+char *fuzzy_words_json(char *const *words, size_t wordsz);
+
+/*
+ * JSON array of [gram, word] pairs for every trigram of every word
+ */
+char *fuzzy_grams_json(char *const *words, size_t wordsz);
+
+/*
+ * JSON array of the distinct trigrams of a single word, their number is stored in gramsz
+ */
+char *fuzzy_word_grams_json(const char *word, size_t *gramsz);
+
+/*
+ * Number of edits tolerated for a query word of this length
+ */
+int fuzzy_max_edits(const char *word);
+
+/*
+ * Whether the edit distance between pattern and text is at most k
+ */
+int fuzzy_within(const char *pattern, const char *text, int k);
+
+#endif
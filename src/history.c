@@ -0,0 +1,71 @@
+#include <sys/types.h> /* size_t */
+#include <dirent.h> /* scandir() */
+#include <err.h> /* err() */
+#include <errno.h> /* ENOENT */
+#include <stdio.h> /* snprintf() */
+#include <stdlib.h> /* EXIT_FAILURE */
+#include <string.h> /* strlen() */
+#include "history.h"
+#include "archive.h"
+
+int history_month(const struct tm *tm) {
+    return (tm->tm_year + 1900) * 12 + tm->tm_mon;
+}
+
+void history_partition(int month, struct history_partition *p) {
+    p->month = month;
+    snprintf(p->path, sizeof(p->path), HISTORY_DIR "/%04d-%02d.db", month / 12, month % 12 + 1);
+    snprintf(p->schema, sizeof(p->schema), "h%04d_%02d", month / 12, month % 12 + 1);
+}
+
+/*
+ * Month of a file named YYYY-MM<ext>, -1 for anything else
+ */
+static int month_of(const char *name, const char *ext) {
+    int year, mon, end = 0;
+
+    if (strlen(name) != sizeof("YYYY-MM") - 1 + strlen(ext) || sscanf(name, "%4d-%2d%n", &year, &mon, &end) != 2 ||
+        end != sizeof("YYYY-MM") - 1 || strcmp(name + end, ext) != 0 || mon < 1 || mon > 12)
+        return -1;
+    return year * 12 + mon - 1;
+}
+
+/*
+ * Lists the YYYY-MM<ext> files of dir from month from to month to, keeping the newest max of them
+ */
+static size_t list(const char *dir, const char *ext, int from, int to, struct history_partition *parts,
+                   size_t max) {
+    struct dirent **names;
+    size_t n = 0;
+    int month, count;
+
+    // YYYY-MM names sort chronologically, walked from the newest to keep the newest max
+    if ((count = scandir(dir, &names, NULL, alphasort)) == -1) {
+        if (errno != ENOENT)
+            err(EXIT_FAILURE, "scandir");
+        return 0;
+    }
+    for (int i = count - 1; i >= 0; --i) {
+        month = month_of(names[i]->d_name, ext);
+        if (month != -1 && month >= from && month <= to && n < max) {
+            history_partition(month, &parts[n]);
+            snprintf(parts[n++].path, sizeof(parts->path), "%s/%.16s", dir, names[i]->d_name);
+        }
+        free(names[i]);
+    }
+    free(names);
+    for (size_t i = 0; i < n / 2; ++i) {
+        struct history_partition swap = parts[i];
+        parts[i] = parts[n - 1 - i];
+        parts[n - 1 - i] = swap;
+    }
+    return n;
+}
+
+size_t history_partitions(int from, int to, struct history_partition *parts, size_t max) {
+    return list(HISTORY_DIR, ".db", from, to, parts, max);
+}
+
+size_t history_archives(int from, int to, struct history_partition *parts, size_t max) {
+    return list(HISTORY_ARCHIVE, ARCHIVE_EXT, from, to, parts, max);
+}
@@ -0,0 +1,58 @@
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include <stddef.h> /* size_t */
+#include <time.h> /* struct tm */
+
+/*
+ * Closed months of HISTORY, moved out of the main database by rollover, one database file
+ * (db/history/YYYY-MM.db) per month holding a HISTORY table of the same columns
+ */
+#define HISTORY_DIR "db/history"
+/*
+ * Where rollover moves the partitions past the retention when the directory exists, they are
+ * deleted otherwise
+ */
+#define HISTORY_ARCHIVE "db/history/archive"
+/*
+ * Months of partitions kept by default, on top of the current month living in HISTORY
+ */
+#define HISTORY_RETENTION 6
+/*
+ * SQLITE_MAX_ATTACHED of a default build, the longest retention rollover accepts. The history page
+ * refuses a date range overlapping more partitions than that.
+ */
+#define HISTORY_ATTACH_MAX 10
+/*
+ * Months of archives a query streams through, the newest ones
+ */
+#define HISTORY_ARCHIVE_MAX 120
+
+struct history_partition {
+    int month; /* year * 12 + month - 1 */
+    char path[64];
+    char schema[16]; /* name it is attached under */
+};
+
+/*
+ * Month (as in struct history_partition) of a broken down time
+ */
+int history_month(const struct tm *tm);
+
+/*
+ * Fills p for the partition of month, whether or not it exists
+ */
+void history_partition(int month, struct history_partition *p);
+
+/*
+ * Lists the partitions from month from to month to (included) in chronological order, keeping the
+ * newest max of them. Returns how many were written to parts.
+ */
+size_t history_partitions(int from, int to, struct history_partition *parts, size_t max);
+
+/*
+ * Same as history_partitions() for the compacted partitions (see archive.h) of HISTORY_ARCHIVE
+ */
+size_t history_archives(int from, int to, struct history_partition *parts, size_t max);
+
+#endif
@@ -1,4 +1,4 @@
-#include <sys/types.h> /* size_t, ssize_t */
+#include <sys/types.h> /* size_t */
 #include <stdarg.h> /* va_list */
 #include <stddef.h> /* NULL */
 #include <stdint.h> /* int64_t */
@@ -10,8 +10,23 @@
 #include <kcgi.h>
 #include <kcgijson.h>
 #include <sqlbox.h>
+#include <sha2.h> /* SHA256Data() */
 #include <stdbool.h>
 #include <stdio.h>
+#include <time.h> /* time() */
+#include "token.h"
+#include "session.h"
+#include "keyhash.h"
+#include "hitlog.h"
+
+/*
+ * Views are only appended to HITLOG, without taking the database write lock, fold moves them into
+ * BOOK.hits in the background
+ */
+/*
+ * Most serial numbers accepted in a single request (serialnum may be repeated)
+ */
+#define HITS_MAX 100
 
 struct kreq r;
 struct kjsonreq req;
@@ -57,25 +72,18 @@ static const struct kvalid keys[KEY__MAX] = {
 };
 
 enum statment {
-    STMTS_HIT,
+    STMTS_UNKNOWN,
     STMTS_LOGIN,
     STMTS__MAX
 };
 
 static struct sqlbox_pstmt pstmts[STMTS__MAX] = {
-    {
-        (char *) "UPDATE BOOK SET hits = hits + 1 WHERE serialnum = (?)"
-    },
     {
         (char *)
-        "SELECT ACCOUNT.UUID, displayname, pwhash, campus, role, perms, frozen "
-        "FROM ROLE,"
-        "ACCOUNT "
-        "LEFT JOIN SESSIONS S on ACCOUNT.UUID = S.account "
-        "WHERE ACCOUNT.role = ROLE.roleName "
-        "AND sessionID = (?) "
-        "GROUP BY ACCOUNT.UUID, displayname, pwhash, campus, perms, frozen "
-    }
+        "SELECT DISTINCT value FROM json_each(?) "
+        "WHERE NOT EXISTS (SELECT 1 FROM BOOK WHERE serialnum = value)"
+    },
+    SESSION_LOGIN_PSTMT
 };
 
 struct sqlbox_src srcs[] = {
@@ -128,46 +136,90 @@ struct usr curr_usr = {
 
 void fill_user() {
     struct kpair *field;
+    struct token tok;
 
-    if ((field = r.cookiemap[COOKIE_SESSIONID])) {
-        size_t stmtid;
-        size_t parmsz = 1;
-        const struct sqlbox_parmset *res;
-        struct sqlbox_parm parms[] = {
-            {.type = SQLBOX_PARM_STRING, .sparm = field->parsed.s},
-        };
-        if (!(stmtid = sqlbox_prepare_bind(boxctx, dbid, STMTS_LOGIN, parmsz, parms, 0)))
-            errx(EXIT_FAILURE, "sqlbox_prepare_bind");
-        if ((res = sqlbox_step(boxctx, stmtid)) == NULL)
-            errx(EXIT_FAILURE, "sqlbox_step");
-        if (res->psz != 0) {
-            curr_usr.authenticated = true;
-            kasprintf(&curr_usr.UUID, "%s", res->ps[0].sparm);
-
-            kasprintf(&curr_usr.disp_name, "%s", res->ps[1].sparm);
-
-            kasprintf(&curr_usr.campus, "%s", res->ps[3].sparm);
-
-            kasprintf(&curr_usr.role, "%s", res->ps[4].sparm);
-
-            kasprintf(&curr_usr.sessionID, "%s", field->parsed.s);
-
-            curr_usr.perms = int_to_accperms((int) res->ps[5].iparm);
-
-            curr_usr.frozen = res->ps[6].iparm;
-        }
-        sqlbox_finalise(boxctx, stmtid);
-    }
+    if ((field = r.cookiemap[COOKIE_SESSIONID]) == NULL ||
+        !session_resolve(field->parsed.s, boxctx, dbid, STMTS_LOGIN, &tok))
+        return;
+    curr_usr.authenticated = true;
+    curr_usr.UUID = tok.UUID;
+    curr_usr.disp_name = tok.disp_name;
+    curr_usr.campus = tok.campus;
+    curr_usr.role = tok.role;
+    kasprintf(&curr_usr.sessionID, "%s", field->parsed.s);
+    curr_usr.perms = int_to_accperms(tok.perms);
+    curr_usr.frozen = tok.frozen;
 }
 
 enum khttp sanitize() {
+    size_t serialsz = 0;
     if (r.method != KMETHOD_GET)
         return KHTTP_405;
     if (!r.fieldmap[KEY_SERIALNUM])
         return KHTTP_403;
+    for (struct kpair *field = r.fieldmap[KEY_SERIALNUM]; field; field = field->next) {
+        if (strchr(field->parsed.s, '\n'))
+            return KHTTP_403;
+        if (++serialsz > HITS_MAX)
+            return KHTTP_400;
+    }
     return KHTTP_200;
 }
 
+/*
+ * Appends s to the JSON array being built in *json as a string
+ */
+void json_push(char **json, const char *s) {
+    size_t len = *json ? strlen(*json) : 0;
+    char *p;
+
+    if ((*json = realloc(*json, len + 6 * strlen(s) + 5)) == NULL)
+        err(EXIT_FAILURE, "realloc");
+    p = *json + len;
+    *p++ = len ? ',' : '[';
+    *p++ = '"';
+    for (; *s; ++s) {
+        if (*s == '"' || *s == '\\') {
+            *p++ = '\\';
+            *p++ = *s;
+        } else if ((unsigned char) *s < 0x20)
+            p += sprintf(p, "\\u%04x", (unsigned char) *s);
+        else
+            *p++ = *s;
+    }
+    *p++ = '"';
+    *p = '\0';
+}
+
+/*
+ * Fills unknown with the requested serial numbers that are not in BOOK, all of them checked
+ * by a single statement. Returns their number.
+ */
+size_t find_unknown(char ***unknown) {
+    size_t stmtid, unknownsz = 0;
+    const struct sqlbox_parmset *res;
+    char *json = NULL;
+
+    for (struct kpair *field = r.fieldmap[KEY_SERIALNUM]; field; field = field->next)
+        json_push(&json, field->parsed.s);
+    strcat(json, "]");
+    struct sqlbox_parm parms[] = {
+        {.type = SQLBOX_PARM_STRING, .sparm = json},
+    };
+    *unknown = NULL;
+    if (!(stmtid = sqlbox_prepare_bind(boxctx, dbid, STMTS_UNKNOWN, 1, parms, SQLBOX_STMT_MULTI)))
+        errx(EXIT_FAILURE, "sqlbox_prepare_bind");
+    while ((res = sqlbox_step(boxctx, stmtid)) != NULL && res->code == SQLBOX_CODE_OK && res->psz != 0) {
+        if ((*unknown = reallocarray(*unknown, unknownsz + 1, sizeof(char *))) == NULL)
+            err(EXIT_FAILURE, "reallocarray");
+        kasprintf(&(*unknown)[unknownsz++], "%s", res->ps[0].sparm);
+    }
+    if (!sqlbox_finalise(boxctx, stmtid))
+        errx(EXIT_FAILURE, "sqlbox_finalise");
+    free(json);
+    return unknownsz;
+}
+
 int main() {
     enum khttp er;
     if (khttp_parse(&r, keys, KEY__MAX, 0, 0, 0) != KCGI_OK)
@@ -185,6 +237,30 @@ int main() {
     }
     alloc_ctx_cfg();
     fill_user();
+
+    time_t now = time(NULL);
+    char *lines = NULL, *next, **unknown = NULL;
+    // Hashed under the per-install secret so that neither IPs nor account ids can be read back from the log
+    const uint64_t viewer = keyhash(curr_usr.authenticated ? curr_usr.UUID : r.remote);
+    size_t unknownsz, i;
+    int64_t logged = 0;
+    bool success = true;
+    unknownsz = find_unknown(&unknown);
+    for (struct kpair *field = r.fieldmap[KEY_SERIALNUM]; field; field = field->next) {
+        for (i = 0; i < unknownsz && strcmp(unknown[i], field->parsed.s) != 0; ++i);
+        if (i < unknownsz)
+            continue;
+        kasprintf(&next, "%s%lld %016" PRIx64 " %s\n", lines ? lines : "", (long long) now, viewer,
+                  field->parsed.s);
+        free(lines);
+        lines = next;
+        logged++;
+    }
+    if (lines) {
+        success = hitlog_append(lines);
+        free(lines);
+    }
+
     khttp_head(&r, kresps[KRESP_STATUS], "%s", khttps[KHTTP_200]);
     khttp_head(&r, kresps[KRESP_CONTENT_TYPE], "%s", kmimetypes[KMIME_APP_JSON]);
     khttp_body(&r);
@@ -212,16 +288,15 @@ int main() {
         kjson_obj_close(&req);
     }
     kjson_obj_close(&req);
-
-    enum sqlbox_code err_instr;
-    struct sqlbox_parm temp_parms2[] = {
-        {.type = SQLBOX_PARM_STRING, .sparm = r.fieldmap[KEY_SERIALNUM]->parsed.s}
-    };
-    if ((err_instr = sqlbox_exec(boxctx, dbid, STMTS_HIT, 1, temp_parms2,SQLBOX_STMT_CONSTRAINT)) !=
-        SQLBOX_CODE_OK)
-        if (err_instr != SQLBOX_CODE_CONSTRAINT)
-            errx(EXIT_FAILURE, "sqlbox_exec");
-    kjson_putboolp(&req, "success", err_instr == SQLBOX_CODE_OK);
+    kjson_putintp(&req, "hits", success ? logged : 0);
+    kjson_arrayp_open(&req, "unknown");
+    for (i = 0; i < unknownsz; ++i) {
+        kjson_putstring(&req, unknown[i]);
+        free(unknown[i]);
+    }
+    kjson_array_close(&req);
+    free(unknown);
+    kjson_putboolp(&req, "success", success && unknownsz == 0);
     kjson_obj_close(&req);
     kjson_close(&req);
     khttp_free(&r);
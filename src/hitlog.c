@@ -0,0 +1,46 @@
+#include <sys/types.h> /* ssize_t */
+#include <sys/file.h> /* flock() */
+#include <sys/stat.h> /* fstat() */
+#include <err.h> /* err() */
+#include <errno.h> /* ENOENT */
+#include <fcntl.h> /* open() */
+#include <stdlib.h> /* EXIT_FAILURE */
+#include <string.h> /* strlen() */
+#include <unistd.h> /* write() */
+#include "hitlog.h"
+
+/*
+ * Opens the current log under a shared lock, fold renames it and then takes an exclusive lock to
+ * seal it, so a log found renamed once locked is given up for the new one
+ */
+static int open_log() {
+    struct stat held, current;
+    int fd;
+
+    for (;;) {
+        if ((fd = open(HITLOG, O_WRONLY | O_APPEND | O_CREAT, 0600)) == -1)
+            err(EXIT_FAILURE, "open");
+        if (flock(fd, LOCK_SH) == -1)
+            err(EXIT_FAILURE, "flock");
+        if (fstat(fd, &held) == -1)
+            err(EXIT_FAILURE, "fstat");
+        if (stat(HITLOG, &current) == -1) {
+            if (errno != ENOENT)
+                err(EXIT_FAILURE, "stat");
+        } else if (held.st_dev == current.st_dev && held.st_ino == current.st_ino)
+            return fd;
+        close(fd);
+    }
+}
+
+bool hitlog_append(const char *lines) {
+    const size_t len = strlen(lines);
+    bool written;
+    int fd;
+
+    fd = open_log();
+    // A single O_APPEND write keeps the lines of concurrent requests whole
+    written = write(fd, lines, len) == (ssize_t) len;
+    close(fd);
+    return written;
+}
@@ -0,0 +1,22 @@
+#ifndef HITLOG_H
+#define HITLOG_H
+
+#include <stdbool.h>
+
+/*
+ * Views are appended to HITLOG as "<epoch> <viewer> <serialnum>" lines by hit instead of taking the
+ * database write lock for each of them, fold moves them into BOOK.hits and the hit buckets
+ */
+#define HITLOG "db/hits.log"
+/*
+ * Prefix of the logs fold renamed and did not finish folding yet
+ */
+#define HITLOG_PENDING "hits.log."
+
+/*
+ * Appends the lines with a single write(), only waiting (if at all) for fold to finish sealing a
+ * log it just renamed. False when the write fell short.
+ */
+bool hitlog_append(const char *lines);
+
+#endif
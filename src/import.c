@@ -0,0 +1,326 @@
+#include <sys/types.h> /* size_t, ssize_t */
+#include <stdarg.h> /* va_list */
+#include <stddef.h> /* NULL */
+#include <stdint.h> /* int64_t */
+#include <err.h> /* err(), warnx() */
+#include <errno.h> /* errno */
+#include <pthread.h> /* pthread_create() */
+#include <stdatomic.h> /* atomic_fetch_add() */
+#include <stdbool.h>
+#include <stdlib.h> /* EXIT_FAILURE */
+#include <string.h> /* memset() */
+#include <strings.h> /* strncasecmp() */
+#include <unistd.h> /* sysconf() */
+#include <argon2.h>
+#include <sqlbox.h>
+#include <stdio.h>
+
+/*
+ * Command line tool creating accounts in bulk, from CSV (UUID,displayname,password,campus,role
+ * and an optional frozen column, an optional header line) or from JSON Lines (one object per line
+ * with the same keys). Passwords are hashed on as many threads as cores and memory allow, the rows
+ * are inserted BATCH at a time, each rejected row is reported on stderr with its line number.
+ * Usage: import file [database]
+ */
+
+#define BATCH 1000
+#define HASHLEN 32
+#define SALTLEN 16
+#define ENCODEDLEN 128
+/*
+ * Same cost as signup and add, m_cost is in KiB
+ */
+#define T_COST 1
+#define M_COST 47104
+#define PARALLELISM 1
+
+enum field {
+    FIELD_UUID,
+    FIELD_NAME,
+    FIELD_PASSWORD,
+    FIELD_CAMPUS,
+    FIELD_ROLE,
+    FIELD__MAX
+};
+
+static const char *missing[FIELD__MAX] = {
+    "missing UUID", "missing displayname", "missing password", "missing campus", "missing role"
+};
+
+struct row {
+    size_t line;
+    char *fields[FIELD__MAX];
+    int frozen;
+    char hash[ENCODEDLEN];
+    const char *error;
+};
+
+/*
+ * Rows are handed to the hashing threads through a shared cursor, every thread takes the next one
+ * as soon as it is done with its own so that none idles while rows are left
+ */
+struct pool {
+    struct row *rows;
+    size_t rowsz;
+    atomic_size_t next;
+};
+
+enum statement {
+    STMTS_JSON,
+    STMTS_ADD,
+    STMTS__MAX
+};
+
+static struct sqlbox_pstmt pstmts[STMTS__MAX] = {
+    {
+        (char *)
+        "SELECT json_extract(?1,'$.UUID'),"
+        "json_extract(?1,'$.displayname'),"
+        "json_extract(?1,'$.password'),"
+        "json_extract(?1,'$.campus'),"
+        "json_extract(?1,'$.role'),"
+        "IFNULL(json_extract(?1,'$.frozen'),0) "
+        "WHERE json_valid(?1) AND json_type(?1) = 'object'"
+    },
+    {(char *) "INSERT INTO ACCOUNT (UUID, displayname, pwhash, campus, role, frozen) VALUES (?,?,?,?,?,?)"}
+};
+
+struct sqlbox_src srcs[] = {
+    {
+        .fname = (char *) "db/database.db",
+        .mode = SQLBOX_SRC_RW
+    }
+};
+struct sqlbox *boxctx;
+struct sqlbox_cfg cfg;
+size_t dbid;
+
+void alloc_ctx_cfg() {
+    memset(&cfg, 0, sizeof(struct sqlbox_cfg));
+    cfg.msg.func_short = warnx;
+    cfg.srcs.srcsz = 1;
+    cfg.srcs.srcs = srcs;
+    cfg.stmts.stmtsz = STMTS__MAX;
+    cfg.stmts.stmts = pstmts;
+    if ((boxctx = sqlbox_alloc(&cfg)) == NULL)
+        errx(EXIT_FAILURE, "sqlbox_alloc");
+    if (!(dbid = sqlbox_open(boxctx, 0)))
+        errx(EXIT_FAILURE, "sqlbox_open");
+}
+
+/*
+ * Splits one CSV record in place into at most n fields, double quoted fields may hold commas and
+ * doubled quotes (but not line breaks). Returns the number of fields, -1 on a stray quote.
+ */
+int csv_split(char *line, char **fields, int n) {
+    char *p = line, *w;
+    int count = 0;
+
+    for (;;) {
+        if (count == n)
+            return count + 1;
+        fields[count++] = w = p;
+        if (*p == '"') {
+            for (++p; *p && !(*p == '"' && p[1] != '"'); ++p)
+                *w++ = (*p == '"') ? *++p : *p;
+            if (*p++ != '"' || (*p != ',' && *p != '\0'))
+                return -1;
+        } else {
+            while (*p && *p != ',')
+                *w++ = *p++;
+        }
+        if (*p == '\0') {
+            *w = '\0';
+            return count;
+        }
+        *w = '\0';
+        ++p;
+    }
+}
+
+void parse_csv(struct row *row, char *line) {
+    char *fields[FIELD__MAX + 1];
+    int n = csv_split(line, fields, FIELD__MAX + 1);
+
+    if (n < FIELD__MAX || n > FIELD__MAX + 1) {
+        row->error = (n == -1) ? "malformed quotes" : "wrong number of columns";
+        return;
+    }
+    for (int i = 0; i < FIELD__MAX; ++i)
+        if ((row->fields[i] = strdup(fields[i])) == NULL)
+            err(EXIT_FAILURE, "strdup");
+    row->frozen = (n > FIELD__MAX) && (strcmp(fields[FIELD__MAX], "1") == 0 ||
+                                       strcasecmp(fields[FIELD__MAX], "true") == 0);
+}
+
+void parse_json(struct row *row, const char *line) {
+    size_t stmtid;
+    const struct sqlbox_parmset *res;
+    struct sqlbox_parm parms[] = {
+        {.type = SQLBOX_PARM_STRING, .sparm = line},
+    };
+
+    if (!(stmtid = sqlbox_prepare_bind(boxctx, dbid, STMTS_JSON, 1, parms, 0)))
+        errx(EXIT_FAILURE, "sqlbox_prepare_bind");
+    if ((res = sqlbox_step(boxctx, stmtid)) == NULL)
+        errx(EXIT_FAILURE, "sqlbox_step");
+    if (res->psz == 0)
+        row->error = "not a JSON object";
+    for (size_t i = 0; i < res->psz && i < FIELD__MAX; ++i)
+        if (res->ps[i].type == SQLBOX_PARM_STRING && (row->fields[i] = strdup(res->ps[i].sparm)) == NULL)
+            err(EXIT_FAILURE, "strdup");
+    if (res->psz > FIELD__MAX)
+        row->frozen = res->ps[FIELD__MAX].type == SQLBOX_PARM_INT && res->ps[FIELD__MAX].iparm != 0;
+    if (!sqlbox_finalise(boxctx, stmtid))
+        errx(EXIT_FAILURE, "sqlbox_finalise");
+}
+
+/*
+ * Reads every record of the file, JSON Lines when its first character opens an object
+ */
+size_t read_rows(FILE *in, struct row **rows) {
+    char *line = NULL;
+    size_t cap = 0, rowsz = 0, lineno = 0;
+    ssize_t len;
+    int json = -1;
+
+    *rows = NULL;
+    while ((len = getline(&line, &cap, in)) != -1) {
+        ++lineno;
+        while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+            line[--len] = '\0';
+        if (len == 0)
+            continue;
+        if (json == -1) {
+            json = line[strspn(line, " \t")] == '{';
+            if (!json && strncasecmp(line, "UUID,", 5) == 0)
+                continue;
+        }
+        if ((*rows = reallocarray(*rows, rowsz + 1, sizeof(struct row))) == NULL)
+            err(EXIT_FAILURE, "reallocarray");
+        struct row *row = &(*rows)[rowsz++];
+        memset(row, 0, sizeof(struct row));
+        row->line = lineno;
+        if (json)
+            parse_json(row, line);
+        else
+            parse_csv(row, line);
+        for (int i = 0; i < FIELD__MAX && row->error == NULL; ++i)
+            if (row->fields[i] == NULL || row->fields[i][0] == '\0')
+                row->error = missing[i];
+    }
+    if (ferror(in))
+        err(EXIT_FAILURE, "getline");
+    free(line);
+    return rowsz;
+}
+
+/*
+ * One thread per core, as long as their argon2 memory fits in half of the RAM
+ */
+long hash_threads() {
+    const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    const long pages = sysconf(_SC_PHYS_PAGES), pagesz = sysconf(_SC_PAGESIZE);
+    long threads = (cpus > 0) ? cpus : 1;
+
+    if (pages > 0 && pagesz > 0 && pages / 2 / (M_COST * 1024L / pagesz) < threads)
+        threads = pages / 2 / (M_COST * 1024L / pagesz);
+    return (threads < 1) ? 1 : threads;
+}
+
+void *hash_worker(void *arg) {
+    struct pool *pool = arg;
+    uint8_t salt[SALTLEN];
+    size_t i, pwdlen;
+
+    while ((i = atomic_fetch_add(&pool->next, 1)) < pool->rowsz) {
+        struct row *row = &pool->rows[i];
+        if (row->error)
+            continue;
+        arc4random_buf(salt, SALTLEN);
+        pwdlen = strlen(row->fields[FIELD_PASSWORD]);
+        if (argon2id_hash_encoded(T_COST, M_COST, PARALLELISM, row->fields[FIELD_PASSWORD], pwdlen, salt, SALTLEN,
+                                  HASHLEN, row->hash, ENCODEDLEN) != ARGON2_OK)
+            row->error = "password could not be hashed";
+        explicit_bzero(row->fields[FIELD_PASSWORD], pwdlen);
+    }
+    return NULL;
+}
+
+void hash_rows(struct row *rows, size_t rowsz) {
+    struct pool pool = {.rows = rows, .rowsz = rowsz};
+    const long threadsz = hash_threads();
+    pthread_t *threads;
+
+    atomic_init(&pool.next, 0);
+    if ((threads = calloc(threadsz, sizeof(pthread_t))) == NULL)
+        err(EXIT_FAILURE, "calloc");
+    for (long i = 0; i < threadsz; ++i)
+        if ((errno = pthread_create(&threads[i], NULL, hash_worker, &pool)) != 0)
+            err(EXIT_FAILURE, "pthread_create");
+    for (long i = 0; i < threadsz; ++i)
+        if ((errno = pthread_join(threads[i], NULL)) != 0)
+            err(EXIT_FAILURE, "pthread_join");
+    free(threads);
+}
+
+void insert_row(struct row *row) {
+    struct sqlbox_parm parms[] = {
+        {.type = SQLBOX_PARM_STRING, .sparm = row->fields[FIELD_UUID]},
+        {.type = SQLBOX_PARM_STRING, .sparm = row->fields[FIELD_NAME]},
+        {.type = SQLBOX_PARM_STRING, .sparm = row->hash},
+        {.type = SQLBOX_PARM_STRING, .sparm = row->fields[FIELD_CAMPUS]},
+        {.type = SQLBOX_PARM_STRING, .sparm = row->fields[FIELD_ROLE]},
+        {.type = SQLBOX_PARM_INT, .iparm = row->frozen},
+    };
+    switch (sqlbox_exec(boxctx, dbid, STMTS_ADD, 6, parms, SQLBOX_STMT_CONSTRAINT)) {
+        case SQLBOX_CODE_OK:
+            break;
+        case SQLBOX_CODE_CONSTRAINT:
+            row->error = "UUID taken, or unknown campus or role";
+            break;
+        default:
+            errx(EXIT_FAILURE, "sqlbox_exec");
+    }
+}
+
+int main(int argc, char *argv[]) {
+    FILE *in;
+    struct row *rows;
+    size_t rowsz, rejected = 0;
+
+    if (argc < 2) {
+        fprintf(stderr, "usage: import file [database]\n");
+        return EXIT_FAILURE;
+    }
+    if (argc > 2)
+        srcs[0].fname = argv[2];
+    if ((in = fopen(argv[1], "r")) == NULL)
+        err(EXIT_FAILURE, "%s", argv[1]);
+    alloc_ctx_cfg();
+    rowsz = read_rows(in, &rows);
+    fclose(in);
+
+    hash_rows(rows, rowsz);
+    for (size_t i = 0; i < rowsz; ++i) {
+        if (i % BATCH == 0 && !sqlbox_trans_immediate(boxctx, dbid, 1))
+            errx(EXIT_FAILURE, "sqlbox_trans_immediate");
+        if (rows[i].error == NULL)
+            insert_row(&rows[i]);
+        if ((i % BATCH == BATCH - 1 || i == rowsz - 1) && !sqlbox_trans_commit(boxctx, dbid, 1))
+            errx(EXIT_FAILURE, "sqlbox_trans_commit");
+    }
+
+    for (size_t i = 0; i < rowsz; ++i) {
+        if (rows[i].error) {
+            rejected++;
+            warnx("%s:%zu: %s", argv[1], rows[i].line, rows[i].error);
+        }
+        for (int j = 0; j < FIELD__MAX; ++j)
+            free(rows[i].fields[j]);
+    }
+    free(rows);
+    printf("%zu accounts imported, %zu rejected\n", rowsz - rejected, rejected);
+    sqlbox_free(boxctx);
+    return rejected ? EXIT_FAILURE : EXIT_SUCCESS;
+}
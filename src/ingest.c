@@ -0,0 +1,274 @@
+#include <sys/types.h> /* size_t */
+#include <sys/file.h> /* flock() */
+#include <sys/stat.h> /* fstat() */
+#include <dirent.h> /* scandir() */
+#include <stdarg.h> /* va_list */
+#include <stddef.h> /* NULL */
+#include <stdint.h> /* int64_t */
+#include <err.h> /* err(), warnx() */
+#include <errno.h> /* ENOENT */
+#include <fcntl.h> /* open() */
+#include <stdlib.h> /* EXIT_FAILURE */
+#include <string.h> /* memset() */
+#include <time.h> /* time() */
+#include <unistd.h> /* sleep() */
+#include <sqlbox.h>
+#include <stdio.h>
+#include "audit.h"
+
+/*
+ * Daemon moving the events appended by audit_append() into HISTORY, to be run from the directory
+ * holding db/ (the chroot of the endpoints). Every INTERVAL seconds the current log is renamed to
+ * db/audit.log.<epoch>.<pid> and the renamed logs are inserted BATCH records per transaction. Each
+ * transaction also records how far the log was read in AUDITINGEST, so that a restarted ingest
+ * resumes after the last committed record instead of losing or duplicating events.
+ * Usage: ingest [database]
+ */
+
+#define BATCH 1000
+#define INTERVAL 5 /* seconds */
+#define AUDIT_DIR "db"
+
+enum statement {
+    STMTS_INSERT,
+    STMTS_PROGRESS,
+    STMTS_OFFSET,
+    STMTS_DONE,
+    STMTS__MAX
+};
+
+static struct sqlbox_pstmt pstmts[STMTS__MAX] = {
+    /*
+     * Logs written before HISTORY.actiontime existed hold local dates instead of epochs
+     */
+    {
+        (char *)
+        "INSERT INTO HISTORY (UUID, UUID_ISSUER, serialnum, IP, action, actiontime, details) "
+        "VALUES ((?),(?),(?),(?),(SELECT actionCode FROM ACTION WHERE actionName = (?)),"
+        "CASE WHEN instr(:date, '-') THEN CAST(strftime('%s', :date, 'utc') AS INTEGER) ELSE CAST(:date AS INTEGER) END,"
+        "(?))"
+    },
+    {
+        (char *)
+        "INSERT OR REPLACE INTO AUDITINGEST (file, offset) "
+        "VALUES ((?),(?))"
+    },
+    {
+        (char *)
+        "SELECT offset "
+        "FROM AUDITINGEST "
+        "WHERE file = (?)"
+    },
+    {
+        (char *)
+        "DELETE FROM AUDITINGEST "
+        "WHERE file = (?)"
+    },
+};
+
+struct sqlbox_src srcs[] = {
+    {
+        .fname = (char *) "db/database.db",
+        .mode = SQLBOX_SRC_RW
+    }
+};
+struct sqlbox *boxctx;
+struct sqlbox_cfg cfg;
+size_t dbid;
+
+void alloc_ctx_cfg() {
+    memset(&cfg, 0, sizeof(struct sqlbox_cfg));
+    cfg.msg.func_short = warnx;
+    cfg.srcs.srcsz = 1;
+    cfg.srcs.srcs = srcs;
+    cfg.stmts.stmtsz = STMTS__MAX;
+    cfg.stmts.stmts = pstmts;
+    if ((boxctx = sqlbox_alloc(&cfg)) == NULL)
+        errx(EXIT_FAILURE, "sqlbox_alloc");
+    if (!(dbid = sqlbox_open(boxctx, 0)))
+        errx(EXIT_FAILURE, "sqlbox_open");
+}
+
+static uint32_t get32(const uint8_t *p) {
+    return (uint32_t) p[0] << 24 | (uint32_t) p[1] << 16 | (uint32_t) p[2] << 8 | (uint32_t) p[3];
+}
+
+/*
+ * Moves the current log aside, empty logs are left in place
+ */
+void rotate() {
+    char name[64];
+    struct stat st;
+
+    if (stat(AUDIT_LOG, &st) == -1) {
+        if (errno != ENOENT)
+            err(EXIT_FAILURE, "stat");
+        return;
+    }
+    if (st.st_size == 0)
+        return;
+    snprintf(name, sizeof(name), AUDIT_DIR "/" AUDIT_PENDING "%010lld.%d", (long long) time(NULL), (int) getpid());
+    if (rename(AUDIT_LOG, name) == -1)
+        err(EXIT_FAILURE, "rename");
+}
+
+/*
+ * Reads a renamed log once the appenders that opened it before the rename are done with it
+ */
+uint8_t *seal(const char *path, size_t *len) {
+    struct stat st;
+    uint8_t *buf;
+    ssize_t got;
+    size_t off = 0;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY)) == -1)
+        err(EXIT_FAILURE, "open");
+    if (flock(fd, LOCK_EX) == -1)
+        err(EXIT_FAILURE, "flock");
+    if (fstat(fd, &st) == -1)
+        err(EXIT_FAILURE, "fstat");
+    if ((buf = malloc(st.st_size + 1)) == NULL)
+        err(EXIT_FAILURE, "malloc");
+    while (off < (size_t) st.st_size && (got = read(fd, buf + off, st.st_size - off)) > 0)
+        off += got;
+    close(fd);
+    *len = off;
+    return buf;
+}
+
+int64_t get_offset(const char *file) {
+    size_t stmtid;
+    int64_t offset = 0;
+    const struct sqlbox_parmset *res;
+    struct sqlbox_parm parms[] = {
+        {.type = SQLBOX_PARM_STRING, .sparm = file},
+    };
+
+    if (!(stmtid = sqlbox_prepare_bind(boxctx, dbid, STMTS_OFFSET, 1, parms, 0)))
+        errx(EXIT_FAILURE, "sqlbox_prepare_bind");
+    if ((res = sqlbox_step(boxctx, stmtid)) == NULL)
+        errx(EXIT_FAILURE, "sqlbox_step");
+    if (res->psz == 1)
+        offset = res->ps[0].iparm;
+    if (!sqlbox_finalise(boxctx, stmtid))
+        errx(EXIT_FAILURE, "sqlbox_finalise");
+    return offset;
+}
+
+/*
+ * Parses the record at buf[off], filling parms and returning the offset of the next one, or 0 when
+ * the rest of the log is not a whole record
+ */
+size_t parse_record(const uint8_t *buf, size_t len, size_t off, struct sqlbox_parm *parms, char **fields) {
+    size_t end, p;
+    uint32_t flen;
+
+    if (len - off < 4 || (end = off + 4 + get32(buf + off)) > len || end < off + 4)
+        return 0;
+    p = off + 4;
+    for (size_t i = 0; i < AUDIT_FIELDS; ++i) {
+        if (end - p < 4)
+            return 0;
+        flen = get32(buf + p);
+        p += 4;
+        free(fields[i]);
+        fields[i] = NULL;
+        if (flen == UINT32_MAX) {
+            parms[i].type = SQLBOX_PARM_NULL;
+            continue;
+        }
+        if (end - p < flen)
+            return 0;
+        if ((fields[i] = strndup((const char *) buf + p, flen)) == NULL)
+            err(EXIT_FAILURE, "strndup");
+        parms[i].type = SQLBOX_PARM_STRING;
+        parms[i].sparm = fields[i];
+        p += flen;
+    }
+    return (p == end) ? end : 0;
+}
+
+/*
+ * Inserts the records of one renamed log from where the last run stopped, then removes it
+ */
+void ingest(const char *file) {
+    char path[128];
+    char *fields[AUDIT_FIELDS] = {0};
+    struct sqlbox_parm parms[AUDIT_FIELDS];
+    struct sqlbox_parm parms_progress[] = {
+        {.type = SQLBOX_PARM_STRING, .sparm = file},
+        {.type = SQLBOX_PARM_INT},
+    };
+    uint8_t *buf;
+    size_t len, off, next;
+    int64_t inserted = 0;
+    int batch;
+
+    snprintf(path, sizeof(path), AUDIT_DIR "/%s", file);
+    buf = seal(path, &len);
+    off = (size_t) get_offset(file);
+    while (off < len) {
+        if (!sqlbox_trans_immediate(boxctx, dbid, 1))
+            errx(EXIT_FAILURE, "sqlbox_trans_immediate");
+        for (batch = 0; batch < BATCH && off < len; ++batch) {
+            if ((next = parse_record(buf, len, off, parms, fields)) == 0) {
+                warnx("%s: truncated record at %zu, %zu bytes dropped", file, off, len - off);
+                off = len;
+                break;
+            }
+            switch (sqlbox_exec(boxctx, dbid, STMTS_INSERT, AUDIT_FIELDS, parms, SQLBOX_STMT_CONSTRAINT)) {
+                case SQLBOX_CODE_OK:
+                    inserted++;
+                    break;
+                case SQLBOX_CODE_CONSTRAINT:
+                    warnx("%s: record at %zu rejected", file, off);
+                    break;
+                default:
+                    errx(EXIT_FAILURE, "sqlbox_exec");
+            }
+            off = next;
+        }
+        parms_progress[1].iparm = (int64_t) off;
+        if (sqlbox_exec(boxctx, dbid, STMTS_PROGRESS, 2, parms_progress, 0) != SQLBOX_CODE_OK)
+            errx(EXIT_FAILURE, "sqlbox_exec");
+        if (!sqlbox_trans_commit(boxctx, dbid, 1))
+            errx(EXIT_FAILURE, "sqlbox_trans_commit");
+    }
+    // The log goes first, a leftover AUDITINGEST row is harmless since the names are never reused
+    if (unlink(path) == -1)
+        err(EXIT_FAILURE, "unlink");
+    if (sqlbox_exec(boxctx, dbid, STMTS_DONE, 1, parms_progress, 0) != SQLBOX_CODE_OK)
+        errx(EXIT_FAILURE, "sqlbox_exec");
+    for (size_t i = 0; i < AUDIT_FIELDS; ++i)
+        free(fields[i]);
+    free(buf);
+    if (inserted > 0)
+        printf("%s: %lld events ingested\n", file, (long long) inserted);
+}
+
+static int pending(const struct dirent *d) {
+    return strncmp(d->d_name, AUDIT_PENDING, sizeof(AUDIT_PENDING) - 1) == 0;
+}
+
+int main(int argc, char *argv[]) {
+    struct dirent **logs;
+    int n;
+
+    if (argc > 1)
+        srcs[0].fname = argv[1];
+    alloc_ctx_cfg();
+    setvbuf(stdout, NULL, _IOLBF, 0);
+    for (;;) {
+        rotate();
+        // Zero-padded epochs, the names sort in the order the logs were renamed
+        if ((n = scandir(AUDIT_DIR, &logs, pending, alphasort)) == -1)
+            err(EXIT_FAILURE, "scandir");
+        for (int i = 0; i < n; ++i) {
+            ingest(logs[i]->d_name);
+            free(logs[i]);
+        }
+        free(logs);
+        sleep(INTERVAL);
+    }
+}
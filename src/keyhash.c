@@ -0,0 +1,107 @@
+#include <sys/types.h> /* ssize_t */
+#include <err.h> /* err(), errx() */
+#include <errno.h> /* errno */
+#include <fcntl.h> /* open() */
+#include <stdbool.h>
+#include <stdint.h> /* uint64_t */
+#include <stdio.h> /* snprintf() */
+#include <stdlib.h> /* EXIT_FAILURE, arc4random_buf() */
+#include <string.h> /* strlen() */
+#include <unistd.h> /* link(), read() */
+#include "keyhash.h"
+
+#define ROTL(x, b) (((x) << (b)) | ((x) >> (64 - (b))))
+
+static uint64_t k0, k1;
+static bool loaded = false;
+
+/*
+ * Writes a fresh secret next to KEYHASH_KEY and links it into place, link() fails when another
+ * process got there first so every process ends up reading the same complete key
+ */
+static void create_key() {
+    uint8_t key[KEYHASH_KEY_LEN];
+    char tmp[64];
+    int fd;
+
+    arc4random_buf(key, sizeof(key));
+    snprintf(tmp, sizeof(tmp), "%s.%d", KEYHASH_KEY, (int) getpid());
+    if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0400)) == -1)
+        err(EXIT_FAILURE, "open");
+    if (write(fd, key, sizeof(key)) != (ssize_t) sizeof(key))
+        err(EXIT_FAILURE, "write");
+    if (fsync(fd) == -1)
+        err(EXIT_FAILURE, "fsync");
+    close(fd);
+    if (link(tmp, KEYHASH_KEY) == -1 && errno != EEXIST)
+        err(EXIT_FAILURE, "link");
+    unlink(tmp);
+}
+
+static uint64_t le64(const uint8_t *p) {
+    uint64_t v = 0;
+    for (int i = 7; i >= 0; --i)
+        v = (v << 8) | p[i];
+    return v;
+}
+
+static void load_key() {
+    uint8_t key[KEYHASH_KEY_LEN];
+    int fd;
+
+    if ((fd = open(KEYHASH_KEY, O_RDONLY)) == -1) {
+        if (errno != ENOENT)
+            err(EXIT_FAILURE, "open");
+        create_key();
+        if ((fd = open(KEYHASH_KEY, O_RDONLY)) == -1)
+            err(EXIT_FAILURE, "open");
+    }
+    if (read(fd, key, sizeof(key)) != (ssize_t) sizeof(key))
+        errx(EXIT_FAILURE, "%s: short key", KEYHASH_KEY);
+    close(fd);
+    k0 = le64(key);
+    k1 = le64(key + 8);
+    loaded = true;
+}
+
+#define SIPROUND \
+    do { \
+        v0 += v1; v1 = ROTL(v1, 13); v1 ^= v0; v0 = ROTL(v0, 32); \
+        v2 += v3; v3 = ROTL(v3, 16); v3 ^= v2; \
+        v0 += v3; v3 = ROTL(v3, 21); v3 ^= v0; \
+        v2 += v1; v1 = ROTL(v1, 17); v1 ^= v2; v2 = ROTL(v2, 32); \
+    } while (0)
+
+uint64_t keyhash(const char *s) {
+    const uint8_t *in = (const uint8_t *) s;
+    const size_t len = strlen(s);
+    uint64_t v0, v1, v2, v3, m, last;
+    size_t i;
+
+    if (!loaded)
+        load_key();
+    v0 = k0 ^ 0x736f6d6570736575ULL;
+    v1 = k1 ^ 0x646f72616e646f6dULL;
+    v2 = k0 ^ 0x6c7967656e657261ULL;
+    v3 = k1 ^ 0x7465646279746573ULL;
+    for (i = 0; i + 8 <= len; i += 8) {
+        m = le64(in + i);
+        v3 ^= m;
+        SIPROUND;
+        SIPROUND;
+        v0 ^= m;
+    }
+    last = (uint64_t) len << 56;
+    for (size_t j = 0; i + j < len; ++j)
+        last |= (uint64_t) in[i + j] << (8 * j);
+    v3 ^= last;
+    SIPROUND;
+    SIPROUND;
+    v0 ^= last;
+    v2 ^= 0xff;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+    return v0 ^ v1 ^ v2 ^ v3;
+}
@@ -0,0 +1,20 @@
+#ifndef KEYHASH_H
+#define KEYHASH_H
+
+#include <stdint.h> /* uint64_t */
+
+/*
+ * Secret of keyhash(), KEYHASH_KEY_LEN random bytes written on first use by whichever process
+ * needs it first. Without it the small space of IPv4 addresses would let anyone reading the hit
+ * log or guessing rate limit buckets recover the inputs by brute force.
+ */
+#define KEYHASH_KEY "db/hash.key"
+#define KEYHASH_KEY_LEN 16
+
+/*
+ * SipHash-2-4 of a string under the per-install secret: well mixed over all 64 bits, as the
+ * HyperLogLog of fold.c needs, and not invertible without the key
+ */
+uint64_t keyhash(const char *s);
+
+#endif
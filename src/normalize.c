@@ -0,0 +1,201 @@
+#include <err.h> /* err() */
+#include <stdint.h> /* uint32_t */
+#include <stdlib.h> /* EXIT_FAILURE */
+#include <string.h> /* strlen() */
+#include "normalize.h"
+
+/*
+ * Base letter of every code point in U+00C0-U+024F and U+1E00-U+1EFF,
+ * '-' keeps the code point as it is and '*' marks a ligature that expands
+ * into two letters (see fold()).
+ */
+static const char latin_base[] =
+    "aaaaaa*ceeeeiiiidnooooo-ouuuuy**aaaaaa*ceeeeiiiidnooooo-ouuuuy*y" /* U+00C0 */
+    "aaaaaaccccccccddddeeeeeeeeeegggggggghhhhiiiiiiiiii**jjkkklllllll" /* U+0100 */
+    "lllnnnnnnnnnoooooo**rrrrrrssssssssttttttuuuuuuuuuuuuwwyyyzzzzzzs" /* U+0140 */
+    "--------------------------------oo-------------uu---------------" /* U+0180 */
+    "-------------aaiioouuuuuuuuuu-aaaa----ggkkoooo--j---gg--nnaa----" /* U+01C0 */
+    "aaaaeeeeiiiioooorrrruuuusstt--hh------aaeeooooooooyy------------" /* U+0200 */
+    "----------------"; /* U+0240 */
+
+static const char latin_ext_base[] =
+    "aabbbbbbccddddddddddeeeeeeeeeeffgghhhhhhhhhhiiiikkkkkkllllllllmm" /* U+1E00 */
+    "mmmmnnnnnnnnoooooooopppprrrrrrrrssssssssssttttttttuuuuuuuuuuvvvv" /* U+1E40 */
+    "wwwwwwwwwwxxxxyyzzzzzzhtwy----*-aaaaaaaaaaaaaaaaaaaaaaaaeeeeeeee" /* U+1E80 */
+    "eeeeeeeeiiiioooooooooooooooooooooooouuuuuuuuuuuuuuyyyyyyyy------"; /* U+1EC0 */
+
+size_t utf8_decode(const unsigned char *s, uint32_t *cp) {
+    size_t len, i;
+    if (s[0] < 0x80) {
+        *cp = s[0];
+        return 1;
+    }
+    if ((s[0] & 0xE0) == 0xC0) {
+        *cp = s[0] & 0x1F;
+        len = 2;
+    } else if ((s[0] & 0xF0) == 0xE0) {
+        *cp = s[0] & 0x0F;
+        len = 3;
+    } else if ((s[0] & 0xF8) == 0xF0) {
+        *cp = s[0] & 0x07;
+        len = 4;
+    } else {
+        *cp = 0xFFFD;
+        return 1;
+    }
+    for (i = 1; i < len; ++i) {
+        if ((s[i] & 0xC0) != 0x80) {
+            *cp = 0xFFFD;
+            return 1;
+        }
+        *cp = (*cp << 6) | (s[i] & 0x3F);
+    }
+    return len;
+}
+
+static size_t utf8_encode(uint32_t cp, char *out) {
+    if (cp < 0x80) {
+        out[0] = (char) cp;
+        return 1;
+    }
+    if (cp < 0x800) {
+        out[0] = (char) (0xC0 | (cp >> 6));
+        out[1] = (char) (0x80 | (cp & 0x3F));
+        return 2;
+    }
+    if (cp < 0x10000) {
+        out[0] = (char) (0xE0 | (cp >> 12));
+        out[1] = (char) (0x80 | ((cp >> 6) & 0x3F));
+        out[2] = (char) (0x80 | (cp & 0x3F));
+        return 3;
+    }
+    out[0] = (char) (0xF0 | (cp >> 18));
+    out[1] = (char) (0x80 | ((cp >> 12) & 0x3F));
+    out[2] = (char) (0x80 | ((cp >> 6) & 0x3F));
+    out[3] = (char) (0x80 | (cp & 0x3F));
+    return 4;
+}
+
+/*
+ * Writes the folded form of a code point into out (at most 4 bytes) and
+ * returns its length, 0 means the code point is dropped.
+ */
+static size_t fold(uint32_t cp, char *out) {
+    const char *lig = NULL;
+    char base = '-';
+
+    if (cp >= 'A' && cp <= 'Z')
+        cp += 'a' - 'A';
+    else if (cp == 0x190 || cp == 0x194) /* Kabyle capital epsilon and gamma */
+        cp = (cp == 0x190) ? 0x25B : 0x263;
+    else if (cp >= 0xC0 && cp < 0x250)
+        base = latin_base[cp - 0xC0];
+    else if (cp >= 0x1E00 && cp < 0x1F00)
+        base = latin_ext_base[cp - 0x1E00];
+    else if (cp >= 0x300 && cp <= 0x36F) /* combining diacritics */
+        return 0;
+    else if ((cp >= 0x64B && cp <= 0x65F) || cp == 0x670 || cp == 0x640 || (cp >= 0x6D6 && cp <= 0x6ED))
+        return 0; /* Arabic harakat, tatweel and Quranic marks */
+    else if (cp == 0x622 || cp == 0x623 || cp == 0x625 || (cp >= 0x671 && cp <= 0x673))
+        cp = 0x627; /* alef with hamza or madda */
+    else if (cp == 0x649 || cp == 0x626 || cp == 0x6CC)
+        cp = 0x64A; /* alef maksura, yeh with hamza, Farsi yeh */
+    else if (cp == 0x629)
+        cp = 0x647; /* teh marbuta */
+    else if (cp == 0x624)
+        cp = 0x648; /* waw with hamza */
+    else if (cp == 0x6A9)
+        cp = 0x643; /* keheh */
+    else if (cp >= 0x660 && cp <= 0x669)
+        cp = '0' + (cp - 0x660);
+    else if (cp >= 0x6F0 && cp <= 0x6F9)
+        cp = '0' + (cp - 0x6F0);
+
+    if (base == '*') {
+        switch (cp) {
+            case 0xC6:
+            case 0xE6:
+                lig = "ae";
+                break;
+            case 0xDE:
+            case 0xFE:
+                lig = "th";
+                break;
+            case 0x132:
+            case 0x133:
+                lig = "ij";
+                break;
+            case 0x152:
+            case 0x153:
+                lig = "oe";
+                break;
+            default:
+                lig = "ss";
+                break;
+        }
+        out[0] = lig[0];
+        out[1] = lig[1];
+        return 2;
+    }
+    if (base != '-') {
+        out[0] = base;
+        return 1;
+    }
+    if (cp == 0xFFFD)
+        return 0;
+    return utf8_encode(cp, out);
+}
+
+/*
+ * Appends the folded form of in to out, which must have room for
+ * 2 * strlen(in) bytes (no code point grows more than that when folded).
+ */
+static char *fold_into(char *out, const char *in) {
+    const unsigned char *s = (const unsigned char *) in;
+    uint32_t cp;
+    int space = 0, empty = 1;
+
+    while (*s) {
+        s += utf8_decode(s, &cp);
+        if (cp == ' ' || cp == '\t' || cp == '\n' || cp == '\r' || cp == '\v' || cp == '\f' || cp == 0xA0) {
+            space = !empty;
+            continue;
+        }
+        if (space) {
+            *out++ = ' ';
+            space = 0;
+        }
+        out += fold(cp, out);
+        empty = 0;
+    }
+    return out;
+}
+
+char *normalize_text(const char *in) {
+    char *buf, *end;
+
+    if ((buf = malloc(2 * strlen(in) + 1)) == NULL)
+        err(EXIT_FAILURE, "malloc");
+    end = fold_into(buf, in);
+    *end = '\0';
+    return buf;
+}
+
+char *normalize_fields(const char *const *fields, size_t fieldsz) {
+    size_t len = 1, i;
+    char *buf, *end;
+
+    for (i = 0; i < fieldsz; ++i)
+        len += 2 * (fields[i] ? strlen(fields[i]) : 0) + 1;
+    if ((buf = malloc(len)) == NULL)
+        err(EXIT_FAILURE, "malloc");
+    end = buf;
+    for (i = 0; i < fieldsz; ++i) {
+        if (i > 0)
+            *end++ = '\n';
+        if (fields[i])
+            end = fold_into(end, fields[i]);
+    }
+    *end = '\0';
+    return buf;
+}
@@ -0,0 +1,28 @@
+#ifndef NORMALIZE_H
+#define NORMALIZE_H
+
+#include <stddef.h> /* size_t */
+#include <stdint.h> /* uint32_t */
+
+/*
+ * Decodes one UTF-8 sequence, returns the number of bytes consumed.
+ * Malformed sequences consume one byte and yield U+FFFD.
+ */
+size_t utf8_decode(const unsigned char *s, uint32_t *cp);
+
+/*
+ * Folds a UTF-8 string into its search form: lower case, accents stripped,
+ * Arabic letter variants and diacritics unified, whitespace collapsed.
+ * The result is allocated and must be freed by the caller.
+ */
+char *normalize_text(const char *in);
+
+/*
+ * Builds a BOOK.searchkey from the given fields, each field normalized with
+ * normalize_text() and separated by a newline so that a (newline free)
+ * normalized query can never match across two fields.
+ * NULL fields are kept as empty ones.
+ */
+char *normalize_fields(const char *const *fields, size_t fieldsz);
+
+#endif
@@ -2,6 +2,8 @@
 #include <stdarg.h> /* va_list */
 #include <stddef.h> /* NULL */
 #include <stdint.h> /* int64_t */
+#include <limits.h> /* INT_MAX */
+#include <time.h> /* localtime() */
 #include <unistd.h> /* pledge() */
 #include <err.h> /* err(), warnx() */
 #include <inttypes.h>
@@ -10,8 +12,14 @@
 #include <kcgi.h>
 #include <kcgijson.h>
 #include <sqlbox.h>
+#include <sha2.h> /* SHA256Data() */
 #include <stdbool.h>
 #include <stdio.h>
+#include "token.h"
+#include "session.h"
+#include "audit.h"
+#include "history.h"
+#include "archive.h"
 struct kreq r;
 struct kjsonreq req;
 /*
@@ -100,7 +108,7 @@ enum statement_pieces get_stmts() {
     return (enum statement_pieces) r.page;
 }
 
-static const char *rows[STMTS__MAX][11] = {
+static const char *rows[STMTS__MAX][12] = {
     {"publisherName",NULL},
     {"authorName",NULL},
     {"langcode",NULL},
@@ -113,30 +121,28 @@ static const char *rows[STMTS__MAX][11] = {
     {
         "BOOK.serialnum", "type", "category", "categoryName", "publisher", "booktitle", "bookreleaseyear", "bookcover",
         "description",
-        "hits",NULL
+        "hits", "viewers",NULL
     },
     {"STOCK.serialnum", "campus", "instock",NULL},
-    {"UUID", "serialnum", "rentduration", "rentdate", "extended",NULL},
+    {"UUID", "serialnum", "rentduration", "rentdate", "extended", "campus", "duedate",NULL},
     {"UUID", "UUID_ISSUER", "serialnum", "IP", "action", "actiondate", "details",NULL},
     {"account", "sessionID", "expiresAt",NULL}
 };
 static struct sqlbox_pstmt pstms_data_top[STMTS__MAX] = {
     {
         (char *)
-        "FROM PUBLISHER "
-        "LEFT JOIN BOOK B ON B.publisher = PUBLISHER.publisherName "
+        "FROM POPULARITY P "
+        "JOIN PUBLISHER ON PUBLISHER.publisherName = P.name AND P.kind = 'publisher' "
     },
     {
         (char *)
-        "FROM AUTHOR "
-        "LEFT JOIN AUTHORED A ON AUTHOR.authorName = A.author "
-        "LEFT JOIN BOOK B ON B.serialnum = A.serialnum "
+        "FROM POPULARITY P "
+        "JOIN AUTHOR ON AUTHOR.authorName = P.name AND P.kind = 'author' "
     },
     {
         (char *)
-        "FROM LANG "
-        "LEFT JOIN LANGUAGES A ON LANG.langCode = A.lang "
-        "LEFT JOIN BOOK B ON B.serialnum = A.serialnum "
+        "FROM POPULARITY P "
+        "JOIN LANG ON LANG.langCode = P.name AND P.kind = 'lang' "
     },
     {
         (char *)
@@ -144,8 +150,8 @@ static struct sqlbox_pstmt pstms_data_top[STMTS__MAX] = {
     },
     {
         (char *)
-        "FROM DOCTYPE "
-        "LEFT JOIN BOOK B ON DOCTYPE.typeName = B.type "
+        "FROM POPULARITY P "
+        "JOIN DOCTYPE ON DOCTYPE.typeName = P.name AND P.kind = 'doctype' "
     },
     {
         (char *)
@@ -159,7 +165,8 @@ static struct sqlbox_pstmt pstms_data_top[STMTS__MAX] = {
     },
     {
         (char *)
-        "FROM CATEGORY LEFT JOIN BOOK B ON CATEGORY.categoryClass = B.category "
+        "FROM POPULARITY P "
+        "JOIN CATEGORY ON CATEGORY.categoryClass = P.name AND P.kind = 'category' "
     },
 
     {
@@ -191,12 +198,12 @@ static struct sqlbox_pstmt pstms_data_top[STMTS__MAX] = {
     },
     {
         (char *)
-        "FROM INVENTORY "
+        "FROM INVENTORYTEXT "
     },
     {
 
         (char *)
-        "FROM HISTORY "
+        "FROM HISTORYTEXT "
     },
     {
         (char *)
@@ -236,10 +243,15 @@ enum key {
     KEY_ORDER_SERIALNUM,
     KEY_ORDER_DATE,
     KEY_ORDER_STOCK,
+    KEY_ORDER_TRENDING,
+    KEY_ORDER_VIEWERS,
     KEY_LIMIT,
     KEY_OFFSET,
     KEY_CASCADE,
     KEY_TREE,
+    KEY_AVAILABLE_AT,
+    KEY_ARCHIVE,
+    KEY_OVERDUE,
     COOKIE_SESSIONID,
     KEY_MANDATORY_GROUP_BY,
     KEY__MAX
@@ -277,34 +289,42 @@ static const struct kvalid keys[KEY__MAX] = {
     {kvalid_int, "order_serialnum"},
     {kvalid_int, "order_date"},
     {kvalid_int, "order_stock"},
+    {kvalid_stringne, "order_trending"},
+    {kvalid_int, "order_viewers"},
     {kvalid_int, "limit"},
     {kvalid_int, "page"},
     {NULL, "cascade"},
     {NULL, "tree"},
+    {kvalid_stringne, "available_at"},
+    {kvalid_bit, "archive"},
+    {kvalid_bit, "overdue"},
     {kvalid_stringne, "sessionID"},
 
 };
 
 
-static char *pstmts_switches[STMTS__MAX][11] = {
+static char *pstmts_switches[STMTS__MAX][13] = {
     {
         "instr(publisherName,(?)) > 0",
-        "serialnum = (?)"
+        "publisherName IN (SELECT publisher FROM BOOK WHERE serialnum = (?))",
+        "publisherName IN (SELECT name FROM TRENDING WHERE span = (?) AND kind = 'publisher')"
     },
     {
         "instr(authorName,(?)) > 0",
-        "A.serialnum = (?)"
+        "authorName IN (SELECT author FROM AUTHORED WHERE serialnum = (?))",
+        "authorName IN (SELECT name FROM TRENDING WHERE span = (?) AND kind = 'author')"
     },
     {
         "instr(langCode,(?)) > 0",
-        "A.serialnum = (?)"
+        "langCode IN (SELECT lang FROM LANGUAGES WHERE serialnum = (?))",
+        "langCode IN (SELECT name FROM TRENDING WHERE span = (?) AND kind = 'lang')"
     },
     {
         "instr(actionName,(?)) > 0"
     },
     {
         "instr(typeName,(?)) > 0",
-        "serialnum = (?)"
+        "typeName IN (SELECT type FROM BOOK WHERE serialnum = (?))"
     },
     {
         "instr(campusName,(?)) > 0",
@@ -321,7 +341,7 @@ static char *pstmts_switches[STMTS__MAX][11] = {
         "parentCategoryID = (?)",
         "instr(categoryName,(?)) > 0",
         "categoryClass = (?)",
-        "serialnum = (?)",
+        "categoryClass IN (SELECT category FROM BOOK WHERE serialnum = (?))",
     },
     {
         "ACCOUNT.UUID = (?)",
@@ -343,7 +363,10 @@ static char *pstmts_switches[STMTS__MAX][11] = {
         "UUID = (?)",
         "bookreleaseyear >= (?)",
         "bookreleaseyear <= (?)",
-        "instr(description, (?)) > 0"
+        "instr(description, (?)) > 0",
+        "BOOK.serialnum IN (SELECT name FROM TRENDING WHERE span = (?) AND kind = 'book')",
+        "EXISTS (SELECT 1 FROM STOCKMAP WHERE STOCKMAP.campus = (?) AND word = BOOK.bookid >> 6 "
+        "AND bits & (1 << (BOOK.bookid & 63)))"
     },
     {
         "STOCK.serialnum = (?)",
@@ -352,15 +375,16 @@ static char *pstmts_switches[STMTS__MAX][11] = {
     },
     {
         "UUID = (?)",
-        "serialnum = (?)"
+        "serialnum = (?)",
+        "campus = (?)"
     },
     {
         "UUID = (?)",
         "UUID_ISSUER = (?)",
-        "serialnum = (?)",
-        "action = (?)",
-        "actiondate >= datetime((?),'unixepoch')",
-        "actiondate <= datetime((?),'unixepoch')",
+        "(serialnum = :serialnum OR queryserialnum = :serialnum)",
+        "actioncode = (SELECT actionCode FROM ACTION WHERE actionName = (?))",
+        "actiontime >= (?)",
+        "actiontime <= (?)",
     },
     {
         "sessionID = (?)",
@@ -368,11 +392,11 @@ static char *pstmts_switches[STMTS__MAX][11] = {
     }
 };
 
-static enum key switch_keys[STMTS__MAX][12] = {
+static enum key switch_keys[STMTS__MAX][14] = {
 
-    {KEY_SWITCH_NAME, KEY_SWITCH_SERIALNUM, KEY__MAX},
-    {KEY_SWITCH_NAME, KEY_SWITCH_SERIALNUM, KEY__MAX},
-    {KEY_SWITCH_NAME, KEY_SWITCH_SERIALNUM, KEY__MAX},
+    {KEY_SWITCH_NAME, KEY_SWITCH_SERIALNUM, KEY_ORDER_TRENDING, KEY__MAX},
+    {KEY_SWITCH_NAME, KEY_SWITCH_SERIALNUM, KEY_ORDER_TRENDING, KEY__MAX},
+    {KEY_SWITCH_NAME, KEY_SWITCH_SERIALNUM, KEY_ORDER_TRENDING, KEY__MAX},
     {KEY_SWITCH_NAME, KEY__MAX},
     {KEY_SWITCH_NAME, KEY_SWITCH_SERIALNUM, KEY__MAX},
     {KEY_SWITCH_NAME, KEY_SWITCH_SERIALNUM, KEY_SWITCH_UUID, KEY__MAX},
@@ -385,11 +409,11 @@ static enum key switch_keys[STMTS__MAX][12] = {
     {
         KEY_SWITCH_SERIALNUM, KEY_SWITCH_NAME, KEY_SWITCH_LANG, KEY_SWITCH_AUTHOR, KEY_SWITCH_TYPE,
         KEY_SWITCH_PUBLISHER, KEY_SWITCH_CAMPUS, KEY_SWITCH_UUID, KEY_SWITCH_UPPERYEAR, KEY_SWITCH_LOWERYEAR,
-        KEY_SWITCH_DESCRIPTION,
+        KEY_SWITCH_DESCRIPTION, KEY_ORDER_TRENDING, KEY_AVAILABLE_AT,
         KEY__MAX
     },
     {KEY_SWITCH_SERIALNUM, KEY_SWITCH_CAMPUS, KEY_SWITCH_NOTEMPTY, KEY__MAX},
-    {KEY_SWITCH_UUID, KEY_SWITCH_SERIALNUM, KEY__MAX},
+    {KEY_SWITCH_UUID, KEY_SWITCH_SERIALNUM, KEY_SWITCH_CAMPUS, KEY__MAX},
     {
         KEY_SWITCH_UUID, KEY_SWITCH_ISSUER, KEY_SWITCH_SERIALNUM, KEY_SWITCH_ACTION, KEY_SWITCH_UPPERDATE,
         KEY_SWITCH_LOWERDATE, KEY__MAX
@@ -400,19 +424,19 @@ static enum key switch_keys[STMTS__MAX][12] = {
 
 static enum key bottom_keys[STMTS__MAX][8] = {
     {
-        KEY_MANDATORY_GROUP_BY,
+        KEY_ORDER_TRENDING,
         KEY_ORDER_HITS,
         KEY_ORDER_NAME,
         KEY__MAX
     },
     {
-        KEY_MANDATORY_GROUP_BY,
+        KEY_ORDER_TRENDING,
         KEY_ORDER_HITS,
         KEY_ORDER_NAME,
         KEY__MAX
     },
     {
-        KEY_MANDATORY_GROUP_BY,
+        KEY_ORDER_TRENDING,
         KEY_ORDER_HITS,
         KEY_ORDER_NAME,
         KEY__MAX
@@ -423,7 +447,6 @@ static enum key bottom_keys[STMTS__MAX][8] = {
         KEY__MAX
     },
     {
-        KEY_MANDATORY_GROUP_BY,
         KEY_ORDER_HITS,
         KEY_ORDER_NAME,
         KEY__MAX
@@ -442,7 +465,6 @@ static enum key bottom_keys[STMTS__MAX][8] = {
     },
 
     {
-        KEY_MANDATORY_GROUP_BY,
         KEY_ORDER_HITS,
         KEY_ORDER_CLASS,
         KEY_ORDER_NAME,
@@ -457,10 +479,12 @@ static enum key bottom_keys[STMTS__MAX][8] = {
     },
     {
         KEY_MANDATORY_GROUP_BY,
+        KEY_ORDER_TRENDING,
         KEY_ORDER_SERIALNUM,
         KEY_ORDER_NAME,
         KEY_ORDER_DATE,
         KEY_ORDER_HITS,
+        KEY_ORDER_VIEWERS,
         KEY__MAX
     },
     {
@@ -490,20 +514,25 @@ static enum key bottom_keys[STMTS__MAX][8] = {
         KEY__MAX
     }
 };
-static char *pstmts_bottom[STMTS__MAX][5] = {
+/*
+ * Publishers, authors, languages, doctypes and categories are listed from their POPULARITY row,
+ * which triggers keep equal to the SUM(hits) of their books: one row per entity, so there is
+ * nothing to group, and sorting by hits walks POPULARITY_HITS
+ */
+static char *pstmts_bottom[STMTS__MAX][7] = {
     {
-        "publisherName",
-        "SUM(hits)",
+        "(SELECT hits FROM TRENDING WHERE span = (?) AND kind = 'publisher' AND name = publisherName)",
+        "P.hits",
         "publisherName",
     },
     {
-        "authorName",
-        "SUM(hits)",
+        "(SELECT hits FROM TRENDING WHERE span = (?) AND kind = 'author' AND name = authorName)",
+        "P.hits",
         "authorName",
     },
     {
-        "langCode",
-        "SUM(hits)",
+        "(SELECT hits FROM TRENDING WHERE span = (?) AND kind = 'lang' AND name = langCode)",
+        "P.hits",
         "langCode",
     },
     {
@@ -511,8 +540,7 @@ static char *pstmts_bottom[STMTS__MAX][5] = {
         "actionName",
     },
     {
-        "typeName",
-        "SUM(hits)",
+        "P.hits",
         "typeName",
     },
     {
@@ -525,8 +553,7 @@ static char *pstmts_bottom[STMTS__MAX][5] = {
         "roleName",
     },
     {
-        "categoryClass, categoryName, parentCategoryID",
-        "SUM(hits)",
+        "P.hits",
         "categoryClass",
         "categoryName",
     },
@@ -540,10 +567,12 @@ static char *pstmts_bottom[STMTS__MAX][5] = {
     {
 
         "BOOK.serialnum, type, category, categoryName, publisher, booktitle, bookreleaseyear, bookcover, hits",
+        "(SELECT hits FROM TRENDING WHERE span = (?) AND kind = 'book' AND name = BOOK.serialnum)",
         "serialnum",
         "booktitle",
         "bookreleaseyear",
         "hits",
+        "viewers",
     },
     {
         "STOCK.serialnum, campus, instock,hits",
@@ -551,16 +580,16 @@ static char *pstmts_bottom[STMTS__MAX][5] = {
         "instock",
     },
     {
-        "UUID, serialnum, rentduration, rentdate, extended",
+        "UUID, serialnum, rentduration, rentdate, extended, campus, duedate",
         "UUID",
         "serialnum",
-        "rentdate",
+        "renttime",
     },
     {
         "UUID, UUID_ISSUER, serialnum, action, actiondate",
         "UUID",
         "serialnum",
-        "actiondate",
+        "actiontime",
     },
     {
         "account,sessionID,expiresAt ",
@@ -573,32 +602,18 @@ enum statement {
     STMT_DATA,
     STMT_COUNT,
     STMT_LOGIN,
-    STMT_SAVE,
     STMT_CATEGORY_CHILD,
     STMT_AUTHORED,
     STMT_LANGUAGED,
     STMT_STOCKED,
+    STMT_ATTACH,
     STMT__FINAL__MAX
 };
 
 static struct sqlbox_pstmt pstmts[STMT__FINAL__MAX] = {
     {(char *) ""},
     {(char *) ""},
-    {
-        (char *)
-        "SELECT ACCOUNT.UUID, displayname, pwhash, campus, role, perms, frozen "
-        "FROM ROLE,"
-        "ACCOUNT "
-        "LEFT JOIN SESSIONS S on ACCOUNT.UUID = S.account "
-        "WHERE ACCOUNT.role = ROLE.roleName "
-        "AND sessionID = (?) "
-        "GROUP BY ACCOUNT.UUID, displayname, pwhash, campus, perms, frozen "
-    },
-    {
-        (char *)
-        "INSERT INTO HISTORY (UUID, IP, action, actiondate, details) "
-        "VALUES ((?),(?),'EDIT',datetime('now','localtime'),(?))"
-    },
+    SESSION_LOGIN_PSTMT,
     {
         (char *)
         "SELECT categoryClass, categoryName, parentCategoryID "
@@ -625,8 +640,40 @@ static struct sqlbox_pstmt pstmts[STMT__FINAL__MAX] = {
         "FROM STOCK "
         "WHERE serialnum = (?)"
     },
+    {(char *) "ATTACH DATABASE (?) AS (?)"},
 };
 
+/*
+ * Months overlapping ?lowerdate and ?upperdate
+ */
+void history_months(int *from, int *to) {
+    time_t date;
+
+    *from = 0;
+    *to = INT_MAX;
+    // Partitions are local months, as rollover cuts them
+    if (r.fieldmap[KEY_SWITCH_LOWERDATE]) {
+        date = (time_t) r.fieldmap[KEY_SWITCH_LOWERDATE]->parsed.i;
+        *from = history_month(localtime(&date));
+    }
+    if (r.fieldmap[KEY_SWITCH_UPPERDATE]) {
+        date = (time_t) r.fieldmap[KEY_SWITCH_UPPERDATE]->parsed.i;
+        *to = history_month(localtime(&date));
+    }
+}
+
+/*
+ * Number of partitions overlapping ?lowerdate and ?upperdate, counted up to one more than a query
+ * can attach
+ */
+size_t history_span() {
+    struct history_partition found[HISTORY_ATTACH_MAX + 1];
+    int from, to;
+
+    history_months(&from, &to);
+    return history_partitions(from, to, found, HISTORY_ATTACH_MAX + 1);
+}
+
 enum khttp sanitize() {
     if (r.method != KMETHOD_GET)
         return KHTTP_405;
@@ -636,6 +683,25 @@ enum khttp sanitize() {
         return KHTTP_400;
     if (r.fieldmap[KEY_TREE] && r.fieldmap[KEY_CASCADE])
         return KHTTP_400;
+    // Archives are streamed in chronological order
+    if (r.fieldmap[KEY_ARCHIVE] && (r.page != PG_HISTORY || r.fieldmap[KEY_ORDER_UUID] ||
+                                    r.fieldmap[KEY_ORDER_SERIALNUM] || r.fieldmap[KEY_ORDER_DATE]))
+        return KHTTP_400;
+    // A range spanning more partitions than can be attached is refused instead of losing its oldest months
+    if (r.page == PG_HISTORY && !r.fieldmap[KEY_ARCHIVE] && history_span() > HISTORY_ATTACH_MAX)
+        return KHTTP_400;
+    // Overdue loans are streamed in due-date order from the index of one campus
+    if (r.fieldmap[KEY_OVERDUE] && (r.page != PG_INVENTORY || !r.fieldmap[KEY_SWITCH_CAMPUS] ||
+                                    r.fieldmap[KEY_ORDER_UUID] || r.fieldmap[KEY_ORDER_SERIALNUM] ||
+                                    r.fieldmap[KEY_ORDER_DATE]))
+        return KHTTP_400;
+    if (r.fieldmap[KEY_ORDER_TRENDING]) {
+        const char *span = r.fieldmap[KEY_ORDER_TRENDING]->parsed.s;
+        if (strcmp(span, "24h") != 0 && strcmp(span, "7d") != 0 && strcmp(span, "30d") != 0)
+            return KHTTP_400;
+        if (r.page != PG_PUBLISHER && r.page != PG_AUTHOR && r.page != PG_LANG && r.page != PG_BOOK)
+            return KHTTP_400;
+    }
     return KHTTP_200;
 }
 
@@ -653,6 +719,10 @@ struct sqlbox_cfg cfg_login;
 size_t dbid_login;
 struct sqlbox_parm *parms; //Array of statement parameters
 size_t parmsz;
+size_t orderparmsz; // Parameters of the ORDER BY clause, which the count statement does not have
+bool archive_scan; // History page read from the archives with ?archive=1, instead of SQL
+struct history_partition partitions[HISTORY_ATTACH_MAX]; // Partitions the history page reads besides HISTORY
+size_t partitionsz;
 /*
  * Allocates the context and source for the current operations
  */
@@ -670,6 +740,20 @@ void alloc_ctx_cfg() {
 }
 
 
+/*
+ * Attaches the partitions found by history_from()
+ */
+void attach_partitions() {
+    for (size_t i = 0; i < partitionsz; ++i) {
+        struct sqlbox_parm parms_attach[] = {
+            {.type = SQLBOX_PARM_STRING, .sparm = partitions[i].path},
+            {.type = SQLBOX_PARM_STRING, .sparm = partitions[i].schema},
+        };
+        if (sqlbox_exec(boxctx_data, dbid_data, STMT_ATTACH, 2, parms_attach, 0) != SQLBOX_CODE_OK)
+            errx(EXIT_FAILURE, "sqlbox_exec");
+    }
+}
+
 void alloc_ctx_cfg_login() {
     memset(&cfg_login, 0, sizeof(struct sqlbox_cfg));
     cfg_login.msg.func_short = warnx;
@@ -707,39 +791,59 @@ struct usr curr_usr = {
 
 void fill_user() {
     struct kpair *field;
+    struct token tok;
 
-    if ((field = r.cookiemap[COOKIE_SESSIONID])) {
-        size_t stmtid;
-        size_t parmsz = 1;
-        const struct sqlbox_parmset *res;
-        struct sqlbox_parm parms[] = {
-            {.type = SQLBOX_PARM_STRING, .sparm = field->parsed.s},
-        };
-        if (!(stmtid = sqlbox_prepare_bind(boxctx_login, dbid_login, 0, parmsz, parms, 0)))
-            errx(EXIT_FAILURE, "sqlbox_prepare_bind");
-        if ((res = sqlbox_step(boxctx_login, stmtid)) == NULL)
-            errx(EXIT_FAILURE, "sqlbox_step");
-        if (res->psz != 0) {
-            curr_usr.authenticated = true;
-            kasprintf(&curr_usr.UUID, "%s", res->ps[0].sparm);
-
-            kasprintf(&curr_usr.disp_name, "%s", res->ps[1].sparm);
-
-            kasprintf(&curr_usr.campus, "%s", res->ps[3].sparm);
-
-            kasprintf(&curr_usr.role, "%s", res->ps[4].sparm);
+    if ((field = r.cookiemap[COOKIE_SESSIONID]) == NULL ||
+        !session_resolve(field->parsed.s, boxctx_login, dbid_login, 0, &tok))
+        return;
+    curr_usr.authenticated = true;
+    curr_usr.UUID = tok.UUID;
+    curr_usr.disp_name = tok.disp_name;
+    curr_usr.campus = tok.campus;
+    curr_usr.role = tok.role;
+    kasprintf(&curr_usr.sessionID, "%s", field->parsed.s);
+    curr_usr.perms = int_to_accperms(tok.perms);
+    curr_usr.frozen = tok.frozen;
+}
 
-            kasprintf(&curr_usr.sessionID, "%s", field->parsed.s);
+/*
+ * Reads the history page from HISTORY and the monthly partitions overlapping ?lowerdate and
+ * ?upperdate, the filters are pushed down into each branch of the UNION ALL by SQLite
+ */
+void history_from() {
+    int from, to;
 
-            curr_usr.perms = int_to_accperms((int) res->ps[5].iparm);
+    history_months(&from, &to);
+    if ((partitionsz = history_partitions(from, to, partitions, HISTORY_ATTACH_MAX)) == 0)
+        return;
+    // Same columns as HISTORYTEXT, views cannot span attached databases
+    pstms_data_top[STMTS_HISTORY].stmt = (char *) "FROM (SELECT * FROM main.HISTORYTEXT";
+    for (size_t i = 0; i < partitionsz; ++i)
+        kasprintf(&pstms_data_top[STMTS_HISTORY].stmt, "%s UNION ALL SELECT H.UUID, UUID_ISSUER, serialnum, IP, "
+                  "actionName, datetime(actiontime, 'unixepoch', 'localtime'), details, querypage, queryserialnum, "
+                  "actiontime, H.action FROM %s.HISTORY H JOIN main.ACTION ON actionCode = H.action",
+                  pstms_data_top[STMTS_HISTORY].stmt, partitions[i].schema);
+    kasprintf(&pstms_data_top[STMTS_HISTORY].stmt, "%s) AS HISTORYTEXT ", pstms_data_top[STMTS_HISTORY].stmt);
+}
 
-            curr_usr.frozen = res->ps[6].iparm;
-        }
-        sqlbox_finalise(boxctx_login, stmtid);
-    }
+/*
+ * Reads the overdue loans of ?campus oldest due first: with the campus bound and duedate
+ * ranged, the GROUP BY and ORDER BY follow INVENTORY_DUEDATE (campus, duedate, UUID, serialnum)
+ * and the rows are stepped out of the index without a sort
+ */
+void overdue_from() {
+    pstms_data_top[STMTS_INVENTORY].stmt = (char *)
+        "FROM INVENTORYTEXT "
+        "WHERE duetime < CAST(strftime('%s', 'now') AS INTEGER) ";
+    pstmts_bottom[STMTS_INVENTORY][0] = "duetime, UUID, serialnum ORDER BY duetime, UUID, serialnum";
 }
 
 void build_stmt(enum statement_pieces STMT) {
+    archive_scan = STMT == STMTS_HISTORY && r.fieldmap[KEY_ARCHIVE];
+    if (STMT == STMTS_HISTORY && !archive_scan)
+        history_from();
+    if (STMT == STMTS_INVENTORY && r.fieldmap[KEY_OVERDUE])
+        overdue_from();
     if (STMT == STMTS_BOOK) {
         if (r.fieldmap[KEY_SWITCH_CLASS]) {
             kasprintf(&pstmts[STMT_DATA].stmt,
@@ -842,8 +946,15 @@ void build_stmt(enum statement_pieces STMT) {
                     kasprintf(&pstmts[STMT_DATA].stmt, "%s"",", pstmts[STMT_DATA].stmt);
                 }
                 kasprintf(&pstmts[STMT_DATA].stmt, "%s%s", pstmts[STMT_DATA].stmt, pstmts_bottom[STMT][i]);
+                // Trending always goes from the most viewed down
                 kasprintf(&pstmts[STMT_DATA].stmt, "%s%s", pstmts[STMT_DATA].stmt,
-                          (r.fieldmap[bottom_keys[STMT][i]]->parsed.i == 0) ? " DESC" : " ASC");
+                          (bottom_keys[STMT][i] == KEY_ORDER_TRENDING || r.fieldmap[bottom_keys[STMT][i]]->parsed.i == 0)
+                              ? " DESC"
+                              : " ASC");
+                if (strstr(pstmts_bottom[STMT][i], "(?)")) {
+                    parmsz++;
+                    orderparmsz++;
+                }
             }
         }
     }
@@ -894,8 +1005,10 @@ int fill_parms(enum statement_pieces STMT) {
     }
 
 
+    // Only the ORDER BY expressions taking a parameter are bound
     for (int i = 0; bottom_keys[STMT][i] != KEY__MAX; i++) {
-        if ((field = r.fieldmap[bottom_keys[STMT][i]])) {
+        if ((field = r.fieldmap[bottom_keys[STMT][i]]) && bottom_keys[STMT][i] != KEY_MANDATORY_GROUP_BY
+            && strstr(pstmts_bottom[STMT][i], "(?)")) {
             switch (field->type) {
                 case KPAIR_INTEGER:
                     parms[n++] = (struct sqlbox_parm){.type = SQLBOX_PARM_INT, .iparm = field->parsed.i};
@@ -968,10 +1081,71 @@ void get_cat_children(const char *class) {
         errx(EXIT_FAILURE, "sqlbox_finalise");
 }
 
+/*
+ * Streams the archives overlapping ?lowerdate and ?upperdate with the filters of the history page,
+ * putting the rows of the requested page. Returns the number of matching rows.
+ */
+int64_t put_archives(int64_t first, int64_t limit) {
+    struct history_partition archives[HISTORY_ARCHIVE_MAX];
+    static struct archive_reader rd;
+    struct archive_row row;
+    struct archive_filter filter = {
+        .UUID = r.fieldmap[KEY_SWITCH_UUID] ? r.fieldmap[KEY_SWITCH_UUID]->parsed.s : NULL,
+        .UUID_ISSUER = r.fieldmap[KEY_SWITCH_ISSUER] ? r.fieldmap[KEY_SWITCH_ISSUER]->parsed.s : NULL,
+        .serialnum = r.fieldmap[KEY_SWITCH_SERIALNUM] ? r.fieldmap[KEY_SWITCH_SERIALNUM]->parsed.s : NULL,
+        .action = r.fieldmap[KEY_SWITCH_ACTION] ? r.fieldmap[KEY_SWITCH_ACTION]->parsed.s : NULL,
+        .lower = r.fieldmap[KEY_SWITCH_LOWERDATE] ? r.fieldmap[KEY_SWITCH_LOWERDATE]->parsed.i : INT64_MIN,
+        .upper = r.fieldmap[KEY_SWITCH_UPPERDATE] ? r.fieldmap[KEY_SWITCH_UPPERDATE]->parsed.i : INT64_MAX
+    };
+    char date[20];
+    int64_t matched = 0;
+    size_t archivesz;
+    int from, to;
+    FILE *f;
+
+    if (!curr_usr.perms.admin && !curr_usr.perms.staff && !curr_usr.perms.monitor_history)
+        filter.UUID = curr_usr.UUID;
+    history_months(&from, &to);
+    archivesz = history_archives(from, to, archives, HISTORY_ARCHIVE_MAX);
+    for (size_t i = 0; i < archivesz; ++i) {
+        if ((f = fopen(archives[i].path, "r")) == NULL)
+            err(EXIT_FAILURE, "%s", archives[i].path);
+        if (!archive_reader_init(&rd, f)) {
+            warnx("%s: not an archive", archives[i].path);
+            fclose(f);
+            continue;
+        }
+        while (archive_next(&rd, &filter, &row)) {
+            if (matched++ < first || matched > first + limit)
+                continue;
+            const time_t actiontime = (time_t) row.actiontime;
+            const char *values[] = {
+                row.UUID, row.UUID_ISSUER, row.serialnum, row.IP, row.action, date, row.details
+            };
+            strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", localtime(&actiontime));
+            kjson_obj_open(&req);
+            for (size_t j = 0; j < sizeof(values) / sizeof(values[0]); ++j) {
+                if (values[j] != NULL)
+                    kjson_putstringp(&req, rows[STMTS_HISTORY][j], values[j]);
+                else
+                    kjson_putnullp(&req, rows[STMTS_HISTORY][j]);
+            }
+            kjson_obj_close(&req);
+        }
+        archive_reader_free(&rd);
+        fclose(f);
+    }
+    return matched;
+}
+
 void process(const enum statement_pieces STATEMENT) {
     size_t stmtid_data;
     const struct sqlbox_parmset *res;
-    if (!(stmtid_data = sqlbox_prepare_bind(boxctx_data, dbid_data, STMT_DATA, parmsz, parms, SQLBOX_STMT_MULTI)))
+    int64_t matched = 0;
+    const int64_t limit = r.fieldmap[KEY_LIMIT] ? r.fieldmap[KEY_LIMIT]->parsed.i : 25;
+    const int64_t first = (r.fieldmap[KEY_OFFSET] ? r.fieldmap[KEY_OFFSET]->parsed.i : 0) * limit;
+    if (!archive_scan && !(stmtid_data = sqlbox_prepare_bind(boxctx_data, dbid_data, STMT_DATA, parmsz, parms,
+                                                             SQLBOX_STMT_MULTI)))
         errx(EXIT_FAILURE, "sqlbox_prepare_bind");
     khttp_head(&r, kresps[KRESP_STATUS], "%s", khttps[KHTTP_200]);
     khttp_head(&r, kresps[KRESP_CONTENT_TYPE], "%s", kmimetypes[KMIME_APP_JSON]);
@@ -1001,7 +1175,10 @@ void process(const enum statement_pieces STATEMENT) {
     }
     kjson_obj_close(&req);
     kjson_arrayp_open(&req, "res");
-    while ((res = sqlbox_step(boxctx_data, stmtid_data)) != NULL && res->code == SQLBOX_CODE_OK && res->psz != 0) {
+    if (archive_scan)
+        matched = put_archives(first, limit);
+    while (!archive_scan && (res = sqlbox_step(boxctx_data, stmtid_data)) != NULL && res->code == SQLBOX_CODE_OK &&
+           res->psz != 0) {
         kjson_obj_open(&req);
         for (int i = 0; i < (int) res->psz; ++i) {
             switch (res->ps[i].type) {
@@ -1111,62 +1288,64 @@ void process(const enum statement_pieces STATEMENT) {
         if (!(STATEMENT == STMTS_CATEGORY && r.fieldmap[KEY_CASCADE]))
             kjson_obj_close(&req);
     }
-    if (!sqlbox_finalise(boxctx_data, stmtid_data))
+    if (!archive_scan && !sqlbox_finalise(boxctx_data, stmtid_data))
         errx(EXIT_FAILURE, "sqlbox_finalise");
     kjson_array_close(&req);
-    if (!(stmtid_data = sqlbox_prepare_bind(boxctx_data, dbid_data, STMT_COUNT, parmsz - 3, parms, SQLBOX_STMT_MULTI)))
-        errx(EXIT_FAILURE, "sqlbox_prepare_bind");
-    if ((res = sqlbox_step(boxctx_data, stmtid_data)) == NULL)
-        errx(EXIT_FAILURE, "sqlbox_step");
-    kjson_putintp(&req, "nbrres", res->ps[0].iparm);
-    if (!sqlbox_finalise(boxctx_data, stmtid_data))
-        errx(EXIT_FAILURE, "sqlbox_finalise");
+    if (archive_scan)
+        kjson_putintp(&req, "nbrres", matched);
+    else {
+        if (!(stmtid_data = sqlbox_prepare_bind(boxctx_data, dbid_data, STMT_COUNT, parmsz - 3 - orderparmsz, parms,
+                                                SQLBOX_STMT_MULTI)))
+            errx(EXIT_FAILURE, "sqlbox_prepare_bind");
+        if ((res = sqlbox_step(boxctx_data, stmtid_data)) == NULL)
+            errx(EXIT_FAILURE, "sqlbox_step");
+        kjson_putintp(&req, "nbrres", res->ps[0].iparm);
+        if (!sqlbox_finalise(boxctx_data, stmtid_data))
+            errx(EXIT_FAILURE, "sqlbox_finalise");
+    }
     kjson_obj_close(&req);
     kjson_close(&req);
 }
 
-void save(const bool failed) {
-    char *requestDesc = NULL;
-    if (!failed) {
-        kasprintf(&requestDesc, "Stmt:%s,parmsz: %ld, Parms:(", pages[r.page], parmsz);
-        for (int i = 0; i < (int) parmsz; ++i) {
-            switch (parms[i].type) {
-                case SQLBOX_PARM_INT:
-                    kasprintf(&requestDesc, "%s\"%"PRId64"\",", requestDesc, parms[i].iparm);
-                    break;
-                case SQLBOX_PARM_STRING:
-                    if (strlen(parms[i].sparm) > 0)
-                        kasprintf(&requestDesc, "%s\"%s\",", requestDesc, parms[i].sparm);
-                    break;
-                case SQLBOX_PARM_FLOAT:
-                    kasprintf(&requestDesc, "%s\"%f\",", requestDesc, parms[i].fparm);
-                    break;
-                default:
-                    break;
-            }
-        }
-        kasprintf(&requestDesc, "%s)", requestDesc);
+/*
+ * Logs the request as a JSON object: the page, a bitmask of the switch_keys[STMT] present, the
+ * serialnum filtered on (indexed as HISTORY.queryserialnum) and the bound parameters
+ */
+void save(const enum statement_pieces STMT, const bool failed) {
+    char *details = NULL;
+    size_t detailsz;
+    int mask = 0;
+    FILE *out;
+
+    if ((out = open_memstream(&details, &detailsz)) == NULL)
+        err(EXIT_FAILURE, "open_memstream");
+    fputs("{\"page\":", out);
+    audit_json_string(out, pages[r.page]);
+    for (int i = 0; switch_keys[STMT][i] != KEY__MAX; ++i)
+        if (r.fieldmap[switch_keys[STMT][i]])
+            mask |= 1 << i;
+    fprintf(out, ",\"mask\":%d", mask);
+    if (r.fieldmap[KEY_SWITCH_SERIALNUM]) {
+        fputs(",\"serialnum\":", out);
+        audit_json_string(out, r.fieldmap[KEY_SWITCH_SERIALNUM]->parsed.s);
+    }
+    if (failed) {
+        fputs(",\"denied\":true", out);
     } else {
-        kasprintf(&requestDesc, "Stmt:%s, ACCESS DENIED", pages[r.page]);
+        fputs(",\"parms\":", out);
+        audit_json_parms(out, parms, parmsz);
     }
-    size_t parmsz_save = 3;
-    struct sqlbox_parm parms_save[] = {
-        {
-            .type = (curr_usr.UUID != NULL) ? SQLBOX_PARM_STRING : SQLBOX_PARM_NULL,
-            .sparm = curr_usr.UUID
-        },
-        {
-            .type = SQLBOX_PARM_STRING,
-            .sparm = r.remote
-        },
-        {
-            .type = SQLBOX_PARM_STRING,
-            .sparm = requestDesc
-        },
+    fputc('}', out);
+    if (fclose(out) == EOF)
+        err(EXIT_FAILURE, "fclose");
+    const struct audit_event ev = {
+        .UUID = curr_usr.UUID,
+        .IP = r.remote,
+        .action = "EDIT",
+        .details = details
     };
-    if (sqlbox_exec(boxctx_data, dbid_data, STMT_SAVE, parmsz_save, parms_save,SQLBOX_STMT_CONSTRAINT) !=
-        SQLBOX_CODE_OK)
-        errx(EXIT_FAILURE, "sqlbox_exec");
+    audit_append(&ev);
+    free(details);
 }
 
 int main(void) {
@@ -1190,8 +1369,9 @@ int main(void) {
     sqlbox_free(boxctx_login);
     build_stmt(STMT);
     alloc_ctx_cfg();
+    attach_partitions();
     if (!fill_parms(STMT)) goto access_denied;
-    save(false);
+    save(STMT, false);
     process(STMT);
     goto cleanup;
 access_denied:
@@ -1205,7 +1385,7 @@ access_denied:
     kjson_putstringp(&req, "error", "You don't have the permissions to access this ressource");
     kjson_obj_close(&req);
     kjson_close(&req);
-    save(true);
+    save(STMT, true);
 cleanup:
     khttp_free(&r);
     sqlbox_free(boxctx_data);
@@ -0,0 +1,73 @@
+#include <sys/types.h> /* size_t */
+#include <sys/mman.h> /* mmap() */
+#include <sys/stat.h> /* fstat() */
+#include <err.h> /* err() */
+#include <fcntl.h> /* open() */
+#include <stdatomic.h> /* atomic_compare_exchange_weak_explicit() */
+#include <stdint.h> /* uint64_t */
+#include <stdlib.h> /* EXIT_FAILURE */
+#include <time.h> /* clock_gettime() */
+#include <unistd.h> /* ftruncate() */
+#include "ratelimit.h"
+#include "keyhash.h"
+
+#define TOKEN 256 /* one token, in 1/256th */
+#define IDLE_MAX 3600000 /* milliseconds, refills are computed over at most an hour */
+
+static _Atomic uint64_t *buckets = NULL;
+
+/*
+ * Maps the buckets, a zeroed bucket refills to its burst on first use so a new (or grown) file
+ * needs no initialisation and concurrent creations are harmless
+ */
+static void buckets_open() {
+    struct stat st;
+    int fd;
+
+    if (buckets != NULL)
+        return;
+    if ((fd = open(RATELIMIT_FILE, O_RDWR | O_CREAT, 0600)) == -1)
+        err(EXIT_FAILURE, "open");
+    if (fstat(fd, &st) == -1)
+        err(EXIT_FAILURE, "fstat");
+    if ((size_t) st.st_size < RATELIMIT_BUCKETS * sizeof(uint64_t) &&
+        ftruncate(fd, RATELIMIT_BUCKETS * sizeof(uint64_t)) == -1)
+        err(EXIT_FAILURE, "ftruncate");
+    if ((buckets = mmap(NULL, RATELIMIT_BUCKETS * sizeof(uint64_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) ==
+        MAP_FAILED)
+        err(EXIT_FAILURE, "mmap");
+    close(fd);
+}
+
+static uint64_t now_ms() {
+    struct timespec ts;
+    if (clock_gettime(CLOCK_REALTIME, &ts) == -1)
+        err(EXIT_FAILURE, "clock_gettime");
+    return (uint64_t) ts.tv_sec * 1000 + (uint64_t) ts.tv_nsec / 1000000;
+}
+
+int ratelimit_take(const char *key, int burst, int per_minute) {
+    _Atomic uint64_t *bucket;
+    const uint64_t now = now_ms();
+    const uint64_t full = (uint64_t) ((burst > RATELIMIT_BURST_MAX) ? RATELIMIT_BURST_MAX : burst) * TOKEN;
+    uint64_t old, new, stamp, tokens, idle;
+
+    buckets_open();
+    bucket = &buckets[keyhash(key) % RATELIMIT_BUCKETS];
+    old = atomic_load_explicit(bucket, memory_order_relaxed);
+    do {
+        stamp = old >> 16;
+        tokens = old & 0xffff;
+        if (now > stamp) {
+            idle = (now - stamp > IDLE_MAX) ? IDLE_MAX : now - stamp;
+            tokens += idle * (uint64_t) per_minute * TOKEN / 60000;
+            stamp = now;
+        }
+        if (tokens > full)
+            tokens = full;
+        if (tokens < TOKEN)
+            return (int) ((TOKEN - tokens) * 60 / ((uint64_t) per_minute * TOKEN)) + 1;
+        new = (stamp << 16) | (tokens - TOKEN);
+    } while (!atomic_compare_exchange_weak_explicit(bucket, &old, new, memory_order_relaxed, memory_order_relaxed));
+    return 0;
+}
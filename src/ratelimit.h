@@ -0,0 +1,23 @@
+#ifndef RATELIMIT_H
+#define RATELIMIT_H
+
+/*
+ * Token buckets shared by every process: a file mapped MAP_SHARED holding one 64 bit word per
+ * bucket (refill time in milliseconds and tokens in 1/256th), updated with compare-and-swap only.
+ * Keys are hashed onto the buckets with keyhash(), a collision makes two keys share a bucket but the
+ * secret keeps clients from choosing keys that land on the bucket of someone else.
+ */
+#define RATELIMIT_FILE "db/ratelimit"
+#define RATELIMIT_BUCKETS 65536
+/*
+ * Largest burst a bucket can hold
+ */
+#define RATELIMIT_BURST_MAX 255
+
+/*
+ * Takes a token from the bucket of key, which holds up to burst tokens and gains per_minute of
+ * them every minute. Returns 0 when granted, otherwise the seconds until a token is available.
+ */
+int ratelimit_take(const char *key, int burst, int per_minute);
+
+#endif
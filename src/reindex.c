@@ -0,0 +1,139 @@
+#include <sys/types.h> /* size_t */
+#include <stdarg.h> /* va_list */
+#include <stddef.h> /* NULL */
+#include <stdint.h> /* int64_t */
+#include <err.h> /* err(), warnx() */
+#include <stdlib.h> /* EXIT_FAILURE */
+#include <string.h> /* memset() */
+#include <sqlbox.h>
+#include <stdio.h>
+#include "searchkey.h"
+
+/*
+ * Command line tool rebuilding BOOK.searchkey and the fuzzy search words of every book, needed
+ * after the schema is (re)created or when the normalization rules change. Trigrams of words no
+ * book uses anymore are dropped at the end. The campus in-stock bitmaps are rebuilt from STOCK
+ * first, after giving a bookid to the books that lack one, along with the POPULARITY totals.
+ * Usage: reindex [database]
+ */
+
+#define BATCH 1000
+
+enum statement {
+    STMTS_SERIALS,
+    STMTS_SEARCHKEY,
+    STMTS_SEARCHKEY_LAST = STMTS_SEARCHKEY + SEARCHKEY__MAX - 1,
+    STMTS_GRAMS_PURGE,
+    STMTS_BOOKID_FILL,
+    STMTS_STOCKMAP_CLEAR,
+    STMTS_STOCKMAP_FILL,
+    STMTS_POPULARITY_CLEAR,
+    STMTS_POPULARITY_FILL,
+    STMTS__MAX
+};
+
+static struct sqlbox_pstmt pstmts[STMTS__MAX] = {
+    {(char *) "SELECT serialnum FROM BOOK ORDER BY serialnum"},
+    SEARCHKEY_PSTMTS,
+    {(char *) "DELETE FROM WORDGRAM WHERE word NOT IN (SELECT word FROM SEARCHWORD)"},
+    {(char *) "UPDATE BOOK SET bookid = rowid + (SELECT IFNULL(MAX(bookid), 0) FROM BOOK) WHERE bookid IS NULL"},
+    {(char *) "DELETE FROM STOCKMAP"},
+    {
+        (char *)
+        "INSERT INTO STOCKMAP (campus, word, bits) "
+        "SELECT campus, bookid >> 6, SUM(1 << (bookid & 63)) "
+        "FROM STOCK,"
+        "BOOK "
+        "WHERE STOCK.serialnum = BOOK.serialnum "
+        "AND instock > 0 "
+        "GROUP BY campus, bookid >> 6"
+    },
+    {(char *) "DELETE FROM POPULARITY"},
+    {
+        (char *)
+        "INSERT INTO POPULARITY "
+        "SELECT 'publisher', publisher, SUM(hits) FROM BOOK GROUP BY publisher "
+        "UNION ALL "
+        "SELECT 'doctype', type, SUM(hits) FROM BOOK GROUP BY type "
+        "UNION ALL "
+        "SELECT 'category', category, SUM(hits) FROM BOOK GROUP BY category "
+        "UNION ALL "
+        "SELECT 'author', author, SUM(hits) FROM AUTHORED, BOOK WHERE AUTHORED.serialnum = BOOK.serialnum GROUP BY author "
+        "UNION ALL "
+        "SELECT 'lang', lang, SUM(hits) FROM LANGUAGES, BOOK WHERE LANGUAGES.serialnum = BOOK.serialnum GROUP BY lang"
+    }
+};
+
+struct sqlbox_src srcs[] = {
+    {
+        .fname = (char *) "db/database.db",
+        .mode = SQLBOX_SRC_RW
+    }
+};
+struct sqlbox *boxctx;
+struct sqlbox_cfg cfg;
+size_t dbid;
+
+void alloc_ctx_cfg() {
+    memset(&cfg, 0, sizeof(struct sqlbox_cfg));
+    cfg.msg.func_short = warnx;
+    cfg.srcs.srcsz = 1;
+    cfg.srcs.srcs = srcs;
+    cfg.stmts.stmtsz = STMTS__MAX;
+    cfg.stmts.stmts = pstmts;
+    if ((boxctx = sqlbox_alloc(&cfg)) == NULL)
+        errx(EXIT_FAILURE, "sqlbox_alloc");
+    if (!(dbid = sqlbox_open(boxctx, 0)))
+        errx(EXIT_FAILURE, "sqlbox_open");
+}
+
+int main(int argc, char *argv[]) {
+    size_t stmtid, serialsz = 0;
+    char **serials = NULL;
+    const struct sqlbox_parmset *res;
+
+    if (argc > 1)
+        srcs[0].fname = argv[1];
+    alloc_ctx_cfg();
+
+    if (!sqlbox_trans_immediate(boxctx, dbid, 1))
+        errx(EXIT_FAILURE, "sqlbox_trans_immediate");
+    if (sqlbox_exec(boxctx, dbid, STMTS_BOOKID_FILL, 0, 0, 0) != SQLBOX_CODE_OK)
+        errx(EXIT_FAILURE, "sqlbox_exec");
+    if (sqlbox_exec(boxctx, dbid, STMTS_STOCKMAP_CLEAR, 0, 0, 0) != SQLBOX_CODE_OK)
+        errx(EXIT_FAILURE, "sqlbox_exec");
+    if (sqlbox_exec(boxctx, dbid, STMTS_STOCKMAP_FILL, 0, 0, 0) != SQLBOX_CODE_OK)
+        errx(EXIT_FAILURE, "sqlbox_exec");
+    if (sqlbox_exec(boxctx, dbid, STMTS_POPULARITY_CLEAR, 0, 0, 0) != SQLBOX_CODE_OK)
+        errx(EXIT_FAILURE, "sqlbox_exec");
+    if (sqlbox_exec(boxctx, dbid, STMTS_POPULARITY_FILL, 0, 0, 0) != SQLBOX_CODE_OK)
+        errx(EXIT_FAILURE, "sqlbox_exec");
+    if (!sqlbox_trans_commit(boxctx, dbid, 1))
+        errx(EXIT_FAILURE, "sqlbox_trans_commit");
+
+    if (!(stmtid = sqlbox_prepare_bind(boxctx, dbid, STMTS_SERIALS, 0, 0, SQLBOX_STMT_MULTI)))
+        errx(EXIT_FAILURE, "sqlbox_prepare_bind");
+    while ((res = sqlbox_step(boxctx, stmtid)) != NULL && res->code == SQLBOX_CODE_OK && res->psz != 0) {
+        if ((serials = reallocarray(serials, serialsz + 1, sizeof(char *))) == NULL)
+            err(EXIT_FAILURE, "reallocarray");
+        if ((serials[serialsz++] = strdup(res->ps[0].sparm)) == NULL)
+            err(EXIT_FAILURE, "strdup");
+    }
+    if (!sqlbox_finalise(boxctx, stmtid))
+        errx(EXIT_FAILURE, "sqlbox_finalise");
+
+    for (size_t i = 0; i < serialsz; ++i) {
+        if (i % BATCH == 0 && !sqlbox_trans_immediate(boxctx, dbid, 1))
+            errx(EXIT_FAILURE, "sqlbox_trans_immediate");
+        searchkey_refresh(boxctx, dbid, STMTS_SEARCHKEY, serials[i]);
+        free(serials[i]);
+        if ((i % BATCH == BATCH - 1 || i == serialsz - 1) && !sqlbox_trans_commit(boxctx, dbid, 1))
+            errx(EXIT_FAILURE, "sqlbox_trans_commit");
+    }
+    free(serials);
+    if (sqlbox_exec(boxctx, dbid, STMTS_GRAMS_PURGE, 0, 0, 0) != SQLBOX_CODE_OK)
+        errx(EXIT_FAILURE, "sqlbox_exec");
+    printf("%zu books reindexed\n", serialsz);
+    sqlbox_free(boxctx);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,257 @@
+#include <sys/types.h> /* size_t */
+#include <sys/stat.h> /* mkdir() */
+#include <stdarg.h> /* va_list */
+#include <stddef.h> /* NULL */
+#include <stdint.h> /* int64_t */
+#include <err.h> /* err(), warnx() */
+#include <errno.h> /* EEXIST */
+#include <stdlib.h> /* EXIT_FAILURE */
+#include <string.h> /* memset() */
+#include <time.h> /* nanosleep(), mktime() */
+#include <unistd.h> /* unlink() */
+#include <sqlbox.h>
+#include <stdio.h>
+#include "history.h"
+
+/*
+ * Command line tool moving the HISTORY rows of closed months into their monthly partition (see
+ * history.h), meant to be run from cron(8) at the start of every month from the directory holding
+ * db/. Rows go BATCH per transaction, each one copying and deleting them at once across both
+ * databases, followed by a PAUSE. Partitions older than the retention (in months, HISTORY_RETENTION
+ * by default and at most HISTORY_ATTACH_MAX) are then moved to HISTORY_ARCHIVE, for compact to turn
+ * them into archives, or deleted when it does not exist.
+ * Usage: rollover [database [months]]
+ */
+
+#define BATCH 5000
+#define PAUSE 50000000L /* nanoseconds */
+
+enum statement {
+    STMTS_MONTHS,
+    STMTS_ATTACH,
+    STMTS_CREATE,
+    STMTS_CREATE_ACTION,
+    STMTS_COPY_ACTION,
+    STMTS_INDEX_DATE,
+    STMTS_INDEX_UUID,
+    STMTS_INDEX_SERIALNUM,
+    STMTS_INDEX_QUERYSERIALNUM,
+    STMTS_COPY,
+    STMTS_DELETE,
+    STMTS_CHANGES,
+    STMTS_DETACH,
+    STMTS__MAX
+};
+
+static struct sqlbox_pstmt pstmts[STMTS__MAX] = {
+    {
+        (char *)
+        "SELECT DISTINCT CAST(strftime('%Y', actiontime, 'unixepoch', 'localtime') AS INTEGER) * 12 + "
+        "CAST(strftime('%m', actiontime, 'unixepoch', 'localtime') AS INTEGER) - 1 "
+        "FROM HISTORY "
+        "WHERE actiontime < (?)"
+    },
+    {(char *) "ATTACH DATABASE (?) AS part"},
+    {
+        (char *)
+        "CREATE TABLE IF NOT EXISTS part.HISTORY "
+        "("
+        "UUID TEXT DEFAULT NULL,"
+        "UUID_ISSUER TEXT DEFAULT NULL,"
+        "serialnum TEXT DEFAULT NULL,"
+        "IP TEXT DEFAULT NULL,"
+        "action INTEGER NOT NULL,"
+        "actiontime INTEGER NOT NULL,"
+        "details TEXT DEFAULT NULL,"
+        "querypage TEXT GENERATED ALWAYS AS (CASE WHEN json_valid(details) THEN json_extract(details, '$.page') END) "
+        "VIRTUAL,"
+        "queryserialnum TEXT GENERATED ALWAYS AS (CASE WHEN json_valid(details) THEN "
+        "json_extract(details, '$.serialnum') END) VIRTUAL"
+        ")"
+    },
+    // Partitions carry the action codes they were written with, compact reads them on their own
+    {
+        (char *)
+        "CREATE TABLE IF NOT EXISTS part.ACTION "
+        "("
+        "actionCode INTEGER PRIMARY KEY NOT NULL,"
+        "actionName TEXT UNIQUE NOT NULL"
+        ")"
+    },
+    {(char *) "INSERT OR REPLACE INTO part.ACTION (actionCode, actionName) SELECT actionCode, actionName FROM main.ACTION"},
+    {(char *) "CREATE INDEX IF NOT EXISTS part.HISTORY_ACTIONTIME ON HISTORY (actiontime)"},
+    {(char *) "CREATE INDEX IF NOT EXISTS part.HISTORY_UUID ON HISTORY (UUID)"},
+    {(char *) "CREATE INDEX IF NOT EXISTS part.HISTORY_SERIALNUM ON HISTORY (serialnum)"},
+    {(char *) "CREATE INDEX IF NOT EXISTS part.HISTORY_QUERYSERIALNUM ON HISTORY (queryserialnum)"},
+    {
+        (char *)
+        "INSERT INTO part.HISTORY (UUID, UUID_ISSUER, serialnum, IP, action, actiontime, details) "
+        "SELECT UUID, UUID_ISSUER, serialnum, IP, action, actiontime, details "
+        "FROM main.HISTORY "
+        "WHERE rowid IN (SELECT rowid FROM main.HISTORY WHERE actiontime >= (?) AND actiontime < (?) "
+        "ORDER BY rowid LIMIT (?))"
+    },
+    {
+        (char *)
+        "DELETE FROM main.HISTORY "
+        "WHERE rowid IN (SELECT rowid FROM main.HISTORY WHERE actiontime >= (?) AND actiontime < (?) "
+        "ORDER BY rowid LIMIT (?))"
+    },
+    {(char *) "SELECT changes()"},
+    {(char *) "DETACH DATABASE part"}
+};
+
+struct sqlbox_src srcs[] = {
+    {
+        .fname = (char *) "db/database.db",
+        .mode = SQLBOX_SRC_RW
+    }
+};
+struct sqlbox *boxctx;
+struct sqlbox_cfg cfg;
+size_t dbid;
+
+void alloc_ctx_cfg() {
+    memset(&cfg, 0, sizeof(struct sqlbox_cfg));
+    cfg.msg.func_short = warnx;
+    cfg.srcs.srcsz = 1;
+    cfg.srcs.srcs = srcs;
+    cfg.stmts.stmtsz = STMTS__MAX;
+    cfg.stmts.stmts = pstmts;
+    if ((boxctx = sqlbox_alloc(&cfg)) == NULL)
+        errx(EXIT_FAILURE, "sqlbox_alloc");
+    if (!(dbid = sqlbox_open(boxctx, 0)))
+        errx(EXIT_FAILURE, "sqlbox_open");
+}
+
+/*
+ * First instant of a local month, as an epoch like HISTORY.actiontime
+ */
+static int64_t month_start(int month) {
+    struct tm tm = {0};
+
+    tm.tm_year = month / 12 - 1900;
+    tm.tm_mon = month % 12;
+    tm.tm_mday = 1;
+    tm.tm_isdst = -1;
+    return (int64_t) mktime(&tm);
+}
+
+void exec(size_t stmt, size_t parmsz, struct sqlbox_parm *parms) {
+    if (sqlbox_exec(boxctx, dbid, stmt, parmsz, parms, 0) != SQLBOX_CODE_OK)
+        errx(EXIT_FAILURE, "sqlbox_exec");
+}
+
+/*
+ * Months before current still having rows in HISTORY, returns how many were written to months
+ */
+size_t closed_months(int current, int *months, size_t max) {
+    size_t stmtid, n = 0;
+    const struct sqlbox_parmset *res;
+    struct sqlbox_parm parms[] = {
+        {.type = SQLBOX_PARM_INT, .iparm = month_start(current)},
+    };
+
+    if (!(stmtid = sqlbox_prepare_bind(boxctx, dbid, STMTS_MONTHS, 1, parms, 0)))
+        errx(EXIT_FAILURE, "sqlbox_prepare_bind");
+    while ((res = sqlbox_step(boxctx, stmtid)) != NULL && res->psz != 0 && n < max)
+        months[n++] = (int) res->ps[0].iparm;
+    if (res == NULL)
+        errx(EXIT_FAILURE, "sqlbox_step");
+    if (!sqlbox_finalise(boxctx, stmtid))
+        errx(EXIT_FAILURE, "sqlbox_finalise");
+    return n;
+}
+
+/*
+ * Moves one month into its partition, returns the number of rows moved
+ */
+int64_t move_month(int month) {
+    size_t stmtid;
+    int64_t moved, total = 0;
+    const struct sqlbox_parmset *res;
+    const struct timespec pause = {0, PAUSE};
+    struct history_partition part;
+    struct sqlbox_parm parms[] = {
+        {.type = SQLBOX_PARM_INT, .iparm = month_start(month)},
+        {.type = SQLBOX_PARM_INT, .iparm = month_start(month + 1)},
+        {.type = SQLBOX_PARM_INT, .iparm = BATCH},
+    };
+    struct sqlbox_parm parms_attach[] = {
+        {.type = SQLBOX_PARM_STRING, .sparm = part.path},
+    };
+
+    history_partition(month, &part);
+    exec(STMTS_ATTACH, 1, parms_attach);
+    for (size_t stmt = STMTS_CREATE; stmt <= STMTS_INDEX_QUERYSERIALNUM; ++stmt)
+        exec(stmt, 0, NULL);
+    do {
+        if (!sqlbox_trans_immediate(boxctx, dbid, 1))
+            errx(EXIT_FAILURE, "sqlbox_trans_immediate");
+        exec(STMTS_COPY, 3, parms);
+        exec(STMTS_DELETE, 3, parms);
+        if (!(stmtid = sqlbox_prepare_bind(boxctx, dbid, STMTS_CHANGES, 0, 0, 0)))
+            errx(EXIT_FAILURE, "sqlbox_prepare_bind");
+        if ((res = sqlbox_step(boxctx, stmtid)) == NULL)
+            errx(EXIT_FAILURE, "sqlbox_step");
+        moved = res->ps[0].iparm;
+        if (!sqlbox_finalise(boxctx, stmtid))
+            errx(EXIT_FAILURE, "sqlbox_finalise");
+        if (!sqlbox_trans_commit(boxctx, dbid, 1))
+            errx(EXIT_FAILURE, "sqlbox_trans_commit");
+        total += moved;
+        if (moved == BATCH)
+            nanosleep(&pause, NULL);
+    } while (moved == BATCH);
+    exec(STMTS_DETACH, 0, NULL);
+    return total;
+}
+
+/*
+ * Archives or deletes the partitions of the months before oldest
+ */
+void expire(int oldest) {
+    struct history_partition parts[HISTORY_ATTACH_MAX];
+    char archived[128];
+    size_t n;
+
+    while ((n = history_partitions(0, oldest - 1, parts, HISTORY_ATTACH_MAX)) > 0) {
+        for (size_t i = 0; i < n; ++i) {
+            snprintf(archived, sizeof(archived), HISTORY_ARCHIVE "%s", strrchr(parts[i].path, '/'));
+            if (rename(parts[i].path, archived) == 0) {
+                printf("%s archived\n", parts[i].path);
+                continue;
+            }
+            if (errno != ENOENT)
+                err(EXIT_FAILURE, "rename");
+            if (unlink(parts[i].path) == -1)
+                err(EXIT_FAILURE, "unlink");
+            printf("%s deleted\n", parts[i].path);
+        }
+    }
+}
+
+int main(int argc, char *argv[]) {
+    int months[BATCH];
+    int retention = HISTORY_RETENTION, current;
+    size_t n;
+    const time_t now = time(NULL);
+
+    if (argc > 1)
+        srcs[0].fname = argv[1];
+    // The history page cannot attach more partitions than that
+    if (argc > 2 && ((retention = atoi(argv[2])) < 1 || retention > HISTORY_ATTACH_MAX))
+        errx(EXIT_FAILURE, "months: must be between 1 and %d", HISTORY_ATTACH_MAX);
+    if (mkdir(HISTORY_DIR, 0700) == -1 && errno != EEXIST)
+        err(EXIT_FAILURE, "mkdir");
+    // Months are cut in local time, as HISTORYTEXT shows actiontime
+    current = history_month(localtime(&now));
+    alloc_ctx_cfg();
+    n = closed_months(current, months, BATCH);
+    for (size_t i = 0; i < n; ++i)
+        printf("%lld rows moved to partition %04d-%02d\n", (long long) move_month(months[i]), months[i] / 12,
+               months[i] % 12 + 1);
+    sqlbox_free(boxctx);
+    expire(current - retention);
+    return EXIT_SUCCESS;
+}
@@ -10,8 +10,15 @@
 #include <kcgi.h>
 #include <kcgijson.h>
 #include <sqlbox.h>
+#include <sha2.h> /* SHA256Data() */
 #include <stdbool.h>
 #include <stdio.h>
+#include "normalize.h"
+#include "fuzzy.h"
+#include "token.h"
+#include "session.h"
+#include "audit.h"
+#include "searchcache.h"
 
 struct kreq r;
 struct kjsonreq req;
@@ -50,6 +57,9 @@ enum key {
     KEY_STRING,
     KEY_PAGE,
     KEY_LIMIT,
+    KEY_FUZZY,
+    KEY_RANK,
+    KEY_AVAILABLE_AT,
     KEY__MAX
 };
 
@@ -57,85 +67,121 @@ static const struct kvalid keys[KEY__MAX] = {
     {kvalid_stringne, "sessionID"},
     {kvalid_stringne, "q"},
     {kvalid_int, "page"},
-    {kvalid_int, "limit"}
+    {kvalid_int, "limit"},
+    {kvalid_int, "fuzzy"},
+    {kvalid_int, "rank"},
+    {kvalid_stringne, "available_at"}
 };
 
 enum statment {
     STMTS_SEARCH,
     STMTS_COUNT,
     STMTS_LOGIN,
-    STMTS_SAVE,
-    STMTS_AUTHORS,
-    STMTS_LANGS,
-    STMTS_STOCKED,
+    STMTS_VERSION,
+    STMTS_FUZZY_WORDS,
+    STMTS_FUZZY_SEARCH,
+    STMTS_FUZZY_COUNT,
+    STMTS_RANK,
+    STMTS_FUZZY_RANK,
+    STMTS_PAGE,
     STMTS__MAX
 };
 
+/*
+ * Flags, a ranked search can be exact or fuzzy
+ */
+enum search_mode {
+    MODE_EXACT = 0,
+    MODE_FUZZY = 1,
+    MODE_RANKED = 2
+};
+
+/*
+ * Most distinct words a fuzzy query may have, each one costs a WORDGRAM lookup and a join, longer
+ * queries are refused with 400. Candidate words verified for each of them.
+ */
+#define FUZZY_QUERY_WORDS 8
+#define FUZZY_CANDIDATES 256
+/*
+ * Deepest result (page * limit + limit) a ranked search sorts for, deeper pages are refused
+ */
+#define RANK_MAX 10000
+#define LIMIT_DEFAULT 25
+
+/*
+ * The statements of a search bind the same parameters: ?1 the GLOB pattern of the query (the JSON
+ * array of fuzzy_expand() in fuzzy mode), ?2 the campus the books must be in stock at or NULL, ?3
+ * and ?4 the offset and size of the page, and ?5 the folded query the ranked modes score with
+ */
+#define SEARCH_EXACT \
+    "FROM SEARCHKEYFTS " \
+    "JOIN BOOK ON bookid = SEARCHKEYFTS.rowid " \
+    "WHERE SEARCHKEYFTS.searchkey GLOB ?1 "
+#define SEARCH_FUZZY \
+    "FROM BOOK " \
+    "WHERE serialnum IN (" \
+    "SELECT serialnum " \
+    "FROM json_each(?1) AS q," \
+    "json_each(q.value) AS w," \
+    "SEARCHWORD " \
+    "WHERE SEARCHWORD.word = w.value " \
+    "GROUP BY serialnum " \
+    "HAVING COUNT(DISTINCT q.key) = json_array_length(?1)) "
+#define SEARCH_AVAILABLE_AT \
+    "AND (?2 IS NULL OR EXISTS (SELECT 1 FROM STOCKMAP WHERE campus = ?2 AND word = bookid >> 6 " \
+    "AND bits & (1 << (bookid & 63)))) "
+/*
+ * Blends where the query matched (start of the title, inside the title, elsewhere, nowhere for a
+ * fuzzy match), the decimal magnitude of the hit counter and whether any campus has the book in stock
+ */
+#define SEARCH_SCORE \
+    "CASE instr(BOOK.searchkey, ?5) WHEN 0 THEN 0 WHEN 1 THEN 12 " \
+    "ELSE CASE WHEN instr(BOOK.searchkey, ?5) < instr(BOOK.searchkey, char(10)) THEN 8 ELSE 4 END END " \
+    "+ CASE WHEN hits > 0 THEN length(hits) * 1.5 ELSE 0 END " \
+    "+ CASE WHEN EXISTS (SELECT 1 FROM STOCK WHERE STOCK.serialnum = BOOK.serialnum AND instock > 0) " \
+    "THEN 2 ELSE 0 END "
+
 static struct sqlbox_pstmt pstmts[STMTS__MAX] = {
+    {(char *) "SELECT serialnum " SEARCH_EXACT SEARCH_AVAILABLE_AT "ORDER BY serialnum LIMIT ?4 OFFSET ?3"},
+    {(char *) "SELECT COUNT(*) " SEARCH_EXACT SEARCH_AVAILABLE_AT},
+    SESSION_LOGIN_PSTMT,
+
+    {(char *) "SELECT version FROM CATALOGVERSION"},
     {
         (char *)
-        "SELECT BOOK.serialnum, type, category, categoryName, publisher, booktitle, bookreleaseyear, bookcover, description, hits "
-        "FROM BOOK,"
-        "CATEGORY,"
-        "LANGUAGES,"
-        "AUTHORED "
-        "WHERE CATEGORY.categoryClass = BOOK.category "
-        "AND AUTHORED.serialnum = BOOK.serialnum "
-        "AND LANGUAGES.serialnum = BOOK.serialnum "
-        "AND instr(lower(concat(BOOK.serialnum,booktitle,lang,author,type,publisher,bookreleaseyear,description,categoryName)), lower(?)) > 0 "
-        "GROUP BY BOOK.serialnum, type, category, categoryName, publisher, booktitle, bookreleaseyear, bookcover, hits "
-        "ORDER BY BOOK.serialnum "
-        "LIMIT(? * ?),(?)"
-    },
-    {
-        (char *)
-        "SELECT COUNT(DISTINCT CONCAT(BOOK.serialnum, type, category, categoryName, publisher, booktitle, bookreleaseyear, bookcover, description, hits)) "
-        "FROM BOOK,"
-        "CATEGORY,"
-        "LANGUAGES,"
-        "AUTHORED "
-        "WHERE CATEGORY.categoryClass = BOOK.category "
-        "AND AUTHORED.serialnum = BOOK.serialnum "
-        "AND LANGUAGES.serialnum = BOOK.serialnum "
-        "AND instr(lower(concat(BOOK.serialnum,booktitle,lang,author,type,publisher,bookreleaseyear,description,categoryName)),lower(?)) > 0 "
-        "GROUP BY BOOK.serialnum, type, category, categoryName, publisher, booktitle, bookreleaseyear, bookcover, hits "
-        "ORDER BY BOOK.serialnum "
-        "LIMIT(? * ?),(?)"
-    },
-    {
-        (char *)
-        "SELECT ACCOUNT.UUID, displayname, pwhash, campus, role, perms, frozen "
-        "FROM ROLE,"
-        "ACCOUNT "
-        "LEFT JOIN SESSIONS S on ACCOUNT.UUID = S.account "
-        "WHERE ACCOUNT.role = ROLE.roleName "
-        "AND sessionID = (?) "
-        "GROUP BY ACCOUNT.UUID, displayname, pwhash, campus, perms, frozen "
+        "SELECT word "
+        "FROM WORDGRAM "
+        "WHERE gram IN (SELECT value FROM json_each(?)) "
+        "GROUP BY word "
+        "HAVING COUNT(*) >= (?) "
+        "ORDER BY COUNT(*) DESC "
+        "LIMIT (?)"
     },
+    {(char *) "SELECT serialnum " SEARCH_FUZZY SEARCH_AVAILABLE_AT "ORDER BY serialnum LIMIT ?4 OFFSET ?3"},
+    {(char *) "SELECT COUNT(*) " SEARCH_FUZZY SEARCH_AVAILABLE_AT},
     {
         (char *)
-        "INSERT INTO HISTORY (UUID, IP, action, actiondate, details) "
-        "VALUES ((?),(?),'EDIT',datetime('now','localtime'),(?))"
+        "SELECT serialnum " SEARCH_EXACT SEARCH_AVAILABLE_AT
+        "ORDER BY " SEARCH_SCORE "DESC, serialnum LIMIT ?4 OFFSET ?3"
     },
-
     {
         (char *)
-        "SELECT author "
-        "FROM AUTHORED "
-        "WHERE serialnum = (?)"
+        "SELECT serialnum " SEARCH_FUZZY SEARCH_AVAILABLE_AT
+        "ORDER BY " SEARCH_SCORE "DESC, serialnum LIMIT ?4 OFFSET ?3"
     },
     {
         (char *)
-        "SELECT lang "
-        "FROM LANGUAGES "
-        "WHERE serialnum = (?)"
-    },
-{
-    (char *)
-    "SELECT campus,instock "
-    "FROM STOCK "
-    "WHERE serialnum = (?)"
-},
+        "SELECT BOOK.serialnum, BOOK.type, category, categoryName, publisher, booktitle, bookreleaseyear, bookcover, "
+        "description, hits, viewers,"
+        "(SELECT group_concat(author, char(31)) FROM AUTHORED WHERE AUTHORED.serialnum = BOOK.serialnum),"
+        "(SELECT group_concat(lang, char(31)) FROM LANGUAGES WHERE LANGUAGES.serialnum = BOOK.serialnum),"
+        "(SELECT group_concat(campus || char(31) || instock, char(30)) FROM STOCK "
+        "WHERE STOCK.serialnum = BOOK.serialnum) "
+        "FROM json_each(?) AS PAGE "
+        "JOIN BOOK ON BOOK.serialnum = PAGE.value "
+        "JOIN CATEGORY ON CATEGORY.categoryClass = BOOK.category "
+        "ORDER BY PAGE.key"
+    }
 };
 
 struct sqlbox_src srcs[] = {
@@ -188,76 +234,375 @@ struct usr curr_usr = {
 
 void fill_user() {
     struct kpair *field;
-
-    if ((field = r.cookiemap[COOKIE_SESSIONID])) {
-        size_t stmtid;
-        size_t parmsz = 1;
-        const struct sqlbox_parmset *res;
-        struct sqlbox_parm parms[] = {
-            {.type = SQLBOX_PARM_STRING, .sparm = field->parsed.s},
-        };
-        if (!(stmtid = sqlbox_prepare_bind(boxctx, dbid, STMTS_LOGIN, parmsz, parms, 0)))
-            errx(EXIT_FAILURE, "sqlbox_prepare_bind");
-        if ((res = sqlbox_step(boxctx, stmtid)) == NULL)
-            errx(EXIT_FAILURE, "sqlbox_step");
-        if (res->psz != 0) {
-            curr_usr.authenticated = true;
-            kasprintf(&curr_usr.UUID, "%s", res->ps[0].sparm);
-
-            kasprintf(&curr_usr.disp_name, "%s", res->ps[1].sparm);
-
-            kasprintf(&curr_usr.campus, "%s", res->ps[3].sparm);
-
-            kasprintf(&curr_usr.role, "%s", res->ps[4].sparm);
-
-            kasprintf(&curr_usr.sessionID, "%s", field->parsed.s);
-
-            curr_usr.perms = int_to_accperms((int) res->ps[5].iparm);
-
-            curr_usr.frozen = res->ps[6].iparm;
-        }
-        sqlbox_finalise(boxctx, stmtid);
-    }
+    struct token tok;
+
+    if ((field = r.cookiemap[COOKIE_SESSIONID]) == NULL ||
+        !session_resolve(field->parsed.s, boxctx, dbid, STMTS_LOGIN, &tok))
+        return;
+    curr_usr.authenticated = true;
+    curr_usr.UUID = tok.UUID;
+    curr_usr.disp_name = tok.disp_name;
+    curr_usr.campus = tok.campus;
+    curr_usr.role = tok.role;
+    kasprintf(&curr_usr.sessionID, "%s", field->parsed.s);
+    curr_usr.perms = int_to_accperms(tok.perms);
+    curr_usr.frozen = tok.frozen;
 }
 
 enum khttp sanitize() {
+    int64_t page, limit;
+    char *query;
+    char **qwords;
+    size_t qwordsz;
+
     if (r.method != KMETHOD_GET)
         return KHTTP_405;
     if (!r.fieldmap[KEY_STRING])
         return KHTTP_400;
+    page = r.fieldmap[KEY_PAGE] ? r.fieldmap[KEY_PAGE]->parsed.i : 0;
+    limit = r.fieldmap[KEY_LIMIT] ? r.fieldmap[KEY_LIMIT]->parsed.i : LIMIT_DEFAULT;
+    // The offset page * limit is computed in int64_t, refuse anything it would overflow
+    if (page < 0 || limit <= 0 || page > (INT64_MAX - limit) / limit)
+        return KHTTP_400;
+    if (r.fieldmap[KEY_RANK] && r.fieldmap[KEY_RANK]->parsed.i && page * limit + limit > RANK_MAX)
+        return KHTTP_400;
+    if (r.fieldmap[KEY_FUZZY] && r.fieldmap[KEY_FUZZY]->parsed.i) {
+        query = normalize_text(r.fieldmap[KEY_STRING]->parsed.s);
+        qwordsz = fuzzy_split(query, 0, &qwords);
+        fuzzy_free(qwords, qwordsz);
+        free(query);
+        if (qwordsz > FUZZY_QUERY_WORDS)
+            return KHTTP_400;
+    }
     return KHTTP_200;
 }
 
 static const char *rows[] = {
     "BOOK.serialnum", "type", "category", "categoryName", "publisher", "booktitle", "bookreleaseyear", "bookcover",
     "description",
-    "hits",NULL
+    "hits", "viewers",NULL
 };
 
-void process() {
+/*
+ * Emits the authors or languages of a book, joined with char(31) by STMTS_PAGE, as the array key
+ */
+void put_list(const char *key, const struct sqlbox_parm *parm) {
+    char *list, *cur, *item;
+
+    kjson_arrayp_open(&req, key);
+    if (parm->type == SQLBOX_PARM_STRING) {
+        list = cur = kstrdup(parm->sparm);
+        while ((item = strsep(&cur, "\x1f")) != NULL)
+            kjson_putstring(&req, item);
+        free(list);
+    }
+    kjson_array_close(&req);
+}
+
+/*
+ * Emits the stock of a book, campus char(31) instock pairs joined with char(30) by STMTS_PAGE
+ */
+void put_stock(const struct sqlbox_parm *parm) {
+    char *list, *cur, *item, *campus;
+
+    kjson_arrayp_open(&req, "stock");
+    if (parm->type == SQLBOX_PARM_STRING) {
+        list = cur = kstrdup(parm->sparm);
+        while ((item = strsep(&cur, "\x1e")) != NULL) {
+            campus = strsep(&item, "\x1f");
+            kjson_obj_open(&req);
+            kjson_putstringp(&req, "campus", campus);
+            kjson_putintp(&req, "stock", item ? strtoll(item, NULL, 10) : 0);
+            kjson_obj_close(&req);
+        }
+        free(list);
+    }
+    kjson_array_close(&req);
+}
+
+/*
+ * Serial numbers of the books on the requested page, in the order they are served
+ */
+struct page {
+    char **serials;
+    size_t serialsz;
+};
+
+void page_add(struct page *pg, const char *serialnum) {
+    pg->serials = kreallocarray(pg->serials, pg->serialsz + 1, sizeof(char *));
+    pg->serials[pg->serialsz++] = kstrdup(serialnum);
+}
+
+void page_free(struct page *pg) {
+    for (size_t i = 0; i < pg->serialsz; ++i)
+        free(pg->serials[i]);
+    free(pg->serials);
+}
+
+/*
+ * JSON array of the serial numbers of the page, as STMTS_PAGE reads them back
+ */
+char *page_json(const struct page *pg) {
+    char *json = NULL;
+    size_t jsonsz;
+    FILE *out;
+
+    if ((out = open_memstream(&json, &jsonsz)) == NULL)
+        err(EXIT_FAILURE, "open_memstream");
+    fputc('[', out);
+    for (size_t i = 0; i < pg->serialsz; ++i) {
+        if (i != 0)
+            fputc(',', out);
+        audit_json_string(out, pg->serials[i]);
+    }
+    fputc(']', out);
+    if (fclose(out) == EOF)
+        err(EXIT_FAILURE, "fclose");
+    return json;
+}
+
+/*
+ * Emits the books of the page as the "res" array, read back from BOOK and STOCK with one statement on
+ * every request, cached or not, so stock counts and hit counters are always current
+ */
+void put_page(const struct page *pg) {
+    size_t stmtid;
+    const struct sqlbox_parmset *res;
+    char *json = page_json(pg);
+    struct sqlbox_parm parms[] = {
+        {.type = SQLBOX_PARM_STRING, .sparm = json},
+    };
+
+    if (!(stmtid = sqlbox_prepare_bind(boxctx, dbid, STMTS_PAGE, 1, parms, SQLBOX_STMT_MULTI)))
+        errx(EXIT_FAILURE, "sqlbox_prepare_bind");
+    kjson_arrayp_open(&req, "res");
+    while ((res = sqlbox_step(boxctx, stmtid)) != NULL && res->code == SQLBOX_CODE_OK && res->psz != 0) {
+        kjson_obj_open(&req);
+        for (int i = 0; rows[i] != NULL; ++i) {
+            switch (res->ps[i].type) {
+                case SQLBOX_PARM_INT:
+                    kjson_putintp(&req, rows[i], res->ps[i].iparm);
+                    break;
+                case SQLBOX_PARM_STRING:
+                    kjson_putstringp(&req, i == 0 ? "serialnum" : rows[i], res->ps[i].sparm);
+                    break;
+                case SQLBOX_PARM_FLOAT:
+                    kjson_putdoublep(&req, rows[i], res->ps[i].fparm);
+                    break;
+                case SQLBOX_PARM_BLOB:
+                    kjson_putstringp(&req, rows[i], res->ps[i].bparm);
+                    break;
+                case SQLBOX_PARM_NULL:
+                    kjson_putnullp(&req, rows[i]);
+                    break;
+                default:
+                    break;
+            }
+        }
+        put_list("authors", &res->ps[11]);
+        put_list("langs", &res->ps[12]);
+        put_stock(&res->ps[13]);
+        kjson_obj_close(&req);
+    }
+    kjson_array_close(&req);
+    if (!sqlbox_finalise(boxctx, stmtid))
+        errx(EXIT_FAILURE, "sqlbox_finalise");
+    free(json);
+}
+
+/*
+ * Runs the search and collects the serial numbers of the page into pg, returns the total number of
+ * matches. Matching, the campus filter, ranking and paging all happen in SQL (a ranked page is the
+ * LIMIT of an ORDER BY on its score), so only the page crosses sqlbox.
+ */
+int64_t run_search(enum statment STMT_DATA, enum statment STMT_COUNT, struct sqlbox_parm *parms, size_t parmsz,
+                   struct page *pg) {
     size_t stmtid_data;
     const struct sqlbox_parmset *res;
+    int64_t nbrres;
+
+    if (!(stmtid_data = sqlbox_prepare_bind(boxctx, dbid, STMT_DATA, parmsz, parms, SQLBOX_STMT_MULTI)))
+        errx(EXIT_FAILURE, "sqlbox_prepare_bind");
+    while ((res = sqlbox_step(boxctx, stmtid_data)) != NULL && res->code == SQLBOX_CODE_OK && res->psz != 0)
+        page_add(pg, res->ps[0].sparm);
+    if (!sqlbox_finalise(boxctx, stmtid_data))
+        errx(EXIT_FAILURE, "sqlbox_finalise");
+
+    if (!(stmtid_data = sqlbox_prepare_bind(boxctx, dbid, STMT_COUNT, 2, parms, SQLBOX_STMT_MULTI)))
+        errx(EXIT_FAILURE, "sqlbox_prepare_bind");
+    if ((res = sqlbox_step(boxctx, stmtid_data)) == NULL)
+        errx(EXIT_FAILURE, "sqlbox_step");
+    nbrres = res->ps[0].iparm;
+    if (!sqlbox_finalise(boxctx, stmtid_data))
+        errx(EXIT_FAILURE, "sqlbox_finalise");
+    return nbrres;
+}
+
+/*
+ * Key of the page in the search cache, every parameter that changes the result set
+ */
+char *cache_key(const char *query, enum search_mode mode, const char *campus, int64_t page, int64_t limit) {
+    char *key;
+
+    kasprintf(&key, "%d/%" PRId64 "/%" PRId64 "/%zu:%s/%s", mode, page, limit, campus ? strlen(campus) : 0,
+              campus ? campus : "", query);
+    return key;
+}
+
+/*
+ * Looks the page up in the search cache, an entry only holds the serial numbers of the page and is
+ * only valid for the catalog version it was computed against, so any change to the books, their
+ * authors, languages, category names or to which campuses have a copy hides it. Stock counts and hit
+ * counters are not part of the version, they are read when the page is served.
+ */
+bool cache_get(const char *key, int64_t version, struct page *pg, int64_t *nbrres) {
+    struct searchcache_page cached;
+
+    if (!searchcache_lookup(key, version, &cached))
+        return false;
+    for (size_t i = 0; i < cached.serialsz; ++i)
+        page_add(pg, cached.serials[i]);
+    *nbrres = cached.nbrres;
+    return true;
+}
+
+int64_t cache_version() {
+    size_t stmtid;
+    const struct sqlbox_parmset *res;
+    int64_t version;
+    if (!(stmtid = sqlbox_prepare_bind(boxctx, dbid, STMTS_VERSION, 0, 0, 0)))
+        errx(EXIT_FAILURE, "sqlbox_prepare_bind");
+    if ((res = sqlbox_step(boxctx, stmtid)) == NULL || res->psz == 0)
+        errx(EXIT_FAILURE, "sqlbox_step");
+    version = res->ps[0].iparm;
+    if (!sqlbox_finalise(boxctx, stmtid))
+        errx(EXIT_FAILURE, "sqlbox_finalise");
+    return version;
+}
+
+/*
+ * Expands the query for the fuzzy mode into a JSON array holding, for each query word, the indexed
+ * words within its edit distance. Candidates come from the trigrams they share with the query word
+ * (every edit breaks at most three of them) and are then verified with fuzzy_within(), so only the
+ * posting lists of the query trigrams are read.
+ */
+char *fuzzy_expand(const char *query) {
+    char **qwords;
+    char *grams;
+    size_t qwordsz, gramsz, stmtid;
+    int k;
+    bool first;
+    const struct sqlbox_parmset *res;
+    char *json = NULL;
+    size_t jsonsz;
+    FILE *out;
+
+    if ((out = open_memstream(&json, &jsonsz)) == NULL)
+        err(EXIT_FAILURE, "open_memstream");
+    qwordsz = fuzzy_split(query, 0, &qwords);
+    fputc('[', out);
+    for (size_t i = 0; i < qwordsz; ++i) {
+        k = fuzzy_max_edits(qwords[i]);
+        grams = fuzzy_word_grams_json(qwords[i], &gramsz);
+        struct sqlbox_parm parms[] = {
+            {.type = SQLBOX_PARM_STRING, .sparm = grams},
+            {.type = SQLBOX_PARM_INT, .iparm = gramsz > (size_t) (3 * k) ? (int64_t) gramsz - 3 * k : 1},
+            {.type = SQLBOX_PARM_INT, .iparm = FUZZY_CANDIDATES},
+        };
+        if (!(stmtid = sqlbox_prepare_bind(boxctx, dbid, STMTS_FUZZY_WORDS, 3, parms, SQLBOX_STMT_MULTI)))
+            errx(EXIT_FAILURE, "sqlbox_prepare_bind");
+        fputs(i == 0 ? "[" : ",[", out);
+        first = true;
+        while ((res = sqlbox_step(boxctx, stmtid)) != NULL && res->code == SQLBOX_CODE_OK && res->psz != 0) {
+            if (!fuzzy_within(qwords[i], res->ps[0].sparm, k))
+                continue;
+            if (!first)
+                fputc(',', out);
+            first = false;
+            audit_json_string(out, res->ps[0].sparm);
+        }
+        fputc(']', out);
+        if (!sqlbox_finalise(boxctx, stmtid))
+            errx(EXIT_FAILURE, "sqlbox_finalise");
+        free(grams);
+    }
+    fputc(']', out);
+    if (fclose(out) == EOF)
+        err(EXIT_FAILURE, "fclose");
+    fuzzy_free(qwords, qwordsz);
+    return json;
+}
+
+/*
+ * GLOB pattern matching the query anywhere in a search key. The trigram index of SEARCHKEYFTS serves
+ * GLOB but not LIKE ... ESCAPE, and both sides are already folded so case does not matter. The
+ * wildcards of the query are escaped as one character classes.
+ */
+char *search_glob(const char *query) {
+    char *glob = kmalloc(strlen(query) * 3 + 3);
+    size_t n = 0;
+
+    glob[n++] = '*';
+    for (; *query; ++query) {
+        if (*query == '*' || *query == '?' || *query == '[') {
+            glob[n++] = '[';
+            glob[n++] = *query;
+            glob[n++] = ']';
+        } else
+            glob[n++] = *query;
+    }
+    glob[n++] = '*';
+    glob[n] = '\0';
+    return glob;
+}
+
+void process() {
+    static const enum statment search_stmts[] = {STMTS_SEARCH, STMTS_FUZZY_SEARCH, STMTS_RANK, STMTS_FUZZY_RANK};
+    static const enum statment count_stmts[] = {STMTS_COUNT, STMTS_FUZZY_COUNT};
+    char *query = normalize_text(r.fieldmap[KEY_STRING]->parsed.s);
+    char *pattern, *key;
+    struct page pg = {NULL, 0};
+    int64_t nbrres, version;
+    enum search_mode mode = MODE_EXACT;
+    const char *campus = r.fieldmap[KEY_AVAILABLE_AT] ? r.fieldmap[KEY_AVAILABLE_AT]->parsed.s : NULL;
     struct sqlbox_parm parms[] = {
         {
             .type = SQLBOX_PARM_STRING,
-            .sparm = r.fieldmap[KEY_STRING]->parsed.s
+            .sparm = query
         },
         {
             .type = SQLBOX_PARM_INT,
-            .iparm = (r.fieldmap[KEY_PAGE] ? r.fieldmap[KEY_PAGE]->parsed.i : 0)
+            .iparm = r.fieldmap[KEY_PAGE] ? r.fieldmap[KEY_PAGE]->parsed.i : 0
         },
         {
             .type = SQLBOX_PARM_INT,
-            .iparm = r.fieldmap[KEY_LIMIT] ? r.fieldmap[KEY_LIMIT]->parsed.i : 25
-        },
-        {
-            .type = SQLBOX_PARM_INT,
-            .iparm = r.fieldmap[KEY_LIMIT] ? r.fieldmap[KEY_LIMIT]->parsed.i : 25
+            .iparm = r.fieldmap[KEY_LIMIT] ? r.fieldmap[KEY_LIMIT]->parsed.i : LIMIT_DEFAULT
         }
     };
-    size_t parmsz = 4;
-    if (!(stmtid_data = sqlbox_prepare_bind(boxctx, dbid, STMTS_SEARCH, parmsz, parms, SQLBOX_STMT_MULTI)))
-        errx(EXIT_FAILURE, "sqlbox_prepare_bind");
+    if (r.fieldmap[KEY_FUZZY] && r.fieldmap[KEY_FUZZY]->parsed.i)
+        mode |= MODE_FUZZY;
+    if (r.fieldmap[KEY_RANK] && r.fieldmap[KEY_RANK]->parsed.i)
+        mode |= MODE_RANKED;
+    // Read before the search runs, a change racing with it then leaves an entry that is never served
+    version = cache_version();
+    key = cache_key(query, mode, campus, parms[1].iparm, parms[2].iparm);
+    if (!cache_get(key, version, &pg, &nbrres)) {
+        pattern = mode & MODE_FUZZY ? fuzzy_expand(query) : search_glob(query);
+        // sanitize() bounded page * limit
+        struct sqlbox_parm parms_search[] = {
+            {.type = SQLBOX_PARM_STRING, .sparm = pattern},
+            campus ? (struct sqlbox_parm) {.type = SQLBOX_PARM_STRING, .sparm = campus}
+                   : (struct sqlbox_parm) {.type = SQLBOX_PARM_NULL},
+            {.type = SQLBOX_PARM_INT, .iparm = parms[1].iparm * parms[2].iparm},
+            parms[2],
+            parms[0]
+        };
+        nbrres = run_search(search_stmts[mode], count_stmts[mode & MODE_FUZZY], parms_search,
+                            mode & MODE_RANKED ? 5 : 4, &pg);
+        free(pattern);
+        searchcache_store(key, version, nbrres, pg.serials, pg.serialsz);
+    }
+    free(key);
     khttp_head(&r, kresps[KRESP_STATUS], "%s", khttps[KHTTP_200]);
     khttp_head(&r, kresps[KRESP_CONTENT_TYPE], "%s", kmimetypes[KMIME_APP_JSON]);
     khttp_body(&r);
@@ -285,104 +630,17 @@ void process() {
         kjson_obj_close(&req);
     }
     kjson_obj_close(&req);
-    kjson_arrayp_open(&req, "res");
-    while ((res = sqlbox_step(boxctx, stmtid_data)) != NULL && res->code == SQLBOX_CODE_OK && res->psz != 0) {
-        kjson_obj_open(&req);
-        for (int i = 0; i < (int) res->psz; ++i) {
-            switch (res->ps[i].type) {
-                case SQLBOX_PARM_INT:
-                    kjson_putintp(&req, rows[i], res->ps[i].iparm);
-                    break;
-                case SQLBOX_PARM_STRING:
-                    if (i == 0)
-                        kjson_putstringp(&req, "serialnum", res->ps[i].sparm);
-                    else
-                        kjson_putstringp(&req, rows[i], res->ps[i].bparm);
-                    break;
-                case SQLBOX_PARM_FLOAT:
-                    kjson_putdoublep(&req, rows[i], res->ps[i].fparm);
-                    break;
-                case SQLBOX_PARM_BLOB:
-                    kjson_putstringp(&req, rows[i], res->ps[i].bparm);
-                    break;
-                case SQLBOX_PARM_NULL:
-                    kjson_putnullp(&req, rows[i]);
-                    break;
-                default:
-                    break;
-            }
-        }
-
-        size_t stmtid_book_data;
-        size_t parmsz_book = 1;
-        const struct sqlbox_parmset *res_book;
-        struct sqlbox_parm parms_book[] = {
-            {.type = SQLBOX_PARM_STRING, .sparm = res->ps[0].sparm},
-        };
-        if (!(stmtid_book_data =
-              sqlbox_prepare_bind(boxctx, dbid, STMTS_AUTHORS, parmsz_book, parms_book,
-                                  SQLBOX_STMT_MULTI)))
-            errx(EXIT_FAILURE, "sqlbox_prepare_bind");
-
-        kjson_arrayp_open(&req, "authors");
-        while ((res_book = sqlbox_step(boxctx, stmtid_book_data)) != NULL && res_book->code ==
-               SQLBOX_CODE_OK
-               && res_book->psz != 0)
-            kjson_putstring(&req, res_book->ps[0].sparm);
-        kjson_array_close(&req);
-
-        if (!sqlbox_finalise(boxctx, stmtid_book_data))
-            errx(EXIT_FAILURE, "sqlbox_finalise");
-
-        if (!(stmtid_book_data =
-              sqlbox_prepare_bind(boxctx, dbid, STMTS_LANGS, parmsz_book, parms_book,
-                                  SQLBOX_STMT_MULTI)))
-            errx(EXIT_FAILURE, "sqlbox_prepare_bind");
-
-        kjson_arrayp_open(&req, "langs");
-        while ((res_book = sqlbox_step(boxctx, stmtid_book_data)) != NULL && res_book->code ==
-               SQLBOX_CODE_OK
-               && res_book->psz != 0)
-            kjson_putstring(&req, res_book->ps[0].sparm);
-        kjson_array_close(&req);
-
-        if (!sqlbox_finalise(boxctx, stmtid_book_data))
-            errx(EXIT_FAILURE, "sqlbox_finalise");
-        if (!(stmtid_book_data =
-                         sqlbox_prepare_bind(boxctx, dbid, STMTS_STOCKED, parmsz_book, parms_book,
-                                             SQLBOX_STMT_MULTI)))
-            errx(EXIT_FAILURE, "sqlbox_prepare_bind");
-
-        kjson_arrayp_open(&req, "stock");
-        while ((res_book = sqlbox_step(boxctx, stmtid_book_data)) != NULL && res_book->code ==
-               SQLBOX_CODE_OK
-               && res_book->psz != 0) {
-            kjson_obj_open(&req);
-            kjson_putstringp(&req, "campus", res_book->ps[0].sparm);
-            kjson_putintp(&req, "stock", res_book->ps[1].iparm);
-            kjson_obj_close(&req);
-               }
-        kjson_array_close(&req);
-
-        if (!sqlbox_finalise(boxctx, stmtid_book_data))
-            errx(EXIT_FAILURE, "sqlbox_finalise");
-
-        kjson_obj_close(&req);
-    }
-    if (!sqlbox_finalise(boxctx, stmtid_data))
-        errx(EXIT_FAILURE, "sqlbox_finalise");
-    kjson_array_close(&req);
-    if (!(stmtid_data = sqlbox_prepare_bind(boxctx, dbid, STMTS_COUNT, parmsz, parms, SQLBOX_STMT_MULTI)))
-        errx(EXIT_FAILURE, "sqlbox_prepare_bind");
-    if ((res = sqlbox_step(boxctx, stmtid_data)) == NULL)
-        errx(EXIT_FAILURE, "sqlbox_step");
-    kjson_putintp(&req, "nbrres", res->ps[0].iparm);
-    if (!sqlbox_finalise(boxctx, stmtid_data))
-        errx(EXIT_FAILURE, "sqlbox_finalise");
+    put_page(&pg);
+    kjson_putintp(&req, "nbrres", nbrres);
     kjson_obj_close(&req);
     kjson_close(&req);
+    page_free(&pg);
+    free(query);
 }
 
+/*
+ * Logs the search as a JSON object, the same shape as the reads of query
+ */
 void save() {
     struct sqlbox_parm parms[] = {
         {
@@ -393,54 +651,32 @@ void save() {
             .type = SQLBOX_PARM_INT,
             .iparm = (r.fieldmap[KEY_PAGE] ? r.fieldmap[KEY_PAGE]->parsed.i : 0)
         },
-        {
-            .type = SQLBOX_PARM_INT,
-            .iparm = r.fieldmap[KEY_LIMIT] ? r.fieldmap[KEY_LIMIT]->parsed.i : 25
-        },
         {
             .type = SQLBOX_PARM_INT,
             .iparm = r.fieldmap[KEY_LIMIT] ? r.fieldmap[KEY_LIMIT]->parsed.i : 25
         }
     };
-    size_t parmsz = 4;
-    char *requestDesc = NULL;
-        kasprintf(&requestDesc, "Stmt:SEARCH,parmsz: %ld, Parms:(", parmsz);
-        for (int i = 0; i < (int) parmsz; ++i) {
-            switch (parms[i].type) {
-                case SQLBOX_PARM_INT:
-                    kasprintf(&requestDesc, "%s\"%"PRId64"\",", requestDesc, parms[i].iparm);
-                    break;
-                case SQLBOX_PARM_STRING:
-                    if (strlen(parms[i].sparm) > 0)
-                        kasprintf(&requestDesc, "%s\"%s\",", requestDesc, parms[i].sparm);
-                    break;
-                case SQLBOX_PARM_FLOAT:
-                    kasprintf(&requestDesc, "%s\"%f\",", requestDesc, parms[i].fparm);
-                    break;
-                default:
-                    break;
-            }
-        }
-        kasprintf(&requestDesc, "%s)", requestDesc);
-    size_t parmsz_save = 3;
-    struct sqlbox_parm parms_save[] = {
-        {
-            .type = (curr_usr.UUID != NULL) ? SQLBOX_PARM_STRING : SQLBOX_PARM_NULL,
-            .sparm = curr_usr.UUID
-        },
-        {
-            .type = SQLBOX_PARM_STRING,
-            .sparm = r.remote
-        },
-        {
-            .type = SQLBOX_PARM_STRING,
-            .sparm = requestDesc
-        },
+    char *details = NULL;
+    size_t detailsz;
+    FILE *out;
+
+    if ((out = open_memstream(&details, &detailsz)) == NULL)
+        err(EXIT_FAILURE, "open_memstream");
+    fputs("{\"page\":\"search\",\"mask\":0,\"parms\":", out);
+    audit_json_parms(out, parms, sizeof(parms) / sizeof(parms[0]));
+    fputc('}', out);
+    if (fclose(out) == EOF)
+        err(EXIT_FAILURE, "fclose");
+    const struct audit_event ev = {
+        .UUID = curr_usr.UUID,
+        .IP = r.remote,
+        .action = "EDIT",
+        .details = details
     };
-    if (sqlbox_exec(boxctx, dbid, STMTS_SAVE, parmsz_save, parms_save,SQLBOX_STMT_CONSTRAINT) !=
-        SQLBOX_CODE_OK)
-        errx(EXIT_FAILURE, "sqlbox_exec");
+    audit_append(&ev);
+    free(details);
 }
+
 int main() {
     enum khttp er;
     if (khttp_parse(&r, keys, KEY__MAX, 0, 0, 0) != KCGI_OK)
@@ -0,0 +1,113 @@
+#include <sys/types.h> /* size_t */
+#include <sys/file.h> /* flock() */
+#include <sys/mman.h> /* mmap() */
+#include <sys/stat.h> /* fstat() */
+#include <err.h> /* err() */
+#include <fcntl.h> /* open() */
+#include <stdlib.h> /* EXIT_FAILURE */
+#include <string.h> /* strlen() */
+#include <unistd.h> /* ftruncate() */
+#include "keyhash.h"
+#include "searchcache.h"
+
+/*
+ * Changes with the layout of the table, a mismatching file is wiped
+ */
+#define SEARCHCACHE_MAGIC (0x5345415200000000ULL | sizeof(struct searchcache_page))
+
+struct cache {
+    uint64_t magic;
+    struct searchcache_page slots[SEARCHCACHE_SLOTS];
+};
+
+static struct cache *cache = NULL;
+static int cachefd = -1;
+
+/*
+ * Maps the table, creating (or wiping) it under an exclusive lock when needed
+ */
+static void cache_open() {
+    struct stat st;
+
+    if (cache != NULL)
+        return;
+    if ((cachefd = open(SEARCHCACHE_FILE, O_RDWR | O_CREAT, 0600)) == -1)
+        err(EXIT_FAILURE, "open");
+    if (flock(cachefd, LOCK_EX) == -1)
+        err(EXIT_FAILURE, "flock");
+    if (fstat(cachefd, &st) == -1)
+        err(EXIT_FAILURE, "fstat");
+    if ((size_t) st.st_size != sizeof(struct cache) && ftruncate(cachefd, sizeof(struct cache)) == -1)
+        err(EXIT_FAILURE, "ftruncate");
+    if ((cache = mmap(NULL, sizeof(struct cache), PROT_READ | PROT_WRITE, MAP_SHARED, cachefd, 0)) == MAP_FAILED)
+        err(EXIT_FAILURE, "mmap");
+    if (cache->magic != SEARCHCACHE_MAGIC) {
+        memset(cache, 0, sizeof(struct cache));
+        cache->magic = SEARCHCACHE_MAGIC;
+    }
+    if (flock(cachefd, LOCK_UN) == -1)
+        err(EXIT_FAILURE, "flock");
+}
+
+static void cache_lock(int op) {
+    cache_open();
+    if (flock(cachefd, op) == -1)
+        err(EXIT_FAILURE, "flock");
+}
+
+static size_t slot_of(uint64_t hash, size_t probe) {
+    return (hash + probe) % SEARCHCACHE_SLOTS;
+}
+
+bool searchcache_lookup(const char *key, int64_t version, struct searchcache_page *pg) {
+    uint64_t hash;
+    bool found = false;
+
+    if (strlen(key) >= sizeof(pg->key))
+        return false;
+    hash = keyhash(key);
+    cache_lock(LOCK_SH);
+    for (size_t i = 0; i < SEARCHCACHE_PROBES && !found; ++i) {
+        const struct searchcache_page *slot = &cache->slots[slot_of(hash, i)];
+        if (slot->version == version && strcmp(slot->key, key) == 0) {
+            *pg = *slot;
+            found = true;
+        }
+    }
+    cache_lock(LOCK_UN);
+    return found;
+}
+
+void searchcache_store(const char *key, int64_t version, int64_t nbrres, char *const *serials, size_t serialsz) {
+    struct searchcache_page *slot = NULL, *s;
+    uint64_t hash;
+
+    if (strlen(key) >= sizeof(slot->key) || serialsz > SEARCHCACHE_PAGE)
+        return;
+    for (size_t i = 0; i < serialsz; ++i)
+        if (strlen(serials[i]) >= sizeof(slot->serials[i]))
+            return;
+    hash = keyhash(key);
+    cache_lock(LOCK_EX);
+    // Same request first, then a free slot or one computed against another version, the hashed slot
+    // is evicted otherwise
+    for (size_t i = 0; i < SEARCHCACHE_PROBES; ++i) {
+        s = &cache->slots[slot_of(hash, i)];
+        if (strcmp(s->key, key) == 0) {
+            slot = s;
+            break;
+        }
+        if (slot == NULL && (s->key[0] == '\0' || s->version != version))
+            slot = s;
+    }
+    if (slot == NULL)
+        slot = &cache->slots[slot_of(hash, 0)];
+    memset(slot, 0, sizeof(struct searchcache_page));
+    strcpy(slot->key, key);
+    slot->version = version;
+    slot->nbrres = nbrres;
+    slot->serialsz = serialsz;
+    for (size_t i = 0; i < serialsz; ++i)
+        strcpy(slot->serials[i], serials[i]);
+    cache_lock(LOCK_UN);
+}
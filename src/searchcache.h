@@ -0,0 +1,50 @@
+#ifndef SEARCHCACHE_H
+#define SEARCHCACHE_H
+
+#include <stdbool.h>
+#include <stddef.h> /* size_t */
+#include <stdint.h> /* int64_t */
+
+/*
+ * Cache of search result pages shared by every search process: a file mapped MAP_SHARED holding an
+ * open addressing table keyed by the keyhash() of the request, guarded by flock(). Serving a search
+ * from it or filling it never writes to the database.
+ */
+#define SEARCHCACHE_FILE "db/search.cache"
+#define SEARCHCACHE_SLOTS 1024
+/*
+ * Slots looked at from the hashed one, the table never grows, colliding entries are evicted
+ */
+#define SEARCHCACHE_PROBES 8
+/*
+ * Largest request key and page kept, bigger ones are not cached
+ */
+#define SEARCHCACHE_KEY_MAX 256
+#define SEARCHCACHE_PAGE 64
+#define SEARCHCACHE_SERIAL_MAX 32
+
+/*
+ * Serial numbers of one page and the total number of matches, valid only for the catalog version
+ * (CATALOGVERSION) they were computed against
+ */
+struct searchcache_page {
+    char key[SEARCHCACHE_KEY_MAX];
+    int64_t version;
+    int64_t nbrres;
+    size_t serialsz;
+    char serials[SEARCHCACHE_PAGE][SEARCHCACHE_SERIAL_MAX];
+};
+
+/*
+ * Copies the page cached for key into pg, false on a miss or when it was computed against another
+ * version than the current one
+ */
+bool searchcache_lookup(const char *key, int64_t version, struct searchcache_page *pg);
+
+/*
+ * Caches a page computed against version, which must be read before the search ran so that a change
+ * racing with it leaves an entry that is never served
+ */
+void searchcache_store(const char *key, int64_t version, int64_t nbrres, char *const *serials, size_t serialsz);
+
+#endif
@@ -0,0 +1,62 @@
+#include <sys/types.h> /* size_t */
+#include <stdarg.h> /* va_list */
+#include <stddef.h> /* NULL */
+#include <stdint.h> /* int64_t */
+#include <err.h> /* errx() */
+#include <stdlib.h> /* EXIT_FAILURE */
+#include <sqlbox.h>
+#include "normalize.h"
+#include "fuzzy.h"
+#include "searchkey.h"
+
+void searchkey_refresh(struct sqlbox *box, size_t dbid, size_t first, const char *serialnum) {
+    size_t stmtid;
+    const struct sqlbox_parmset *res;
+    const char *fields[9];
+    char *key, *words_json, *grams_json, **words;
+    size_t wordsz;
+    struct sqlbox_parm parms[] = {
+        {.type = SQLBOX_PARM_STRING, .sparm = serialnum},
+    };
+    if (!(stmtid = sqlbox_prepare_bind(box, dbid, first + SEARCHKEY_SRC, 1, parms, 0)))
+        errx(EXIT_FAILURE, "sqlbox_prepare_bind");
+    if ((res = sqlbox_step(box, stmtid)) == NULL)
+        errx(EXIT_FAILURE, "sqlbox_step");
+    if (res->psz == 0) {
+        sqlbox_finalise(box, stmtid);
+        return;
+    }
+    for (size_t i = 0; i < 9; ++i)
+        fields[i] = (i < res->psz && res->ps[i].type == SQLBOX_PARM_STRING) ? res->ps[i].sparm : NULL;
+    key = normalize_fields(fields, 9);
+    sqlbox_finalise(box, stmtid);
+
+    struct sqlbox_parm parms_set[] = {
+        {.type = SQLBOX_PARM_STRING, .sparm = key},
+        {.type = SQLBOX_PARM_STRING, .sparm = serialnum},
+    };
+    if (sqlbox_exec(box, dbid, first + SEARCHKEY_SET, 2, parms_set, 0) != SQLBOX_CODE_OK)
+        errx(EXIT_FAILURE, "sqlbox_exec");
+
+    // Words and trigrams of the title, authors and publisher for the fuzzy search
+    wordsz = fuzzy_split(key, FUZZY_FIELDS, &words);
+    words_json = fuzzy_words_json(words, wordsz);
+    grams_json = fuzzy_grams_json(words, wordsz);
+    struct sqlbox_parm parms_words[] = {
+        {.type = SQLBOX_PARM_STRING, .sparm = serialnum},
+        {.type = SQLBOX_PARM_STRING, .sparm = words_json},
+    };
+    struct sqlbox_parm parms_grams[] = {
+        {.type = SQLBOX_PARM_STRING, .sparm = grams_json},
+    };
+    if (sqlbox_exec(box, dbid, first + SEARCHKEY_WORDS_CLEAR, 1, parms_words, 0) != SQLBOX_CODE_OK)
+        errx(EXIT_FAILURE, "sqlbox_exec");
+    if (sqlbox_exec(box, dbid, first + SEARCHKEY_WORDS_SET, 2, parms_words, 0) != SQLBOX_CODE_OK)
+        errx(EXIT_FAILURE, "sqlbox_exec");
+    if (sqlbox_exec(box, dbid, first + SEARCHKEY_GRAMS_SET, 1, parms_grams, 0) != SQLBOX_CODE_OK)
+        errx(EXIT_FAILURE, "sqlbox_exec");
+    fuzzy_free(words, wordsz);
+    free(words_json);
+    free(grams_json);
+    free(key);
+}
@@ -0,0 +1,53 @@
+#ifndef SEARCHKEY_H
+#define SEARCHKEY_H
+
+#include <stddef.h> /* size_t */
+
+struct sqlbox;
+
+/*
+ * Statements run by searchkey_refresh(), an endpoint lists them in its sqlbox statements with
+ * SEARCHKEY_PSTMTS, in this order, and passes the index of the first one
+ */
+enum searchkey_statement {
+    SEARCHKEY_SRC,
+    SEARCHKEY_SET,
+    SEARCHKEY_WORDS_CLEAR,
+    SEARCHKEY_WORDS_SET,
+    SEARCHKEY_GRAMS_SET,
+    SEARCHKEY__MAX
+};
+
+#define SEARCHKEY_PSTMTS \
+    { \
+        (char *) \
+        "SELECT booktitle," \
+        "(SELECT group_concat(author, ' ') FROM AUTHORED WHERE AUTHORED.serialnum = BOOK.serialnum)," \
+        "publisher," \
+        "serialnum," \
+        "(SELECT categoryName FROM CATEGORY WHERE categoryClass = BOOK.category)," \
+        "type," \
+        "(SELECT group_concat(lang, ' ') FROM LANGUAGES WHERE LANGUAGES.serialnum = BOOK.serialnum)," \
+        "CAST(bookreleaseyear AS TEXT)," \
+        "description " \
+        "FROM BOOK " \
+        "WHERE serialnum = (?)" \
+    }, \
+    {(char *) "UPDATE BOOK SET searchkey = (?) WHERE serialnum = (?)"}, \
+    {(char *) "DELETE FROM SEARCHWORD WHERE serialnum = (?)"}, \
+    {(char *) "INSERT OR IGNORE INTO SEARCHWORD (word, serialnum) SELECT value, (?) FROM json_each(?)"}, \
+    { \
+        (char *) \
+        "INSERT OR IGNORE INTO WORDGRAM (gram, word) " \
+        "SELECT json_extract(value, '$[0]'), json_extract(value, '$[1]') " \
+        "FROM json_each(?)" \
+    }
+
+/*
+ * Recomputes the normalized search key of a book from its row, its authors and its languages, along
+ * with the words and trigrams the fuzzy search looks it up by. first is the index of SEARCHKEY_SRC
+ * in the statements of box, a book that no longer exists is left alone.
+ */
+void searchkey_refresh(struct sqlbox *box, size_t dbid, size_t first, const char *serialnum);
+
+#endif
@@ -0,0 +1,213 @@
+#include <sys/types.h> /* size_t */
+#include <sys/file.h> /* flock() */
+#include <sys/mman.h> /* mmap() */
+#include <sys/stat.h> /* fstat() */
+#include <err.h> /* err() */
+#include <fcntl.h> /* open() */
+#include <sha2.h> /* SHA256Data() */
+#include <sqlbox.h>
+#include <stdlib.h> /* EXIT_FAILURE */
+#include <string.h> /* strlen() */
+#include <time.h> /* time() */
+#include <unistd.h> /* ftruncate() */
+#include "token.h"
+#include "session.h"
+
+/*
+ * Changes with the layout of the table, a mismatching file is wiped
+ */
+#define SESSION_MAGIC (0x5345535300000000ULL | sizeof(struct session))
+
+struct cache {
+    uint64_t magic;
+    uint64_t generation;
+    struct session slots[SESSION_SLOTS];
+};
+
+static struct cache *cache = NULL;
+static int cachefd = -1;
+
+/*
+ * Maps the table, creating (or wiping) it under an exclusive lock when needed
+ */
+static void cache_open() {
+    struct stat st;
+
+    if (cache != NULL)
+        return;
+    if ((cachefd = open(SESSION_CACHE, O_RDWR | O_CREAT, 0600)) == -1)
+        err(EXIT_FAILURE, "open");
+    if (flock(cachefd, LOCK_EX) == -1)
+        err(EXIT_FAILURE, "flock");
+    if (fstat(cachefd, &st) == -1)
+        err(EXIT_FAILURE, "fstat");
+    if ((size_t) st.st_size != sizeof(struct cache) && ftruncate(cachefd, sizeof(struct cache)) == -1)
+        err(EXIT_FAILURE, "ftruncate");
+    if ((cache = mmap(NULL, sizeof(struct cache), PROT_READ | PROT_WRITE, MAP_SHARED, cachefd, 0)) == MAP_FAILED)
+        err(EXIT_FAILURE, "mmap");
+    if (cache->magic != SESSION_MAGIC) {
+        memset(cache, 0, sizeof(struct cache));
+        cache->magic = SESSION_MAGIC;
+    }
+    if (flock(cachefd, LOCK_UN) == -1)
+        err(EXIT_FAILURE, "flock");
+}
+
+static void cache_lock(int op) {
+    cache_open();
+    if (flock(cachefd, op) == -1)
+        err(EXIT_FAILURE, "flock");
+}
+
+/*
+ * The key is already a SHA-256, its first 32 bits are as good as any hash of it
+ */
+static size_t slot_of(const char *digest, size_t probe) {
+    char head[9] = {0};
+    strncpy(head, digest, 8);
+    return (strtoul(head, NULL, 16) + probe) % SESSION_SLOTS;
+}
+
+static bool live(const struct session *s, int64_t now) {
+    return s->digest[0] != '\0' && s->generation == cache->generation && s->expires > now;
+}
+
+bool session_lookup(const char *digest, struct session *s) {
+    const int64_t now = time(NULL);
+    bool found = false;
+
+    cache_lock(LOCK_SH);
+    for (size_t i = 0; i < SESSION_PROBES && !found; ++i) {
+        const struct session *slot = &cache->slots[slot_of(digest, i)];
+        if (live(slot, now) && strcmp(slot->digest, digest) == 0) {
+            *s = *slot;
+            found = true;
+        }
+    }
+    cache_lock(LOCK_UN);
+    return found;
+}
+
+uint64_t session_generation() {
+    uint64_t generation;
+
+    cache_lock(LOCK_SH);
+    generation = cache->generation;
+    cache_lock(LOCK_UN);
+    return generation;
+}
+
+void session_store(const char *digest, const char *UUID, const char *disp_name, const char *campus,
+                   const char *role, int perms, bool frozen, int64_t expires, uint64_t generation) {
+    const int64_t now = time(NULL);
+    struct session *slot = NULL, *s;
+
+    if (strlen(digest) >= sizeof(slot->digest) || strlen(UUID) >= sizeof(slot->UUID) ||
+        strlen(disp_name) >= sizeof(slot->disp_name) || strlen(campus) >= sizeof(slot->campus) ||
+        strlen(role) >= sizeof(slot->role) || expires <= now)
+        return;
+    cache_lock(LOCK_EX);
+    if (cache->generation != generation) {
+        cache_lock(LOCK_UN);
+        return;
+    }
+    // Same session first, then a free or dead slot, the hashed slot is evicted otherwise
+    for (size_t i = 0; i < SESSION_PROBES; ++i) {
+        s = &cache->slots[slot_of(digest, i)];
+        if (strcmp(s->digest, digest) == 0) {
+            slot = s;
+            break;
+        }
+        if (slot == NULL && !live(s, now))
+            slot = s;
+    }
+    if (slot == NULL)
+        slot = &cache->slots[slot_of(digest, 0)];
+    memset(slot, 0, sizeof(struct session));
+    strcpy(slot->digest, digest);
+    strcpy(slot->UUID, UUID);
+    strcpy(slot->disp_name, disp_name);
+    strcpy(slot->campus, campus);
+    strcpy(slot->role, role);
+    slot->perms = perms;
+    slot->frozen = frozen;
+    slot->expires = (expires < now + SESSION_TTL) ? expires : now + SESSION_TTL;
+    slot->generation = generation;
+    cache_lock(LOCK_UN);
+}
+
+void session_forget(const char *digest) {
+    cache_lock(LOCK_EX);
+    for (size_t i = 0; i < SESSION_PROBES; ++i) {
+        struct session *s = &cache->slots[slot_of(digest, i)];
+        if (strcmp(s->digest, digest) == 0)
+            s->digest[0] = '\0';
+    }
+    cache_lock(LOCK_UN);
+}
+
+void session_invalidate() {
+    cache_lock(LOCK_EX);
+    cache->generation++;
+    cache_lock(LOCK_UN);
+}
+
+static char *copy_field(const char *s) {
+    char *out;
+    if ((out = strdup(s)) == NULL)
+        err(EXIT_FAILURE, "strdup");
+    return out;
+}
+
+bool session_resolve(const char *cookie, struct sqlbox *box, size_t dbid, size_t stmt, struct token *tok) {
+    char digest[SHA256_DIGEST_STRING_LENGTH];
+    struct session cached;
+    const struct sqlbox_parmset *res;
+    size_t stmtid;
+    uint64_t generation;
+    bool found = false;
+
+    SHA256Data((const uint8_t *) cookie, strlen(cookie), digest);
+    switch (token_verify(cookie, digest, tok)) {
+        case TOKEN_VALID:
+            return true;
+        case TOKEN_INVALID:
+            return false;
+        default:
+            break;
+    }
+    memset(tok, 0, sizeof(struct token));
+    // Taken before the database is read, an invalidation racing the read then keeps the row out
+    generation = session_generation();
+    if (session_lookup(digest, &cached)) {
+        tok->UUID = copy_field(cached.UUID);
+        tok->disp_name = copy_field(cached.disp_name);
+        tok->campus = copy_field(cached.campus);
+        tok->role = copy_field(cached.role);
+        tok->perms = cached.perms;
+        tok->frozen = cached.frozen;
+        tok->expires = cached.expires;
+        return true;
+    }
+    struct sqlbox_parm parms[] = {
+        {.type = SQLBOX_PARM_STRING, .sparm = digest},
+    };
+    if (!(stmtid = sqlbox_prepare_bind(box, dbid, stmt, 1, parms, 0)))
+        errx(EXIT_FAILURE, "sqlbox_prepare_bind");
+    if ((res = sqlbox_step(box, stmtid)) == NULL)
+        errx(EXIT_FAILURE, "sqlbox_step");
+    if (res->psz != 0) {
+        tok->UUID = copy_field(res->ps[0].sparm);
+        tok->disp_name = copy_field(res->ps[1].sparm);
+        tok->campus = copy_field(res->ps[3].sparm);
+        tok->role = copy_field(res->ps[4].sparm);
+        tok->perms = (int) res->ps[5].iparm;
+        tok->frozen = res->ps[6].iparm;
+        tok->expires = res->ps[7].iparm;
+        session_store(digest, tok->UUID, tok->disp_name, tok->campus, tok->role, tok->perms, tok->frozen,
+                      tok->expires, generation);
+        found = true;
+    }
+    sqlbox_finalise(box, stmtid);
+    return found;
+}
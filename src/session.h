@@ -0,0 +1,98 @@
+#ifndef SESSION_H
+#define SESSION_H
+
+#include <stdbool.h>
+#include <stddef.h> /* size_t */
+#include <stdint.h> /* int64_t, uint64_t */
+
+struct sqlbox;
+struct token;
+
+/*
+ * Cache of resolved sessions shared by every endpoint: a file mapped MAP_SHARED holding an open
+ * addressing table keyed by the SHA-256 (hex) of the session ID, guarded by flock()
+ */
+#define SESSION_CACHE "db/sessions.cache"
+#define SESSION_SLOTS 2048
+/*
+ * Slots looked at from the hashed one, the table never grows, colliding entries are evicted
+ */
+#define SESSION_PROBES 8
+/*
+ * Longest time an entry is trusted, even if SESSIONS.expiresAt is later
+ */
+#define SESSION_TTL 300
+#define SESSION_FIELD_MAX 96
+
+/*
+ * Statement session_resolve() reads a session from the database with, an endpoint lists it in its
+ * sqlbox statements and passes its index. Columns: UUID, displayname, pwhash, campus, role, perms,
+ * frozen and the expiry (epoch) of the session.
+ */
+#define SESSION_LOGIN_PSTMT \
+    { \
+        (char *) \
+        "SELECT ACCOUNT.UUID, displayname, pwhash, campus, role, perms, frozen, " \
+        "CAST(strftime('%s', expiresAt, 'utc') AS INTEGER) " \
+        "FROM ROLE," \
+        "ACCOUNT " \
+        "LEFT JOIN SESSIONS S on ACCOUNT.UUID = S.account " \
+        "WHERE ACCOUNT.role = ROLE.roleName " \
+        "AND sessionID = (?) " \
+        "AND expiresAt > datetime('now','localtime') " \
+        "GROUP BY ACCOUNT.UUID, displayname, pwhash, campus, perms, frozen " \
+    }
+
+/*
+ * What session_resolve() reads from ACCOUNT, ROLE and SESSIONS, fields that do not fit are not cached
+ */
+struct session {
+    char digest[65];
+    char UUID[SESSION_FIELD_MAX];
+    char disp_name[SESSION_FIELD_MAX * 2];
+    char campus[SESSION_FIELD_MAX];
+    char role[SESSION_FIELD_MAX];
+    int perms;
+    bool frozen;
+    int64_t expires;
+    uint64_t generation;
+};
+
+/*
+ * Resolves a session cookie into the account behind it: a signed token first, then the cache, then
+ * the SESSIONS row read with the statement stmt of box (SESSION_LOGIN_PSTMT), which is cached. On
+ * success the fields of tok are allocated and owned by the caller, false for an unknown, expired or
+ * forged session.
+ */
+bool session_resolve(const char *cookie, struct sqlbox *box, size_t dbid, size_t stmt, struct token *tok);
+
+/*
+ * Copies the live entry of digest into s, false on a miss
+ */
+bool session_lookup(const char *digest, struct session *s);
+
+/*
+ * Current generation of the cache, to be read before the database so that session_store() can
+ * tell whether session_invalidate() ran in between
+ */
+uint64_t session_generation();
+
+/*
+ * Caches a session resolved from the database until expires (epoch) or SESSION_TTL. Nothing is
+ * stored when the cache moved past generation since, the row read may predate the change.
+ */
+void session_store(const char *digest, const char *UUID, const char *disp_name, const char *campus,
+                   const char *role, int perms, bool frozen, int64_t expires, uint64_t generation);
+
+/*
+ * Drops one session, after it was closed
+ */
+void session_forget(const char *digest);
+
+/*
+ * Drops every session at once by moving to a new generation, after accounts, roles or campuses
+ * changed
+ */
+void session_invalidate();
+
+#endif
@@ -63,8 +63,9 @@ static struct sqlbox_pstmt pstmts_data[STMTS__MAX] = {
     },
     {
         (char *)
-        "INSERT INTO HISTORY (UUID, IP, action, actiondate, details) "
-        "VALUES ((?),(?),'SIGNUP',datetime('now','localtime'),(?))"
+        "INSERT INTO HISTORY (UUID, IP, action, actiontime, details) "
+        "VALUES ((?),(?),(SELECT actionCode FROM ACTION WHERE actionName = 'SIGNUP'),"
+        "CAST(strftime('%s', 'now') AS INTEGER),(?))"
     }
 };
 
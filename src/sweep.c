@@ -0,0 +1,102 @@
+#include <sys/types.h> /* size_t */
+#include <stdarg.h> /* va_list */
+#include <stddef.h> /* NULL */
+#include <stdint.h> /* int64_t */
+#include <err.h> /* err(), warnx() */
+#include <stdlib.h> /* EXIT_FAILURE */
+#include <string.h> /* memset() */
+#include <time.h> /* nanosleep() */
+#include <sqlbox.h>
+#include <stdio.h>
+
+/*
+ * Command line tool deleting the expired SESSIONS rows, meant to be run from cron(8). Rows go in
+ * batches of BATCH, each in its own short transaction followed by a PAUSE so that the endpoints
+ * writing to the database (borrow, return, ...) never wait long on the write lock.
+ * Usage: sweep [database]
+ */
+
+#define BATCH 500
+#define PAUSE 50000000L /* nanoseconds */
+
+enum statement {
+    STMTS_SWEEP,
+    STMTS_CHANGES,
+    STMTS__MAX
+};
+
+static struct sqlbox_pstmt pstmts[STMTS__MAX] = {
+    {
+        (char *)
+        "DELETE FROM SESSIONS "
+        "WHERE rowid IN (SELECT rowid FROM SESSIONS WHERE expiresAt <= datetime('now','localtime') LIMIT (?))"
+    },
+    {(char *) "SELECT changes()"}
+};
+
+struct sqlbox_src srcs[] = {
+    {
+        .fname = (char *) "db/database.db",
+        .mode = SQLBOX_SRC_RW
+    }
+};
+struct sqlbox *boxctx;
+struct sqlbox_cfg cfg;
+size_t dbid;
+
+void alloc_ctx_cfg() {
+    memset(&cfg, 0, sizeof(struct sqlbox_cfg));
+    cfg.msg.func_short = warnx;
+    cfg.srcs.srcsz = 1;
+    cfg.srcs.srcs = srcs;
+    cfg.stmts.stmtsz = STMTS__MAX;
+    cfg.stmts.stmts = pstmts;
+    if ((boxctx = sqlbox_alloc(&cfg)) == NULL)
+        errx(EXIT_FAILURE, "sqlbox_alloc");
+    if (!(dbid = sqlbox_open(boxctx, 0)))
+        errx(EXIT_FAILURE, "sqlbox_open");
+}
+
+/*
+ * Deletes one batch, returns the number of rows deleted
+ */
+int64_t sweep_batch() {
+    size_t stmtid;
+    int64_t deleted;
+    const struct sqlbox_parmset *res;
+    struct sqlbox_parm parms[] = {
+        {.type = SQLBOX_PARM_INT, .iparm = BATCH},
+    };
+
+    if (!sqlbox_trans_immediate(boxctx, dbid, 1))
+        errx(EXIT_FAILURE, "sqlbox_trans_immediate");
+    if (sqlbox_exec(boxctx, dbid, STMTS_SWEEP, 1, parms, 0) != SQLBOX_CODE_OK)
+        errx(EXIT_FAILURE, "sqlbox_exec");
+    if (!(stmtid = sqlbox_prepare_bind(boxctx, dbid, STMTS_CHANGES, 0, 0, 0)))
+        errx(EXIT_FAILURE, "sqlbox_prepare_bind");
+    if ((res = sqlbox_step(boxctx, stmtid)) == NULL)
+        errx(EXIT_FAILURE, "sqlbox_step");
+    deleted = res->ps[0].iparm;
+    if (!sqlbox_finalise(boxctx, stmtid))
+        errx(EXIT_FAILURE, "sqlbox_finalise");
+    if (!sqlbox_trans_commit(boxctx, dbid, 1))
+        errx(EXIT_FAILURE, "sqlbox_trans_commit");
+    return deleted;
+}
+
+int main(int argc, char *argv[]) {
+    int64_t deleted, total = 0;
+    const struct timespec pause = {0, PAUSE};
+
+    if (argc > 1)
+        srcs[0].fname = argv[1];
+    alloc_ctx_cfg();
+    while ((deleted = sweep_batch()) > 0) {
+        total += deleted;
+        if (deleted == BATCH)
+            nanosleep(&pause, NULL);
+    }
+    printf("%lld expired sessions deleted\n", (long long) total);
+    sqlbox_free(boxctx);
+    return EXIT_SUCCESS;
+}
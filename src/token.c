@@ -0,0 +1,322 @@
+#include <sys/types.h> /* size_t, ssize_t */
+#include <stdarg.h> /* va_list */
+#include <sys/file.h> /* flock() */
+#include <sys/stat.h> /* fstat() */
+#include <err.h> /* err() */
+#include <errno.h> /* ENOENT */
+#include <fcntl.h> /* open() */
+#include <inttypes.h> /* PRId64 */
+#include <stdio.h> /* vsnprintf() */
+#include <stdlib.h> /* EXIT_FAILURE */
+#include <string.h> /* strchr() */
+#include <time.h> /* time() */
+#include <unistd.h> /* pwrite() */
+#include <sha2.h> /* SHA256Init() */
+#include "token.h"
+
+#define TOKEN_VERSION "v1."
+#define TOKEN_FIELDS 8
+#define HMAC_BLOCK 64
+#define SIGLEN ((SHA256_DIGEST_LENGTH * 4 + 2) / 3)
+/*
+ * Size past which token_revoke() drops the expired entries of the revocation list
+ */
+#define REVOKED_COMPACT 65536
+
+static const char b64url[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+
+static uint8_t key[HMAC_BLOCK];
+static ssize_t keylen = -1;
+
+/*
+ * Allocated printf(), stores the length of the result in len
+ */
+static char *format(int *len, const char *fmt, ...) {
+    va_list ap;
+    char *out;
+
+    va_start(ap, fmt);
+    *len = vsnprintf(NULL, 0, fmt, ap);
+    va_end(ap);
+    if (*len < 0)
+        err(EXIT_FAILURE, "vsnprintf");
+    if ((out = malloc((size_t) *len + 1)) == NULL)
+        err(EXIT_FAILURE, "malloc");
+    va_start(ap, fmt);
+    vsnprintf(out, (size_t) *len + 1, fmt, ap);
+    va_end(ap);
+    return out;
+}
+
+size_t b64url_encode(const uint8_t *in, size_t len, char *out) {
+    size_t n = 0;
+    for (size_t i = 0; i < len; i += 3) {
+        uint32_t v = (uint32_t) in[i] << 16;
+        if (i + 1 < len)
+            v |= (uint32_t) in[i + 1] << 8;
+        if (i + 2 < len)
+            v |= in[i + 2];
+        out[n++] = b64url[(v >> 18) & 63];
+        out[n++] = b64url[(v >> 12) & 63];
+        if (i + 1 < len)
+            out[n++] = b64url[(v >> 6) & 63];
+        if (i + 2 < len)
+            out[n++] = b64url[v & 63];
+    }
+    out[n] = '\0';
+    return n;
+}
+
+static ssize_t b64url_decode(const char *in, size_t len, uint8_t *out) {
+    const char *p;
+    uint32_t v = 0;
+    size_t bits = 0, n = 0;
+    for (size_t i = 0; i < len; ++i) {
+        if ((p = memchr(b64url, in[i], 64)) == NULL)
+            return -1;
+        v = (v << 6) | (uint32_t) (p - b64url);
+        bits += 6;
+        if (bits >= 8) {
+            bits -= 8;
+            out[n++] = (uint8_t) (v >> bits);
+        }
+    }
+    return (ssize_t) n;
+}
+
+/*
+ * Reads the signing key once, a missing file disables signed tokens
+ */
+static bool load_key() {
+    int fd;
+    if (keylen < 0) {
+        keylen = 0;
+        if ((fd = open(TOKEN_KEY, O_RDONLY)) == -1) {
+            if (errno == ENOENT)
+                return false;
+            err(EXIT_FAILURE, "open");
+        }
+        if ((keylen = read(fd, key, sizeof(key))) == -1)
+            err(EXIT_FAILURE, "read");
+        close(fd);
+    }
+    return keylen >= TOKEN_KEY_MIN;
+}
+
+/*
+ * HMAC-SHA256 (RFC 2104), the key is never longer than a block so it is used as is
+ */
+static void hmac_sha256(const char *msg, size_t len, uint8_t mac[SHA256_DIGEST_LENGTH]) {
+    SHA2_CTX ctx;
+    uint8_t pad[HMAC_BLOCK], inner[SHA256_DIGEST_LENGTH];
+
+    memset(pad, 0x36, sizeof(pad));
+    for (ssize_t i = 0; i < keylen; ++i)
+        pad[i] ^= key[i];
+    SHA256Init(&ctx);
+    SHA256Update(&ctx, pad, sizeof(pad));
+    SHA256Update(&ctx, (const uint8_t *) msg, len);
+    SHA256Final(inner, &ctx);
+
+    memset(pad, 0x5c, sizeof(pad));
+    for (ssize_t i = 0; i < keylen; ++i)
+        pad[i] ^= key[i];
+    SHA256Init(&ctx);
+    SHA256Update(&ctx, pad, sizeof(pad));
+    SHA256Update(&ctx, inner, sizeof(inner));
+    SHA256Final(mac, &ctx);
+}
+
+char *token_issue(const struct token *tok) {
+    const char *fields[] = {tok->UUID, tok->disp_name, tok->campus, tok->role};
+    char *payload, *out;
+    uint8_t mac[SHA256_DIGEST_LENGTH];
+    size_t n;
+    int len;
+
+    if (!load_key())
+        return NULL;
+    for (size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); ++i)
+        if (fields[i] == NULL || strchr(fields[i], '\n') != NULL)
+            return NULL;
+    payload = format(&len, "%s\n%s\n%s\n%s\n%d\n%d\n%" PRId64 "\n%" PRId64, tok->UUID, tok->disp_name, tok->campus,
+                     tok->role, tok->perms, tok->frozen, tok->issued, tok->expires);
+    if ((out = malloc(sizeof(TOKEN_VERSION) + ((size_t) len * 4 + 2) / 3 + 1 + SIGLEN + 1)) == NULL)
+        err(EXIT_FAILURE, "malloc");
+    memcpy(out, TOKEN_VERSION, sizeof(TOKEN_VERSION) - 1);
+    n = sizeof(TOKEN_VERSION) - 1;
+    n += b64url_encode((const uint8_t *) payload, (size_t) len, out + n);
+    hmac_sha256(out, n, mac);
+    out[n++] = '.';
+    b64url_encode(mac, sizeof(mac), out + n);
+    free(payload);
+    return out;
+}
+
+/*
+ * Whole content of fd, NUL terminated
+ */
+static char *read_all(int fd, size_t *len) {
+    struct stat st;
+    ssize_t n = 0;
+    char *buf;
+
+    if (fstat(fd, &st) == -1)
+        err(EXIT_FAILURE, "fstat");
+    if ((buf = malloc((size_t) st.st_size + 1)) == NULL)
+        err(EXIT_FAILURE, "malloc");
+    *len = 0;
+    while (*len < (size_t) st.st_size && (n = pread(fd, buf + *len, (size_t) st.st_size - *len, (off_t) *len)) > 0)
+        *len += (size_t) n;
+    if (n == -1)
+        err(EXIT_FAILURE, "pread");
+    buf[*len] = '\0';
+    return buf;
+}
+
+static bool revoked(const char *digest, const struct token *tok) {
+    int fd;
+    size_t len;
+    char *buf, *line, *next, *end, *name;
+    int64_t until, cutoff, now = time(NULL);
+    bool found = false;
+
+    if ((fd = open(TOKEN_REVOKED, O_RDONLY)) == -1) {
+        if (errno == ENOENT)
+            return false;
+        err(EXIT_FAILURE, "open");
+    }
+    if (flock(fd, LOCK_SH) == -1)
+        err(EXIT_FAILURE, "flock");
+    buf = read_all(fd, &len);
+    close(fd);
+
+    for (line = buf; !found && (next = strchr(line, '\n')) != NULL; line = next) {
+        *next++ = '\0';
+        until = strtoll(line, &end, 10);
+        if (until < now || end[0] != ' ' || end[1] == '\0' || end[2] != ' ')
+            continue;
+        cutoff = strtoll(end + 3, &name, 10);
+        if (*name++ != ' ')
+            continue;
+        switch (end[1]) {
+            case REVOKE_SESSION:
+                found = strcmp(name, digest) == 0;
+                break;
+            case REVOKE_ACCOUNT:
+                found = tok->issued <= cutoff && strcmp(name, tok->UUID) == 0;
+                break;
+            case REVOKE_ROLE:
+                found = tok->issued <= cutoff && strcmp(name, tok->role) == 0;
+                break;
+            case REVOKE_CAMPUS:
+                found = tok->issued <= cutoff && strcmp(name, tok->campus) == 0;
+                break;
+            default:
+                break;
+        }
+    }
+    free(buf);
+    return found;
+}
+
+enum token_status token_verify(const char *cookie, const char *digest, struct token *tok) {
+    const char *dot, *sig;
+    char expected[SIGLEN + 1], *fields[TOKEN_FIELDS], *payload, *p;
+    uint8_t mac[SHA256_DIGEST_LENGTH], diff = 0;
+    struct token found;
+    size_t fieldsz = 0, enclen;
+    ssize_t len;
+    bool ok;
+
+    if (strncmp(cookie, TOKEN_VERSION, sizeof(TOKEN_VERSION) - 1) != 0)
+        return TOKEN_OPAQUE;
+    if (!load_key() || (dot = strrchr(cookie, '.')) < cookie + sizeof(TOKEN_VERSION) - 1)
+        return TOKEN_INVALID;
+    if (strlen(sig = dot + 1) != SIGLEN)
+        return TOKEN_INVALID;
+    hmac_sha256(cookie, (size_t) (dot - cookie), mac);
+    b64url_encode(mac, sizeof(mac), expected);
+    for (size_t i = 0; i < SIGLEN; ++i)
+        diff |= (uint8_t) (expected[i] ^ sig[i]);
+    if (diff != 0)
+        return TOKEN_INVALID;
+
+    enclen = (size_t) (dot - cookie) - (sizeof(TOKEN_VERSION) - 1);
+    if ((payload = malloc(enclen + 1)) == NULL)
+        err(EXIT_FAILURE, "malloc");
+    if ((len = b64url_decode(cookie + sizeof(TOKEN_VERSION) - 1, enclen, (uint8_t *) payload)) == -1) {
+        free(payload);
+        return TOKEN_INVALID;
+    }
+    payload[len] = '\0';
+    for (p = payload; fieldsz < TOKEN_FIELDS; ++fieldsz) {
+        fields[fieldsz] = p;
+        if ((p = strchr(p, '\n')) == NULL) {
+            fieldsz++;
+            break;
+        }
+        *p++ = '\0';
+    }
+    if (fieldsz != TOKEN_FIELDS || p != NULL) {
+        free(payload);
+        return TOKEN_INVALID;
+    }
+    found = (struct token){
+        .UUID = fields[0],
+        .disp_name = fields[1],
+        .campus = fields[2],
+        .role = fields[3],
+        .perms = (int) strtol(fields[4], NULL, 10),
+        .frozen = strtol(fields[5], NULL, 10) != 0,
+        .issued = strtoll(fields[6], NULL, 10),
+        .expires = strtoll(fields[7], NULL, 10)
+    };
+    if ((ok = found.expires > time(NULL) && !revoked(digest, &found))) {
+        *tok = found;
+        if ((tok->UUID = strdup(found.UUID)) == NULL || (tok->disp_name = strdup(found.disp_name)) == NULL ||
+            (tok->campus = strdup(found.campus)) == NULL || (tok->role = strdup(found.role)) == NULL)
+            err(EXIT_FAILURE, "strdup");
+    }
+    free(payload);
+    return ok ? TOKEN_VALID : TOKEN_INVALID;
+}
+
+void token_revoke(enum token_scope scope, const char *name) {
+    int fd, entrylen;
+    size_t len, kept = 0;
+    char *buf, *line, *next, *entry;
+    off_t size;
+    int64_t now = time(NULL);
+
+    if (!load_key() || strchr(name, '\n') != NULL)
+        return; /* no signed token can carry it */
+    entry = format(&entrylen, "%" PRId64 " %c %" PRId64 " %s\n", now + TOKEN_MAX_AGE, scope, now, name);
+    if ((fd = open(TOKEN_REVOKED, O_RDWR | O_CREAT, 0600)) == -1)
+        err(EXIT_FAILURE, "open");
+    if (flock(fd, LOCK_EX) == -1)
+        err(EXIT_FAILURE, "flock");
+    if ((size = lseek(fd, 0, SEEK_END)) == -1)
+        err(EXIT_FAILURE, "lseek");
+    if (size > REVOKED_COMPACT) {
+        // Rewritten in place and truncated afterwards, a crash in between only leaves stale lines behind
+        buf = read_all(fd, &len);
+        for (line = buf; (next = strchr(line, '\n')) != NULL; line = next) {
+            next++;
+            if (strtoll(line, NULL, 10) >= now) {
+                memmove(buf + kept, line, (size_t) (next - line));
+                kept += (size_t) (next - line);
+            }
+        }
+        if (pwrite(fd, buf, kept, 0) != (ssize_t) kept)
+            err(EXIT_FAILURE, "pwrite");
+        if (ftruncate(fd, (off_t) kept) == -1)
+            err(EXIT_FAILURE, "ftruncate");
+        size = (off_t) kept;
+        free(buf);
+    }
+    if (pwrite(fd, entry, (size_t) entrylen, size) != entrylen)
+        err(EXIT_FAILURE, "pwrite");
+    close(fd);
+    free(entry);
+}
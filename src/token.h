@@ -0,0 +1,78 @@
+#ifndef TOKEN_H
+#define TOKEN_H
+
+#include <stdbool.h>
+#include <stddef.h> /* size_t */
+#include <stdint.h> /* uint8_t, int64_t */
+
+/*
+ * Signing key of the stateless session tokens, signed tokens are only issued when this file
+ * exists and holds at least TOKEN_KEY_MIN bytes (see `make install-token-key`).
+ */
+#define TOKEN_KEY "db/token.key"
+#define TOKEN_KEY_MIN 32
+/*
+ * Revocation list, one "<until> <scope> <cutoff> <name>" line per entry, see token_revoke()
+ */
+#define TOKEN_REVOKED "db/revoked"
+/*
+ * Longest lifetime of a token, how long revocation entries must be kept
+ */
+#define TOKEN_MAX_AGE (7 * 24 * 60 * 60)
+
+/*
+ * Account fields carried by a signed token, the same ones fill_user() reads from the database
+ */
+struct token {
+    char *UUID;
+    char *disp_name;
+    char *campus;
+    char *role;
+    int perms;
+    bool frozen;
+    int64_t issued;
+    int64_t expires;
+};
+
+enum token_status {
+    TOKEN_OPAQUE, /* a random session ID, to be looked up in SESSIONS */
+    TOKEN_VALID,
+    TOKEN_INVALID /* forged, expired or revoked */
+};
+
+/*
+ * What a revocation entry applies to: one session (by its SHA-256 digest) or every token issued
+ * up to now for an account, a role or a campus.
+ */
+enum token_scope {
+    REVOKE_SESSION = 'S',
+    REVOKE_ACCOUNT = 'A',
+    REVOKE_ROLE = 'R',
+    REVOKE_CAMPUS = 'C'
+};
+
+/*
+ * Unpadded base64url encoding of len bytes, out must have room for (len * 4 + 2) / 3 + 1 bytes.
+ * Returns the length of the encoded string.
+ */
+size_t b64url_encode(const uint8_t *in, size_t len, char *out);
+
+/*
+ * Signs tok into "v1.<payload>.<signature>", returns NULL when no key is installed or a field
+ * cannot be carried (it contains a newline). The result must be freed by the caller.
+ */
+char *token_issue(const struct token *tok);
+
+/*
+ * Checks the signature, expiry and revocation of a session cookie whose SHA-256 (hex) is digest.
+ * On TOKEN_VALID the fields of tok are allocated and owned by the caller.
+ */
+enum token_status token_verify(const char *cookie, const char *digest, struct token *tok);
+
+/*
+ * Appends a revocation entry, expired entries are dropped once the list grows past a few pages.
+ * Nothing is recorded while signed tokens are disabled.
+ */
+void token_revoke(enum token_scope scope, const char *name);
+
+#endif